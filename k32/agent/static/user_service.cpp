@@ -6,6 +6,8 @@
 #include "user_service.hpp"
 #include "../globals.hpp"
 #include "../../common/static/service.hpp"
+#include "../../common/base/msgpack.hpp"
+#include "../../common/base/role_digest.hpp"
 #include <poseidon/base/config_file.hpp>
 #include <poseidon/easy/easy_hws_server.hpp>
 #include <poseidon/easy/easy_timer.hpp>
@@ -16,22 +18,90 @@
 #include <poseidon/fiber/mysql_query_future.hpp>
 #include <poseidon/mysql/mysql_connection.hpp>
 #include <poseidon/static/mysql_connector.hpp>
+#include <poseidon/fiber/abstract_future.hpp>
 #include <asteria/rocket/ascii_numget.hpp>
+#include <algorithm>
+#include <deque>
 namespace k32::agent {
 namespace {
 
 const cow_dictionary<User_Record> empty_user_map;
 
+// Topics whose names begin with this prefix are chat threads, and messages
+// that are appended to them will be published by chat servers.
+constexpr char chat_topic_prefix[] = "chat:";
+
+struct WS_Authenticator
+  {
+    User_Service::ws_authenticator_type handler;
+    User_WS_Encoding encoding = user_ws_encoding_json;
+  };
+
+struct Bandwidth_Counters
+  {
+    uint64_t messages_in = 0;
+    uint64_t bytes_in = 0;
+    uint64_t messages_out = 0;
+    uint64_t bytes_out = 0;
+  };
+
+class Login_Ticket
+  :
+    public ::poseidon::Abstract_Future
+  {
+  public:
+    wkptr<::poseidon::WS_Server_Session> weak_session;
+    User_WS_Encoding encoding = user_ws_encoding_json;
+    bool admitted = false;
+    bool abandoned = false;
+
+  private:
+    virtual
+    void
+    do_on_abstract_future_initialize()
+      override
+      { }
+
+  public:
+    Login_Ticket() = default;
+    Login_Ticket(const Login_Ticket&) = delete;
+    Login_Ticket& operator=(const Login_Ticket&) = delete;
+
+    void
+    wake()
+      { this->do_abstract_future_initialize_once();  }
+  };
+
+struct User_Cache_Entry
+  {
+    system_time creation_time;
+    system_time logout_time;
+    system_time banned_until;
+    steady_time expiry_time;
+  };
+
+struct Role_List_Cache_Entry
+  {
+    uint64_t version = 0;
+    bool valid = false;
+    steady_time expiry_time;
+    cow_int64_dictionary<cow_string> raw_avatars;
+    cow_int64_dictionary<cow_string> encoded_avatars[2];  // indexed by encoding
+  };
+
 struct User_Connection
   {
     wkptr<::poseidon::WS_Server_Session> weak_session;
+    User_WS_Encoding encoding = user_ws_encoding_json;
     steady_time rate_time;
     steady_time pong_time;
     int rate_counter = 0;
 
     int64_t current_roid = 0;
     ::poseidon::UUID current_logic_srv;
-    cow_int64_dictionary<::taxon::V_object> cached_raw_avatars;
+    cow_int64_dictionary<cow_string> cached_raw_avatars;
+    cow_int64_dictionary<cow_string> cached_encoded_avatars;
+    cow_vector<phcow_string> topics;
   };
 
 struct Implementation
@@ -42,13 +112,22 @@ struct Implementation
     uint16_t max_number_of_roles_per_user = 0;
     uint8_t nickname_length_limits[2] = { };
     seconds client_ping_interval;
+    uint32_t login_concurrency_limits[2] = { };
+    milliseconds login_target_latency;
+    seconds user_cache_ttl;
+    uint32_t logout_batch_size;
+    seconds role_list_cache_ttl;
 
     cow_dictionary<User_Service::http_handler_type> http_handlers;
-    cow_dictionary<User_Service::ws_authenticator_type> ws_authenticators;
+    cow_dictionary<WS_Authenticator> ws_authenticators;
     cow_dictionary<User_Service::ws_handler_type> ws_handlers;
 
     ::poseidon::Easy_Timer ping_timer;
     ::poseidon::Easy_Timer check_user_timer;
+    ::poseidon::Easy_Timer role_digest_timer;
+    ::poseidon::Easy_Timer login_queue_timer;
+    ::poseidon::Easy_Timer logout_flush_timer;
+    ::poseidon::Easy_Timer chat_subscription_timer;
     ::poseidon::Easy_HWS_Server user_server;
 
     // connections from clients
@@ -56,6 +135,35 @@ struct Implementation
     cow_dictionary<User_Record> users;
     cow_dictionary<User_Connection> connections;
     ::std::vector<phcow_string> expired_username_list;
+    cow_dictionary<User_Cache_Entry> user_cache;
+    cow_dictionary<system_time> pending_logout_times;
+    bool exit_logouts_recorded = false;
+
+    // role lists of users, which are invalidated by monitors
+    cow_dictionary<Role_List_Cache_Entry> role_list_cache;
+    uint64_t role_list_version = 0;
+
+    // digests of online roles that have been sent to logic servers
+    cow_uuid_dictionary<Role_Digest> sent_role_digests;
+    steady_time role_digest_sync_time;
+
+    // topic subscriptions of clients
+    cow_dictionary<cow_dictionary<wkptr<::poseidon::WS_Server_Session>>> topic_subscribers;
+
+    // chat threads that have been sent to chat servers, and those servers
+    ::std::vector<cow_string> sent_chat_thread_keys;
+    ::std::vector<::poseidon::UUID> sent_chat_services;
+    steady_time chat_subscription_sync_time;
+
+    // traffic statistics, indexed by encoding
+    Bandwidth_Counters bandwidth[2];
+
+    // login admission control
+    double login_concurrency = 0;
+    uint32_t login_active_count = 0;
+    double login_latency_ewma = 0;
+    steady_time login_last_decrease;
+    ::std::deque<shptr<Login_Ticket>> login_queue;
   };
 
 phcow_string
@@ -74,6 +182,166 @@ do_get_username(const shptr<Implementation>& impl, const shptr<::poseidon::WS_Se
     return it->first;
   }
 
+void
+do_encode_client_message(cow_string& str, User_WS_Encoding encoding, const ::taxon::V_object& obj)
+  {
+    if(encoding == user_ws_encoding_msgpack)
+      msgpack_encode(str, obj);
+    else
+      ::taxon::Value(obj).print_to(str, ::taxon::option_json_mode);
+  }
+
+void
+do_parse_raw_avatar(::taxon::V_object& avatar, const cow_string& raw_avatar)
+  {
+    // Mind a fresh role (that has just been created but has not been loaded yet),
+    // whose avatar is an empty string.
+    avatar.clear();
+    if(raw_avatar.empty())
+      return;
+
+    ::taxon::Value temp_value;
+    POSEIDON_CHECK(temp_value.parse(raw_avatar));
+    avatar = temp_value.as_object();
+  }
+
+bool
+do_send_client_message(const shptr<Implementation>& impl,
+                       const shptr<::poseidon::WS_Server_Session>& session,
+                       User_WS_Encoding encoding, const cow_string& str)
+  {
+    auto& counters = impl->bandwidth[encoding];
+    counters.messages_out ++;
+    counters.bytes_out += str.size();
+
+    if(encoding == user_ws_encoding_msgpack)
+      return session->ws_send(::poseidon::ws_BINARY, str);
+    else
+      return session->ws_send(::poseidon::ws_TEXT, str);
+  }
+
+bool
+do_send_login_queue_position(const shptr<Implementation>& impl, const Login_Ticket& ticket,
+                             size_t position)
+  {
+    auto session = ticket.weak_session.lock();
+    if(!session)
+      return false;
+
+    ::taxon::V_object obj;
+    obj.try_emplace(&"%opcode", &"ntfy/login/queue");
+    obj.try_emplace(&"position", static_cast<int64_t>(position));
+
+    cow_string str;
+    do_encode_client_message(str, ticket.encoding, obj);
+    return do_send_client_message(impl, session, ticket.encoding, str);
+  }
+
+void
+do_login_admit_queued(const shptr<Implementation>& impl)
+  {
+    while(!impl->login_queue.empty()
+          && (impl->login_active_count < static_cast<uint32_t>(impl->login_concurrency))) {
+      auto ticket = move(impl->login_queue.front());
+      impl->login_queue.pop_front();
+
+      // Don't give a slot to a client that has gone away.
+      if(ticket->weak_session.expired()) {
+        ticket->abandoned = true;
+        ticket->wake();
+        continue;
+      }
+
+      ticket->admitted = true;
+      impl->login_active_count ++;
+      ticket->wake();
+    }
+  }
+
+void
+do_login_abandon(const shptr<Implementation>& impl,
+                 const shptr<::poseidon::WS_Server_Session>& session)
+  {
+    // Remove the ticket of a client that has gone away, and wake its fiber up
+    // so it can exit. This doesn't wait for the queue timer.
+    for(auto it = impl->login_queue.begin();  it != impl->login_queue.end();  ++it)
+      if((*it)->weak_session.lock() == session) {
+        auto ticket = move(*it);
+        impl->login_queue.erase(it);
+
+        ticket->abandoned = true;
+        ticket->wake();
+        break;
+      }
+  }
+
+void
+do_login_observe_latency(const shptr<Implementation>& impl, steady_clock::duration latency)
+  {
+    double sample = duration_cast<duration<double, ::std::milli>>(latency).count();
+    impl->login_latency_ewma += (sample - impl->login_latency_ewma) * 0.125;
+  }
+
+void
+do_login_release(const shptr<Implementation>& impl)
+  {
+    ASTERIA_ASSERT(impl->login_active_count > 0);
+    impl->login_active_count --;
+
+    // Adapt concurrency to backend latency: increase it additively while the
+    // backends keep up, and halve it when they are overloaded, at most once
+    // per target latency.
+    auto now = steady_clock::now();
+    double target = static_cast<double>(impl->login_target_latency.count());
+    if(impl->login_latency_ewma <= target)
+      impl->login_concurrency += 1;
+    else if(now - impl->login_last_decrease >= impl->login_target_latency) {
+      impl->login_concurrency /= 2;
+      impl->login_last_decrease = now;
+      POSEIDON_LOG_DEBUG(("Login latency `$1` ms exceeded target; concurrency limit now `$2`"),
+                         impl->login_latency_ewma, impl->login_concurrency);
+    }
+
+    impl->login_concurrency = ::rocket::clamp(impl->login_concurrency,
+                                   static_cast<double>(impl->login_concurrency_limits[0]),
+                                   static_cast<double>(impl->login_concurrency_limits[1]));
+
+    do_login_admit_queued(impl);
+  }
+
+class Login_Slot_Guard
+  {
+  private:
+    shptr<Implementation> m_impl;
+
+  public:
+    explicit
+    Login_Slot_Guard(const shptr<Implementation>& impl)
+      {
+        this->m_impl = impl;
+      }
+
+    Login_Slot_Guard(const Login_Slot_Guard&) = delete;
+    Login_Slot_Guard& operator=(const Login_Slot_Guard&) = delete;
+
+    ~Login_Slot_Guard()
+      {
+        do_login_release(this->m_impl);
+      }
+  };
+
+void
+do_unsubscribe_all_topics(const shptr<Implementation>& impl, const phcow_string& username,
+                          const User_Connection& uconn)
+  {
+    for(const auto& topic : uconn.topics)
+      if(auto psubs = impl->topic_subscribers.mut_ptr(topic)) {
+        psubs->erase(username);
+        if(psubs->empty())
+          impl->topic_subscribers.erase(topic);
+      }
+  }
+
 ::poseidon::UUID
 do_find_my_monitor()
   {
@@ -90,6 +358,30 @@ do_find_my_monitor()
   }
 
 void
+do_invalidate_user_cache_on_other_agents(const phcow_string& username)
+  {
+    // Other agents may have cached properties of this user. Notify all of them
+    // in this zone. This is a best-effort notification, so there is no need to
+    // wait for responses.
+    cow_vector<::poseidon::UUID> multicast_list;
+    for(const auto& r : service.all_service_records())
+      if((r.second.zone_id == service.zone_id()) && (r.second.service_type == "agent")
+            && (r.first != service.service_uuid()))
+        multicast_list.emplace_back(r.first);
+
+    if(multicast_list.empty())
+      return;
+
+    ::taxon::V_object tx_args;
+    tx_args.try_emplace(&"username", username.rdstr());
+
+    auto srv_q = new_sh<Service_Future>(multicast_list, &"agent/user/invalidate_cache", tx_args);
+    service.launch(srv_q);
+  }
+
+// Returns the time spent on the Redis query, excluding kicking the user from
+// another agent, for the login admission control.
+steady_clock::duration
 do_publish_user_on_redis(::poseidon::Abstract_Fiber& fiber, const User_Record& uinfo, seconds ttl)
   {
     cow_vector<cow_string> redis_cmd;
@@ -100,9 +392,11 @@ do_publish_user_on_redis(::poseidon::Abstract_Fiber& fiber, const User_Record& u
     redis_cmd.emplace_back(&"EX");
     redis_cmd.emplace_back(sformat("$1", ttl.count()));
 
+    steady_time query_time = steady_clock::now();
     auto task2 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
     ::poseidon::task_scheduler.launch(task2);
     fiber.yield(task2);
+    auto latency = steady_clock::now() - query_time;
 
     if(!task2->result().is_nil()) {
       User_Record old_uinfo;
@@ -123,6 +417,7 @@ do_publish_user_on_redis(::poseidon::Abstract_Fiber& fiber, const User_Record& u
     }
 
     POSEIDON_LOG_TRACE(("Published user `$1` on Redis"), uinfo.username);
+    return latency;
   }
 
 void
@@ -191,19 +486,42 @@ do_welcome_client(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber&
     if(impl->connections.at(username).current_roid != 0)
       return;
 
+    cow_vector<::poseidon::UUID> multicast_list;
     if(impl->connections.at(username).cached_raw_avatars.size() > 0) {
-      // In case there's an online role, try reconnecting.
+      // Look up owners of roles. A role that is online is owned by the logic
+      // service where it has been logged in.
+      cow_vector<cow_string> redis_cmd;
+      redis_cmd.emplace_back(&"MGET");
+      for(const auto& r : impl->connections.at(username).cached_raw_avatars)
+        redis_cmd.emplace_back(sformat("$1/role_owner/$2", service.application_name(), r.first));
+
+      auto task2 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
+      ::poseidon::task_scheduler.launch(task2);
+      fiber.yield(task2);
+
+      for(const auto& r : task2->result().as_array())
+        if(!r.is_nil()) {
+          ::poseidon::UUID logic_service_uuid(r.as_string());
+          if(service.find_service_record_opt(logic_service_uuid)
+             && ::std::none_of(multicast_list.begin(), multicast_list.end(),
+                               [&](const ::poseidon::UUID& x) { return x == logic_service_uuid;  }))
+            multicast_list.emplace_back(logic_service_uuid);
+        }
+    }
+
+    if(impl->connections.at(username).current_roid != 0)
+      return;
+
+    if(multicast_list.size() > 0) {
+      // In case there's an online role, try reconnecting. At most one can be
+      // online, so stop waiting as soon as it is found.
       ::taxon::V_object tx_args;
       tx_args.try_emplace(&"agent_srv", service.service_uuid().to_string());
       for(const auto& r : impl->connections.at(username).cached_raw_avatars)
         tx_args.open(&"roid_list").open_array().emplace_back(r.first);
 
-      cow_vector<::poseidon::UUID> multicast_list;
-      for(const auto& r : service.all_service_records())
-        if(r.second.service_type == "logic")
-          multicast_list.emplace_back(r.first);
-
       auto srv_q = new_sh<Service_Future>(multicast_list, &"logic/role/reconnect", tx_args);
+      srv_q->set_any_of(true);
       service.launch(srv_q);
       fiber.yield(srv_q);
 
@@ -244,16 +562,115 @@ do_welcome_client(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber&
 
     // No role is online. No role is being created. Send my role list to the
     // client, so the user may select an existing role, or create a new one.
-    ::taxon::V_array avatar_list;
-    for(const auto& r : impl->connections.at(username).cached_raw_avatars)
-      avatar_list.emplace_back(r.second);
+    // Avatars have been encoded for this client when the list was fetched, so
+    // they are spliced into the message verbatim.
+    User_WS_Encoding encoding = impl->connections.at(username).encoding;
+    const auto& encoded_avatars = impl->connections.at(username).cached_encoded_avatars;
+    cow_string str;
 
-    ::taxon::V_object tx_args;
-    tx_args.try_emplace(&"%opcode", &"ntfy/role/list");
-    tx_args.try_emplace(&"avatar_list", avatar_list);
+    if(encoding == user_ws_encoding_msgpack) {
+      msgpack_put_map_header(str, 2);
+      msgpack_put_string(str, "%opcode");
+      msgpack_put_string(str, "ntfy/role/list");
+      msgpack_put_string(str, "avatar_list");
+      msgpack_put_array_header(str, encoded_avatars.size());
+      for(const auto& r : encoded_avatars)
+        str += r.second;
+    }
+    else {
+      str += "{\"%opcode\":\"ntfy/role/list\",\"avatar_list\":[";
+      for(const auto& r : encoded_avatars) {
+        if(str.back() != '[')
+          str += ',';
+        str += r.second;
+      }
+      str += "]}";
+    }
 
-    auto str = ::taxon::Value(tx_args).to_string(::taxon::option_json_mode);
-    session->ws_send(::poseidon::ws_TEXT, str);
+    do_send_client_message(impl, session, encoding, str);
+  }
+
+void
+do_make_logout_time_batch(cow_string& stmt, cow_vector<::poseidon::MySQL_Value>& sql_args,
+                          cow_dictionary<system_time>::const_iterator& it,
+                          cow_dictionary<system_time>::const_iterator end, uint32_t batch_size)
+  {
+    // Users should always exist, but all columns are required by `INSERT`.
+    stmt = &R"!!!(
+          INSERT INTO `user`
+            (`username`, `login_address`, `creation_time`, `login_time`,
+             `logout_time`, `banned_until`)
+            VALUES )!!!";
+
+    sql_args.clear();
+    for(uint32_t k = 0;  (k != batch_size) && (it != end);  ++k) {
+      if(k != 0)
+        stmt += ", ";
+      stmt += "(?, '', ?, ?, ?, '1999-01-01')";
+
+      sql_args.emplace_back(it->first.rdstr());   // `username`
+      sql_args.emplace_back(it->second);          // `creation_time`
+      sql_args.emplace_back(it->second);          // `login_time`
+      sql_args.emplace_back(it->second);          // `logout_time`
+      ++ it;
+    }
+
+    stmt += R"!!!(
+            ON DUPLICATE KEY
+            UPDATE `logout_time` = VALUES(`logout_time`)
+        )!!!";
+  }
+
+void
+do_flush_logout_times(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber)
+  {
+    if(impl->pending_logout_times.empty())
+      return;
+
+    // Take all pending writes, so new ones can be added while we are waiting
+    // for MySQL.
+    cow_dictionary<system_time> pending_logout_times;
+    pending_logout_times.swap(impl->pending_logout_times);
+
+    cow_vector<shptr<::poseidon::MySQL_Query_Future>> tasks;
+    ::std::vector<cow_dictionary<system_time>::const_iterator> task_begins;
+    cow_dictionary<system_time>::const_iterator it = pending_logout_times.begin();
+    while(it != pending_logout_times.end()) {
+      task_begins.push_back(it);
+      cow_string stmt;
+      cow_vector<::poseidon::MySQL_Value> sql_args;
+      do_make_logout_time_batch(stmt, sql_args, it, pending_logout_times.end(),
+                                impl->logout_batch_size);
+
+      auto task2 = new_sh<::poseidon::MySQL_Query_Future>(::poseidon::mysql_connector,
+                                  ::poseidon::mysql_connector.allocate_tertiary_connection(),
+                                  stmt, sql_args);
+      ::poseidon::task_scheduler.launch(task2);
+      tasks.emplace_back(task2);
+    }
+    task_begins.push_back(pending_logout_times.end());
+
+    for(const auto& task2 : tasks)
+      fiber.yield(task2);
+
+    // Put failed writes back, so they will be retried. If a user has logged
+    // out again in the meantime, the newer time is kept.
+    size_t failed_count = 0;
+    for(size_t k = 0;  k != tasks.size();  ++k)
+      if(!tasks[k]->successful())
+        for(it = task_begins[k];  it != task_begins[k + 1];  ++it) {
+          impl->pending_logout_times.try_emplace(it->first, it->second);
+          failed_count ++;
+        }
+
+    if(failed_count != 0) {
+      POSEIDON_LOG_ERROR(("Could not flush logout time of $1 user(s); will retry"),
+                         failed_count);
+      return;
+    }
+
+    POSEIDON_LOG_DEBUG(("Flushed logout time of $1 user(s) in $2 batch(es)"),
+                       pending_logout_times.size(), tasks.size());
   }
 
 void
@@ -278,18 +695,42 @@ do_server_hws_callback(const shptr<Implementation>& impl,
           }
 
           // Copy the authenticator, in case of fiber context switches.
-          User_Service::ws_authenticator_type authenticator;
+          WS_Authenticator authenticator;
           impl->ws_authenticators.find_and_copy(authenticator, path);
-          if(!authenticator) {
+          if(!authenticator.handler) {
             session->ws_shut_down(user_ws_status_authentication_failure);
             return;
           }
 
+          // Wait for my turn, so backends will not be overwhelmed by a login
+          // storm. Clients in the queue are notified of their positions.
+          auto ticket = new_sh<Login_Ticket>();
+          ticket->weak_session = session;
+          ticket->encoding = authenticator.encoding;
+
+          if(impl->login_queue.empty()
+             && (impl->login_active_count < static_cast<uint32_t>(impl->login_concurrency))) {
+            ticket->admitted = true;
+            impl->login_active_count ++;
+          }
+          else {
+            impl->login_queue.push_back(ticket);
+            do_send_login_queue_position(impl, *ticket, impl->login_queue.size());
+
+            while(!ticket->admitted && !ticket->abandoned)
+              fiber.yield(ticket);
+
+            if(ticket->abandoned)
+              return;
+          }
+
+          const Login_Slot_Guard login_slot_guard(impl);
+
           // Call the user-defined authenticator to get the username.
           User_Record uinfo;
           uinfo._agent_srv = service.service_uuid();
           try {
-            authenticator(fiber, uinfo.username, cow_string(uri.query));
+            authenticator.handler(fiber, uinfo.username, cow_string(uri.query));
           }
           catch(exception& stdex) {
             POSEIDON_LOG_ERROR(("Unhandled exception in `$1 $2`: $3"), path, uri.query, stdex);
@@ -306,11 +747,58 @@ do_server_hws_callback(const shptr<Implementation>& impl,
           POSEIDON_LOG_INFO(("Authenticated `$1` from `$2`"), uinfo.username, session->remote_address());
           session->mut_session_user_data() = uinfo.username.rdstr();
 
-          // Create the user if one doesn't exist. Ensure they can only log in
-          // on a single instance.
+          // Record login information.
           uinfo.login_address = session->remote_address();
           uinfo.login_time = system_clock::now();
 
+          // Get properties of this user. If they have logged in recently, use
+          // cached data and skip the read.
+          User_Cache_Entry cached;
+          if(!impl->user_cache.find_and_copy(cached, uinfo.username)
+             || (steady_clock::now() >= cached.expiry_time)) {
+            static constexpr char select_from_user[] =
+                R"!!!(
+                  SELECT `creation_time`
+                         , `logout_time`
+                         , `banned_until`
+                    FROM `user`
+                    WHERE `username` = ?
+                )!!!";
+
+            cow_vector<::poseidon::MySQL_Value> sql_args;
+            sql_args.emplace_back(uinfo.username.rdstr());
+
+            steady_time query_time = steady_clock::now();
+            auto task1 = new_sh<::poseidon::MySQL_Query_Future>(::poseidon::mysql_connector,
+                                        ::poseidon::mysql_connector.allocate_tertiary_connection(),
+                                        &select_from_user, sql_args);
+            ::poseidon::task_scheduler.launch(task1);
+            fiber.yield(task1);
+            do_login_observe_latency(impl, steady_clock::now() - query_time);
+
+            if(task1->result_row_count() == 0) {
+              // This is a new user, which will be created below.
+              cached.creation_time = uinfo.login_time;
+              cached.logout_time = uinfo.login_time;
+              cached.banned_until = system_time();
+            }
+            else {
+              cached.creation_time = task1->result_row(0).at(0).as_system_time();   // SELECT `creation_time`
+              cached.logout_time = task1->result_row(0).at(1).as_system_time();     //        , `logout_time`
+              cached.banned_until = task1->result_row(0).at(2).as_system_time();    //        , `banned_until`
+            }
+
+            cached.expiry_time = steady_clock::now() + impl->user_cache_ttl;
+            impl->user_cache.insert_or_assign(uinfo.username, cached);
+          }
+
+          uinfo.creation_time = cached.creation_time;
+          uinfo.logout_time = cached.logout_time;
+          uinfo.banned_until = cached.banned_until;
+
+          // Create the user if one doesn't exist, and update login information.
+          // This runs while the role list is being fetched, and is waited for
+          // before the user is admitted, so it adds no round-trip in most cases.
           static constexpr char insert_into_user[] =
               R"!!!(
                 INSERT INTO `user`
@@ -334,39 +822,10 @@ do_server_hws_callback(const shptr<Implementation>& impl,
           sql_args.emplace_back(uinfo.login_address.to_string());   // UPDATE `login_address` = ?
           sql_args.emplace_back(uinfo.login_time);                  //        , `login_time` = ?
 
-          auto task1 = new_sh<::poseidon::MySQL_Query_Future>(::poseidon::mysql_connector,
+          auto task2 = new_sh<::poseidon::MySQL_Query_Future>(::poseidon::mysql_connector,
                                       ::poseidon::mysql_connector.allocate_tertiary_connection(),
                                       &insert_into_user, sql_args);
-          ::poseidon::task_scheduler.launch(task1);
-          fiber.yield(task1);
-
-          static constexpr char select_from_user[] =
-              R"!!!(
-                SELECT `creation_time`
-                       , `logout_time`
-                       , `banned_until`
-                  FROM `user`
-                  WHERE `username` = ?
-              )!!!";
-
-          sql_args.clear();
-          sql_args.emplace_back(uinfo.username.rdstr());
-
-          task1 = new_sh<::poseidon::MySQL_Query_Future>(::poseidon::mysql_connector,
-                                      ::poseidon::mysql_connector.allocate_tertiary_connection(),
-                                      &select_from_user, sql_args);
-          ::poseidon::task_scheduler.launch(task1);
-          fiber.yield(task1);
-
-          if(task1->result_row_count() == 0) {
-            POSEIDON_LOG_FATAL(("Could not find user `$1` in database"), uinfo.username);
-            session->ws_shut_down(::poseidon::ws_status_unexpected_error);
-            return;
-          }
-
-          uinfo.creation_time = task1->result_row(0).at(0).as_system_time();   // SELECT `creation_time`
-          uinfo.logout_time = task1->result_row(0).at(1).as_system_time();     //        , `logout_time`
-          uinfo.banned_until = task1->result_row(0).at(2).as_system_time();    //        , `banned_until`
+          ::poseidon::task_scheduler.launch(task2);
 
           if(uinfo.login_time < uinfo.banned_until) {
             POSEIDON_LOG_DEBUG(("User `$1` is banned until `$2`"), uinfo.username, uinfo.banned_until);
@@ -377,49 +836,91 @@ do_server_hws_callback(const shptr<Implementation>& impl,
           // Find my roles.
           User_Connection uconn;
           uconn.weak_session = session;
+          uconn.encoding = authenticator.encoding;
           uconn.rate_time = steady_clock::now();
           uconn.pong_time = uconn.rate_time;
 
-          ::taxon::V_object tx_args;
-          tx_args.try_emplace(&"username", uinfo.username.rdstr());
+          // If the role list is in cache, there is no need to bother the monitor.
+          Role_List_Cache_Entry rlc;
+          impl->role_list_cache.find_and_copy(rlc, uinfo.username);
+          if(rlc.valid && (steady_clock::now() < rlc.expiry_time)) {
+            uconn.cached_raw_avatars = rlc.raw_avatars;
+            uconn.cached_encoded_avatars = rlc.encoded_avatars[uconn.encoding];
+          }
+          else {
+            ::taxon::V_object tx_args;
+            tx_args.try_emplace(&"username", uinfo.username.rdstr());
 
-          auto srv_q = new_sh<Service_Future>(do_find_my_monitor(), &"monitor/role/list", tx_args);
-          service.launch(srv_q);
-          fiber.yield(srv_q);
+            auto srv_q = new_sh<Service_Future>(do_find_my_monitor(), &"monitor/role/list", tx_args);
+            service.launch(srv_q);
+            fiber.yield(srv_q);
 
-          if(srv_q->response(0).error != "") {
-            POSEIDON_LOG_WARN(("Could not list roles of `$1`: $2"), uinfo.username, srv_q->response(0).error);
-            session->ws_shut_down(::poseidon::ws_status_try_again_later);
-            return;
-          }
+            if(srv_q->response(0).error != "") {
+              POSEIDON_LOG_WARN(("Could not list roles of `$1`: $2"), uinfo.username, srv_q->response(0).error);
+              session->ws_shut_down(::poseidon::ws_status_try_again_later);
+              return;
+            }
 
-          for(const auto& r : srv_q->response(0).obj.at(&"raw_avatars").as_object()) {
-            // For intermediate servers, an avatar is transferred as a JSON
-            // string. We will not send a raw string to the client, so parse it.
-            // Mind a fresh role (that has just been created but has not been
-            // loaded yet), whose avatar is an empty string.
-            int64_t roid = 0;
-            ::asteria::ascii_numget numg;
-            POSEIDON_CHECK(numg.parse_DI(r.first.data(), r.first.length()) == r.first.length());
-            numg.cast_I(roid, 0, INT64_MAX);
-
-            ::taxon::V_object avatar;
-            if(r.second.as_string_length() > 0) {
-              ::taxon::Value temp_value;
-              POSEIDON_CHECK(temp_value.parse(r.second.as_string()));
-              avatar = temp_value.as_object();
+            rlc.encoded_avatars[0].clear();
+            rlc.encoded_avatars[1].clear();
+            for(const auto& r : srv_q->response(0).obj.at(&"raw_avatars").as_object()) {
+              // For intermediate servers, an avatar is transferred as a string
+              // in taxon's own format, which is not always valid JSON. Parse it
+              // only once, and encode it for both kinds of clients, so role lists
+              // can be sent without parsing avatars again. Mind a fresh role
+              // (that has just been created but has not been loaded yet), whose
+              // avatar is an empty string.
+              int64_t roid = 0;
+              ::asteria::ascii_numget numg;
+              POSEIDON_CHECK(numg.parse_DI(r.first.data(), r.first.length()) == r.first.length());
+              numg.cast_I(roid, 0, INT64_MAX);
+
+              ::taxon::V_object avatar;
+              do_parse_raw_avatar(avatar, r.second.as_string());
+              for(uint32_t enc = 0;  enc != 2;  ++enc)
+                do_encode_client_message(rlc.encoded_avatars[enc].open(roid),
+                                         static_cast<User_WS_Encoding>(enc), avatar);
+
+              POSEIDON_LOG_DEBUG(("Found role `$1` of user `$2`"), roid, uinfo.username);
+              uconn.cached_raw_avatars.try_emplace(roid, r.second.as_string());
             }
 
-            POSEIDON_LOG_DEBUG(("Found role `$1` of user `$2`"), roid, uinfo.username);
-            uconn.cached_raw_avatars.try_emplace(roid, avatar);
+            uconn.cached_encoded_avatars = rlc.encoded_avatars[uconn.encoding];
+
+            // Save the list into cache, unless it has been invalidated while we
+            // were waiting for the monitor.
+            auto pcached = impl->role_list_cache.ptr(uinfo.username);
+            if((pcached ? pcached->version : 0) == rlc.version) {
+              rlc.version = ++ impl->role_list_version;
+              rlc.valid = true;
+              rlc.expiry_time = steady_clock::now() + impl->role_list_cache_ttl;
+              rlc.raw_avatars = uconn.cached_raw_avatars;
+              impl->role_list_cache.insert_or_assign(uinfo.username, rlc);
+            }
+          }
+
+          fiber.yield(task2);
+          if(!task2->successful()) {
+            // The user may not exist in MySQL, so don't cache it.
+            POSEIDON_LOG_ERROR(("Could not update login information of `$1`"), uinfo.username);
+            impl->user_cache.erase(uinfo.username);
+            session->ws_shut_down(::poseidon::ws_status_try_again_later);
+            return;
           }
 
-          do_publish_user_on_redis(fiber, uinfo, impl->redis_role_ttl);
+          // Only the Redis query is timed. Kicking a user from another agent is
+          // not a sign of backend load.
+          auto redis_latency = do_publish_user_on_redis(fiber, uinfo, impl->redis_role_ttl);
+          do_login_observe_latency(impl, redis_latency);
 
-          if(auto ptr = impl->connections.ptr(uinfo.username))
+          if(auto ptr = impl->connections.ptr(uinfo.username)) {
             if(auto old_session = ptr->weak_session.lock())
               old_session->ws_shut_down(user_ws_status_login_conflict);
 
+            // Subscriptions are bound to the old session.
+            do_unsubscribe_all_topics(impl, uinfo.username, *ptr);
+          }
+
           impl->users.insert_or_assign(uinfo.username, uinfo);
           impl->connections.insert_or_assign(uinfo.username, uconn);
           POSEIDON_LOG_INFO(("`$1` connected from `$2`"), uinfo.username, session->remote_address());
@@ -435,8 +936,16 @@ do_server_hws_callback(const shptr<Implementation>& impl,
           if(username.empty())
             return;
 
+          User_WS_Encoding encoding = impl->connections.at(username).encoding;
+          auto& counters = impl->bandwidth[encoding];
+          counters.messages_in ++;
+          counters.bytes_in += data.size();
+
           ::taxon::Value temp_value;
-          POSEIDON_CHECK(temp_value.parse(data.data(), data.size(), ::taxon::option_json_mode));
+          if(encoding == user_ws_encoding_msgpack)
+            msgpack_decode(temp_value, data.data(), data.size());
+          else
+            POSEIDON_CHECK(temp_value.parse(data.data(), data.size(), ::taxon::option_json_mode));
           ::taxon::V_object request = temp_value.as_object();
           temp_value.clear();
 
@@ -485,10 +994,10 @@ do_server_hws_callback(const shptr<Implementation>& impl,
 
           // The client expects a response, so send it.
           response.try_emplace(&"%serial", serial);
-          temp_value = response;
 
-          auto str = temp_value.to_string(::taxon::option_json_mode);
-          session->ws_send(::poseidon::ws_TEXT, str);
+          cow_string str;
+          do_encode_client_message(str, encoding, response);
+          do_send_client_message(impl, session, encoding, str);
           break;
         }
 
@@ -505,12 +1014,16 @@ do_server_hws_callback(const shptr<Implementation>& impl,
 
       case ::poseidon::easy_hws_close:
         {
+          // If the client was waiting for its turn to log in, give up.
+          do_login_abandon(impl, session);
+
           const phcow_string username = do_get_username(impl, session);
           if(username.empty())
             return;
 
           User_Connection uconn;
           impl->connections.find_and_erase(uconn, username);
+          do_unsubscribe_all_topics(impl, username, uconn);
 
           if(uconn.current_roid != 0) {
             // Notify the logic server that the client has disconnected. If the
@@ -523,23 +1036,15 @@ do_server_hws_callback(const shptr<Implementation>& impl,
             fiber.yield(srv_q);
           }
 
-          // Update logout time.
-          static constexpr char update_user_logout_time[] =
-              R"!!!(
-                UPDATE `user`
-                  SET `logout_time` = ?
-                  WHERE `username` = ?
-              )!!!";
+          // Update logout time. Writes are batched. If this is the last user, it's
+          // likely that the service is being shut down, so flush them now.
+          system_time logout_time = system_clock::now();
+          if(auto pcached = impl->user_cache.mut_ptr(username))
+            pcached->logout_time = logout_time;
 
-          cow_vector<::poseidon::MySQL_Value> sql_args;
-          sql_args.emplace_back(system_clock::now());
-          sql_args.emplace_back(username.rdstr());
-
-          auto task2 = new_sh<::poseidon::MySQL_Query_Future>(::poseidon::mysql_connector,
-                                      ::poseidon::mysql_connector.allocate_tertiary_connection(),
-                                      &update_user_logout_time, sql_args);
-          ::poseidon::task_scheduler.launch(task2);
-          fiber.yield(task2);
+          impl->pending_logout_times.insert_or_assign(username, logout_time);
+          if((impl->pending_logout_times.size() >= impl->logout_batch_size) || impl->connections.empty())
+            do_flush_logout_times(impl, fiber);
 
           POSEIDON_LOG_INFO(("`$1` disconnected from `$2`"), username, session->remote_address());
           break;
@@ -869,8 +1374,29 @@ do_ping_timer_callback(const shptr<Implementation>& impl,
       impl->expired_username_list.pop_back();
 
       POSEIDON_LOG_DEBUG(("Unloading user information: $1"), username);
+      User_Connection uconn;
+      if(impl->connections.find_and_erase(uconn, username))
+        do_unsubscribe_all_topics(impl, username, uconn);
       impl->users.erase(username);
-      impl->connections.erase(username);
+    }
+
+    // Purge expired cache entries.
+    for(const auto& r : impl->user_cache)
+      if(now >= r.second.expiry_time)
+        impl->expired_username_list.emplace_back(r.first);
+
+    while(impl->expired_username_list.size() != 0) {
+      impl->user_cache.erase(impl->expired_username_list.back());
+      impl->expired_username_list.pop_back();
+    }
+
+    for(const auto& r : impl->role_list_cache)
+      if(now >= r.second.expiry_time)
+        impl->expired_username_list.emplace_back(r.first);
+
+    while(impl->expired_username_list.size() != 0) {
+      impl->role_list_cache.erase(impl->expired_username_list.back());
+      impl->expired_username_list.pop_back();
     }
   }
 
@@ -896,6 +1422,155 @@ do_check_user_timer_callback(const shptr<Implementation>& impl,
     }
   }
 
+void
+do_role_digest_timer_callback(const shptr<Implementation>& impl,
+                              const shptr<::poseidon::Abstract_Timer>& /*timer*/,
+                              ::poseidon::Abstract_Fiber& /*fiber*/, steady_time now)
+  {
+    // Calculate digests of online roles, grouped by logic service.
+    cow_uuid_dictionary<Role_Digest> role_digests;
+    for(const auto& r : impl->connections)
+      if(r.second.current_roid != 0)
+        role_digests.open(r.second.current_logic_srv).add(r.first, r.second.current_roid);
+
+    // If all roles have gone away from a logic service, it shall be notified,
+    // too. Once in a while, send digests to all logic services in this zone, in
+    // case a previous one has been lost.
+    cow_uuid_dictionary<Role_Digest> old_role_digests;
+    old_role_digests.swap(impl->sent_role_digests);
+    for(const auto& r : old_role_digests)
+      role_digests.open(r.first);
+
+    bool send_all = now - impl->role_digest_sync_time >= 1min;
+    if(send_all) {
+      impl->role_digest_sync_time = now;
+      for(const auto& r : service.all_service_records())
+        if((r.second.zone_id == service.zone_id()) && (r.second.service_type == "logic"))
+          role_digests.open(r.first);
+    }
+
+    // Send digests that have changed. These are best-effort notifications, so
+    // there is no need to wait for responses.
+    for(const auto& r : role_digests) {
+      if(!service.find_service_record_opt(r.first))
+        continue;
+
+      if(r.second.count != 0)
+        impl->sent_role_digests.try_emplace(r.first, r.second);
+
+      Role_Digest old_digest;
+      old_role_digests.find_and_copy(old_digest, r.first);
+      if(!send_all && (old_digest == r.second))
+        continue;
+
+      ::taxon::V_object tx_args;
+      tx_args.try_emplace(&"count", static_cast<int64_t>(r.second.count));
+      tx_args.try_emplace(&"hash", static_cast<int64_t>(r.second.hash));
+
+      auto srv_q = new_sh<Service_Future>(r.first, &"logic/role/check_digest", tx_args);
+      service.launch(srv_q);
+    }
+  }
+
+void
+do_chat_subscription_timer_callback(const shptr<Implementation>& impl,
+                                    const shptr<::poseidon::Abstract_Timer>& /*timer*/,
+                                    ::poseidon::Abstract_Fiber& /*fiber*/, steady_time now)
+  {
+    // Collect chat threads that clients have subscribed to.
+    ::std::vector<cow_string> thread_keys;
+    for(const auto& r : impl->topic_subscribers)
+      if(r.first.rdstr().starts_with(chat_topic_prefix))
+        thread_keys.emplace_back(r.first.rdstr().substr(sizeof(chat_topic_prefix) - 1));
+
+    ::std::sort(thread_keys.begin(), thread_keys.end());
+
+    // Collect chat services in this zone.
+    ::std::vector<::poseidon::UUID> chat_services;
+    for(const auto& r : service.all_service_records())
+      if((r.second.zone_id == service.zone_id()) && (r.second.service_type == "chat"))
+        chat_services.emplace_back(r.first);
+
+    ::std::sort(chat_services.begin(), chat_services.end());
+
+    // Send them to all chat services if either list has changed, so a chat
+    // service that has just started gets them immediately. Once in a while,
+    // send them anyway, as subscriptions expire on chat services. These are
+    // best-effort notifications, so there is no need to wait for responses.
+    bool send_all = now - impl->chat_subscription_sync_time >= 1min;
+    if(!send_all && (thread_keys == impl->sent_chat_thread_keys)
+       && (chat_services == impl->sent_chat_services))
+      return;
+
+    impl->chat_subscription_sync_time = now;
+    impl->sent_chat_thread_keys = thread_keys;
+    impl->sent_chat_services = chat_services;
+
+    if(chat_services.empty())
+      return;
+
+    cow_vector<::poseidon::UUID> multicast_list;
+    multicast_list.append(chat_services.begin(), chat_services.end());
+
+    ::taxon::V_object tx_args;
+    auto& thread_key_list = tx_args.open(&"thread_key_list").open_array();
+    thread_key_list.reserve(thread_keys.size());
+    for(const auto& thread_key : thread_keys)
+      thread_key_list.emplace_back(thread_key);
+
+    auto srv_q = new_sh<Service_Future>(multicast_list, &"chat/thread/subscribe", tx_args);
+    service.launch(srv_q);
+  }
+
+void
+do_login_queue_timer_callback(const shptr<Implementation>& impl,
+                              const shptr<::poseidon::Abstract_Timer>& /*timer*/,
+                              ::poseidon::Abstract_Fiber& /*fiber*/, steady_time /*now*/)
+  {
+    if(impl->login_queue.empty())
+      return;
+
+    // Notify clients of their positions. If a client has gone away, remove
+    // it from the queue, and wake its fiber up so it can exit.
+    size_t position = 0;
+    for(auto it = impl->login_queue.begin();  it != impl->login_queue.end();  )
+      if(do_send_login_queue_position(impl, **it, ++ position))
+        ++ it;
+      else {
+        auto ticket = move(*it);
+        it = impl->login_queue.erase(it);
+        position --;
+
+        ticket->abandoned = true;
+        ticket->wake();
+      }
+
+    POSEIDON_LOG_INFO(("Login queue: $1 waiting, $2 active, concurrency limit $3, latency $4 ms"),
+                      impl->login_queue.size(), impl->login_active_count,
+                      static_cast<uint32_t>(impl->login_concurrency), impl->login_latency_ewma);
+  }
+
+void
+do_logout_flush_timer_callback(const shptr<Implementation>& impl,
+                               const shptr<::poseidon::Abstract_Timer>& /*timer*/,
+                               ::poseidon::Abstract_Fiber& fiber, steady_time /*now*/)
+  {
+    if((::poseidon::exit_signal.load() != 0) && !impl->exit_logouts_recorded) {
+      // The process is exiting. Users who are still online are logged out now,
+      // and their logout times are written with the others. Fibers are run to
+      // completion before the process exits, so this flush is not lost.
+      impl->exit_logouts_recorded = true;
+      system_time now = system_clock::now();
+      for(const auto& r : impl->connections)
+        impl->pending_logout_times.insert_or_assign(r.first, now);
+
+      POSEIDON_LOG_INFO(("Flushing logout time of $1 user(s) before exit"),
+                        impl->pending_logout_times.size());
+    }
+
+    do_flush_logout_times(impl, fiber);
+  }
+
 void
 do_user_kick(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& /*fiber*/,
              const ::poseidon::UUID& /*request_service_uuid*/,
@@ -992,6 +1667,79 @@ do_user_check_roles(const shptr<Implementation>& impl, ::poseidon::Abstract_Fibe
     response.try_emplace(&"status", &"gs_ok");
   }
 
+void
+do_invalidate_role_list(const shptr<Implementation>& impl, const phcow_string& username)
+  {
+    // Leave a tombstone, so a concurrent login will not save a stale list.
+    auto& rlc = impl->role_list_cache.open(username);
+    rlc.version = ++ impl->role_list_version;
+    rlc.valid = false;
+    rlc.expiry_time = steady_clock::now() + impl->role_list_cache_ttl;
+    rlc.raw_avatars.clear();
+    rlc.encoded_avatars[0].clear();
+    rlc.encoded_avatars[1].clear();
+  }
+
+void
+do_user_invalidate_roles(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& /*fiber*/,
+                         const ::poseidon::UUID& /*request_service_uuid*/,
+                         ::taxon::V_object& /*response*/, const ::taxon::V_object& request)
+  {
+    // * Request Parameters
+    //
+    //   - `username` <sub>string</sub> : Owner of roles.
+    //
+    // * Response Parameters
+    //
+    //   - _None_
+    //
+    // * Description
+    //
+    //   Invalidates the cached role list of a user, after a role has been created or
+    //   unloaded, or its avatar has changed. The next login of this user will fetch
+    //   a fresh list from the monitor.
+
+    ////////////////////////////////////////////////////////////
+    //
+    phcow_string username = request.at(&"username").as_string();
+    POSEIDON_CHECK(username != "");
+
+    ////////////////////////////////////////////////////////////
+    //
+    do_invalidate_role_list(impl, username);
+    POSEIDON_LOG_DEBUG(("Invalidated role list of `$1`"), username);
+  }
+
+void
+do_user_invalidate_cache(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& /*fiber*/,
+                         const ::poseidon::UUID& /*request_service_uuid*/,
+                         ::taxon::V_object& /*response*/, const ::taxon::V_object& request)
+  {
+    // * Request Parameters
+    //
+    //   - `username` <sub>string</sub> : Name of user.
+    //
+    // * Response Parameters
+    //
+    //   - _None_
+    //
+    // * Description
+    //
+    //   Invalidates cached properties of a user, after they have been changed by
+    //   another agent, such as when a ban is set or lifted. The next login of this
+    //   user will read them from MySQL.
+
+    ////////////////////////////////////////////////////////////
+    //
+    phcow_string username = request.at(&"username").as_string();
+    POSEIDON_CHECK(username != "");
+
+    ////////////////////////////////////////////////////////////
+    //
+    impl->user_cache.erase(username);
+    POSEIDON_LOG_DEBUG(("Invalidated cached properties of `$1`"), username);
+  }
+
 void
 do_user_push_message(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& /*fiber*/,
                      const ::poseidon::UUID& /*request_service_uuid*/,
@@ -1034,19 +1782,221 @@ do_user_push_message(const shptr<Implementation>& impl, ::poseidon::Abstract_Fib
 
     ////////////////////////////////////////////////////////////
     //
-    cow_string str;
+    client_data.try_emplace(&"%opcode", client_opcode);
+    cow_string strs[2];
+
     for(const auto& username : username_list)
       if(auto uconn = impl->connections.ptr(username))
         if(auto session = uconn->weak_session.lock()) {
-          if(str.size() == 0) {
-            ::taxon::V_object obj = client_data;
-            obj.try_emplace(&"%opcode", client_opcode);
-            ::taxon::Value(obj).print_to(str, ::taxon::option_json_mode);
-          }
-          session->ws_send(::poseidon::ws_TEXT, str);
+          auto& str = strs[uconn->encoding];
+          if(str.size() == 0)
+            do_encode_client_message(str, uconn->encoding, client_data);
+          do_send_client_message(impl, session, uconn->encoding, str);
+        }
+  }
+
+void
+do_topic_subscribe(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& /*fiber*/,
+                   const ::poseidon::UUID& /*request_service_uuid*/,
+                   ::taxon::V_object& response, const ::taxon::V_object& request)
+  {
+    // * Request Parameters
+    //
+    //   - `topic` <sub>string</sub> : Topic to subscribe to.
+    //   - `username` <sub>strings, optional</sub> : A single user.
+    //   - `username_list` <sub>array of strings, optional</sub> : List of users.
+    //
+    // * Response Parameters
+    //
+    //   - `status` <sub>string</sub> : [General status code.](#general-status-codes)
+    //
+    // * Description
+    //
+    //   Subscribes all clients in `username` and `username_list` to `topic`. If a user
+    //   is not online on this service, they are silently ignored. Subscriptions are
+    //   bound to connections, and are cancelled automatically when a user goes
+    //   offline.
+    //
+    //   If `topic` is `chat:` followed by the key of a chat thread, new messages in
+    //   that thread will be published by chat services, with `client_opcode` being
+    //   `ntfy/chat/message`.
+
+    ////////////////////////////////////////////////////////////
+    //
+    phcow_string topic = request.at(&"topic").as_string();
+    POSEIDON_CHECK(topic != "");
+
+    ::std::vector<phcow_string> username_list;
+    if(auto plist = request.ptr(&"username_list"))
+      for(const auto& r : plist->as_array()) {
+        POSEIDON_CHECK(r.as_string() != "");
+        username_list.emplace_back(r.as_string());
+      }
+
+    if(auto ptr = request.ptr(&"username"))
+      username_list.emplace_back(ptr->as_string());
+
+    ////////////////////////////////////////////////////////////
+    //
+    for(const auto& username : username_list)
+      if(auto uconn = impl->connections.mut_ptr(username)) {
+        if(::std::find(uconn->topics.begin(), uconn->topics.end(), topic) == uconn->topics.end())
+          uconn->topics.emplace_back(topic);
+
+        impl->topic_subscribers.open(topic).insert_or_assign(username, uconn->weak_session);
+      }
+
+    response.try_emplace(&"status", &"gs_ok");
+  }
+
+void
+do_topic_unsubscribe(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& /*fiber*/,
+                     const ::poseidon::UUID& /*request_service_uuid*/,
+                     ::taxon::V_object& response, const ::taxon::V_object& request)
+  {
+    // * Request Parameters
+    //
+    //   - `topic` <sub>string</sub> : Topic to unsubscribe from.
+    //   - `username` <sub>strings, optional</sub> : A single user.
+    //   - `username_list` <sub>array of strings, optional</sub> : List of users.
+    //
+    // * Response Parameters
+    //
+    //   - `status` <sub>string</sub> : [General status code.](#general-status-codes)
+    //
+    // * Description
+    //
+    //   Unsubscribes all clients in `username` and `username_list` from `topic`.
+
+    ////////////////////////////////////////////////////////////
+    //
+    phcow_string topic = request.at(&"topic").as_string();
+    POSEIDON_CHECK(topic != "");
+
+    ::std::vector<phcow_string> username_list;
+    if(auto plist = request.ptr(&"username_list"))
+      for(const auto& r : plist->as_array()) {
+        POSEIDON_CHECK(r.as_string() != "");
+        username_list.emplace_back(r.as_string());
+      }
+
+    if(auto ptr = request.ptr(&"username"))
+      username_list.emplace_back(ptr->as_string());
+
+    ////////////////////////////////////////////////////////////
+    //
+    for(const auto& username : username_list) {
+      if(auto uconn = impl->connections.mut_ptr(username)) {
+        auto pos = ::std::find(uconn->topics.begin(), uconn->topics.end(), topic);
+        if(pos != uconn->topics.end())
+          uconn->topics.erase(pos);
+      }
+
+      if(auto psubs = impl->topic_subscribers.mut_ptr(topic)) {
+        psubs->erase(username);
+        if(psubs->empty())
+          impl->topic_subscribers.erase(topic);
+      }
+    }
+
+    response.try_emplace(&"status", &"gs_ok");
+  }
+
+void
+do_topic_publish(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& /*fiber*/,
+                 const ::poseidon::UUID& /*request_service_uuid*/,
+                 ::taxon::V_object& /*response*/, const ::taxon::V_object& request)
+  {
+    // * Request Parameters
+    //
+    //   - `topic` <sub>string</sub> : Topic to publish to.
+    //   - `client_opcode` <sub>string</sub> : Opcode to send to clients.
+    //   - `client_data` <sub>object, optional</sub> : Additional data for this opcode.
+    //
+    // * Response Parameters
+    //
+    //   - _None_
+    //
+    // * Description
+    //
+    //   Sends a message to all clients on this service that have subscribed to
+    //   `topic`. In order to reach all subscribers in a zone, this request should be
+    //   multicast to all agents.
+
+    ////////////////////////////////////////////////////////////
+    //
+    phcow_string topic = request.at(&"topic").as_string();
+    POSEIDON_CHECK(topic != "");
+
+    cow_string client_opcode = request.at(&"client_opcode").as_string();
+    POSEIDON_CHECK(client_opcode != "");
+
+    ::taxon::V_object client_data;
+    if(auto ptr = request.ptr(&"client_data"))
+      client_data = ptr->as_object();
+
+    ////////////////////////////////////////////////////////////
+    //
+    auto psubs = impl->topic_subscribers.ptr(topic);
+    if(!psubs)
+      return;
+
+    client_data.try_emplace(&"%opcode", client_opcode);
+    cow_string strs[2];
+
+    for(const auto& r : *psubs)
+      if(auto uconn = impl->connections.ptr(r.first))
+        if(auto session = r.second.lock()) {
+          auto& str = strs[uconn->encoding];
+          if(str.size() == 0)
+            do_encode_client_message(str, uconn->encoding, client_data);
+          do_send_client_message(impl, session, uconn->encoding, str);
         }
   }
 
+::taxon::V_object
+do_make_bandwidth_object(const Bandwidth_Counters& counters)
+  {
+    ::taxon::V_object obj;
+    obj.try_emplace(&"messages_in", static_cast<int64_t>(counters.messages_in));
+    obj.try_emplace(&"bytes_in", static_cast<int64_t>(counters.bytes_in));
+    obj.try_emplace(&"messages_out", static_cast<int64_t>(counters.messages_out));
+    obj.try_emplace(&"bytes_out", static_cast<int64_t>(counters.bytes_out));
+    return obj;
+  }
+
+void
+do_stats_bandwidth(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& /*fiber*/,
+                   const ::poseidon::UUID& /*request_service_uuid*/,
+                   ::taxon::V_object& response, const ::taxon::V_object& /*request*/)
+  {
+    // * Request Parameters
+    //
+    //   - _None_
+    //
+    // * Response Parameters
+    //
+    //   - `status` <sub>string</sub> : [General status code.](#general-status-codes)
+    //   - `json` <sub>object</sub> : Traffic of clients that use JSON.
+    //     - `messages_in` <sub>integer</sub> : Number of messages from clients.
+    //     - `bytes_in` <sub>integer</sub> : Number of bytes from clients.
+    //     - `messages_out` <sub>integer</sub> : Number of messages to clients.
+    //     - `bytes_out` <sub>integer</sub> : Number of bytes to clients.
+    //   - `msgpack` <sub>object</sub> : Traffic of clients that use MessagePack.
+    //     - _same as above_
+    //
+    // * Description
+    //
+    //   Gets traffic statistics of clients on this service since startup. Sizes are
+    //   of message payloads before compression.
+
+    ////////////////////////////////////////////////////////////
+    //
+    response.try_emplace(&"json", do_make_bandwidth_object(impl->bandwidth[user_ws_encoding_json]));
+    response.try_emplace(&"msgpack", do_make_bandwidth_object(impl->bandwidth[user_ws_encoding_msgpack]));
+    response.try_emplace(&"status", &"gs_ok");
+  }
+
 void
 do_relay_deny(const shptr<Implementation>& /*impl*/, ::poseidon::Abstract_Fiber& /*fiber*/,
               const phcow_string& /*username*/, ::taxon::V_object& response,
@@ -1166,7 +2116,8 @@ do_user_ban_set(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& f
     // * Description
     //
     //   Sets a ban on a user until a given time point. If the user is online, they are
-    //   kicked with `reason`.
+    //   kicked with `reason`. Other agents in the same zone are notified with
+    //   `agent/user/invalidate_cache`, so the ban takes effect at once.
 
     ////////////////////////////////////////////////////////////
     //
@@ -1210,6 +2161,11 @@ do_user_ban_set(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& f
     if(auto uinfo = impl->users.mut_ptr(username))
       uinfo->banned_until = until;
 
+    if(auto pcached = impl->user_cache.mut_ptr(username))
+      pcached->banned_until = until;
+
+    do_invalidate_user_cache_on_other_agents(username);
+
     if(auto uconn = impl->connections.ptr(username))
       if(auto session = uconn->weak_session.lock())
         session->ws_shut_down(user_ws_status_ban, reason);
@@ -1234,7 +2190,8 @@ do_user_ban_lift(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber&
     //
     // * Description
     //
-    //   Lifts a ban on a user.
+    //   Lifts a ban on a user. Other agents in the same zone are notified with
+    //   `agent/user/invalidate_cache`.
 
     ////////////////////////////////////////////////////////////
     //
@@ -1270,6 +2227,11 @@ do_user_ban_lift(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber&
     if(auto uinfo = impl->users.mut_ptr(username))
       uinfo->banned_until = system_time();
 
+    if(auto pcached = impl->user_cache.mut_ptr(username))
+      pcached->banned_until = system_time();
+
+    do_invalidate_user_cache_on_other_agents(username);
+
     POSEIDON_LOG_INFO(("Lift ban on `$1`"), username);
 
     response.try_emplace(&"status", &"gs_ok");
@@ -1353,7 +2315,10 @@ do_plus_role_create(const shptr<Implementation>& impl, ::poseidon::Abstract_Fibe
       return;
     }
 
-    impl->connections.mut(username).cached_raw_avatars.try_emplace(roid);
+    auto& uconn = impl->connections.mut(username);
+    uconn.cached_raw_avatars.try_emplace(roid);
+    do_encode_client_message(uconn.cached_encoded_avatars.open(roid), uconn.encoding, ::taxon::V_object());
+    do_invalidate_role_list(impl, username);
 
     do_role_login_common(impl, fiber, username, roid);
 
@@ -1459,23 +2424,33 @@ remove_http_handler(const phcow_string& path)
 
 void
 User_Service::
-add_ws_authenticator(const phcow_string& path, const ws_authenticator_type& handler)
+add_ws_authenticator(const phcow_string& path, const ws_authenticator_type& handler,
+                     User_WS_Encoding encoding)
   {
     if(!this->m_impl)
       this->m_impl = new_sh<X_Implementation>();
 
-    if(this->m_impl->ws_authenticators.try_emplace(path, handler).second == false)
+    WS_Authenticator authenticator;
+    authenticator.handler = handler;
+    authenticator.encoding = encoding;
+
+    if(this->m_impl->ws_authenticators.try_emplace(path, authenticator).second == false)
       POSEIDON_THROW(("Handler for `$1` already exists"), path);
   }
 
 bool
 User_Service::
-set_ws_authenticator(const phcow_string& path, const ws_authenticator_type& handler)
+set_ws_authenticator(const phcow_string& path, const ws_authenticator_type& handler,
+                     User_WS_Encoding encoding)
   {
     if(!this->m_impl)
       this->m_impl = new_sh<X_Implementation>();
 
-    return this->m_impl->ws_authenticators.try_emplace(path, handler).second;
+    WS_Authenticator authenticator;
+    authenticator.handler = handler;
+    authenticator.encoding = encoding;
+
+    return this->m_impl->ws_authenticators.insert_or_assign(path, authenticator).second;
   }
 
 bool
@@ -1586,6 +2561,38 @@ reload(const ::poseidon::Config_File& conf_file)
           "[in configuration file '$2']"),
           nickname_length_limits_0, conf_file.path(), nickname_length_limits_1);
 
+    // `agent.login_concurrency_limits[]`
+    uint32_t login_concurrency_limits_0 = static_cast<uint32_t>(conf_file.get_integer_opt(
+                                    &"agent.login_concurrency_limits[0]", 1, 99999).value_or(4));
+    uint32_t login_concurrency_limits_1 = static_cast<uint32_t>(conf_file.get_integer_opt(
+                                    &"agent.login_concurrency_limits[1]", 1, 99999).value_or(256));
+
+    if(login_concurrency_limits_0 > login_concurrency_limits_1)
+      POSEIDON_THROW((
+          "Invalid `agent.login_concurrency_limits`: invalid range: `$1` > `$3`",
+          "[in configuration file '$2']"),
+          login_concurrency_limits_0, conf_file.path(), login_concurrency_limits_1);
+
+    // `agent.user_cache_ttl`
+    seconds user_cache_ttl = seconds(static_cast<int>(conf_file.get_integer_opt(
+                                    &"agent.user_cache_ttl", 0, 3600).value_or(30)));
+
+    // `agent.logout_batch_size`
+    uint32_t logout_batch_size = static_cast<uint32_t>(conf_file.get_integer_opt(
+                                    &"agent.logout_batch_size", 1, 9999).value_or(500));
+
+    // `agent.logout_flush_interval`
+    milliseconds logout_flush_interval = milliseconds(static_cast<int>(conf_file.get_integer_opt(
+                                    &"agent.logout_flush_interval", 10, 60000).value_or(500)));
+
+    // `agent.role_list_cache_ttl`
+    seconds role_list_cache_ttl = seconds(static_cast<int>(conf_file.get_integer_opt(
+                                    &"agent.role_list_cache_ttl", 0, 86400).value_or(300)));
+
+    // `agent.login_target_latency`
+    milliseconds login_target_latency = milliseconds(static_cast<int>(conf_file.get_integer_opt(
+                                    &"agent.login_target_latency", 1, 999999).value_or(200)));
+
     // Set up new configuration. This operation shall be atomic.
     this->m_impl->redis_role_ttl = redis_role_ttl;
     this->m_impl->client_port = client_port;
@@ -1594,6 +2601,18 @@ reload(const ::poseidon::Config_File& conf_file)
     this->m_impl->max_number_of_roles_per_user = max_number_of_roles_per_user;
     this->m_impl->nickname_length_limits[0] = nickname_length_limits_0;
     this->m_impl->nickname_length_limits[1] = nickname_length_limits_1;
+    this->m_impl->login_concurrency_limits[0] = login_concurrency_limits_0;
+    this->m_impl->login_concurrency_limits[1] = login_concurrency_limits_1;
+    this->m_impl->login_target_latency = login_target_latency;
+    this->m_impl->user_cache_ttl = user_cache_ttl;
+    this->m_impl->logout_batch_size = logout_batch_size;
+    this->m_impl->role_list_cache_ttl = role_list_cache_ttl;
+
+    // Start conservatively; concurrency will grow as logins complete.
+    this->m_impl->login_concurrency = ::rocket::clamp(this->m_impl->login_concurrency,
+                                   static_cast<double>(login_concurrency_limits_0),
+                                   static_cast<double>(login_concurrency_limits_1));
+    do_login_admit_queued(this->m_impl);
 
     // Set up builtin handlers.
     this->m_impl->ws_handlers.insert_or_assign(&"req/role/create", bindw(this->m_impl, do_plus_role_create));
@@ -1607,15 +2626,25 @@ reload(const ::poseidon::Config_File& conf_file)
     service.set_handler(&"agent/user/kick", bindw(this->m_impl, do_user_kick));
     service.set_handler(&"agent/user/check_roles", bindw(this->m_impl, do_user_check_roles));
     service.set_handler(&"agent/user/push_message", bindw(this->m_impl, do_user_push_message));
+    service.set_handler(&"agent/user/invalidate_roles", bindw(this->m_impl, do_user_invalidate_roles));
+    service.set_handler(&"agent/user/invalidate_cache", bindw(this->m_impl, do_user_invalidate_cache));
+    service.set_handler(&"agent/topic/subscribe", bindw(this->m_impl, do_topic_subscribe));
+    service.set_handler(&"agent/topic/unsubscribe", bindw(this->m_impl, do_topic_unsubscribe));
+    service.set_handler(&"agent/topic/publish", bindw(this->m_impl, do_topic_publish));
     service.set_handler(&"agent/user/reload_relay_conf", bindw(this->m_impl, do_user_reload_relay_conf));
     service.set_handler(&"agent/user/ban/set", bindw(this->m_impl, do_user_ban_set));
     service.set_handler(&"agent/user/ban/lift", bindw(this->m_impl, do_user_ban_lift));
     service.set_handler(&"agent/nickname/acquire", bindw(this->m_impl, do_nickname_acquire));
     service.set_handler(&"agent/nickname/release", bindw(this->m_impl, do_nickname_release));
+    service.set_handler(&"agent/stats/bandwidth", bindw(this->m_impl, do_stats_bandwidth));
 
     // Restart the service.
     this->m_impl->ping_timer.start(150ms, 7001ms, bindw(this->m_impl, do_ping_timer_callback));
     this->m_impl->check_user_timer.start(2min, bindw(this->m_impl, do_check_user_timer_callback));
+    this->m_impl->role_digest_timer.start(3001ms, bindw(this->m_impl, do_role_digest_timer_callback));
+    this->m_impl->login_queue_timer.start(3001ms, bindw(this->m_impl, do_login_queue_timer_callback));
+    this->m_impl->logout_flush_timer.start(logout_flush_interval, bindw(this->m_impl, do_logout_flush_timer_callback));
+    this->m_impl->chat_subscription_timer.start(1001ms, bindw(this->m_impl, do_chat_subscription_timer_callback));
     this->m_impl->user_server.start(this->m_impl->client_port, bindw(this->m_impl, do_server_hws_callback));
   }
 
@@ -56,15 +56,19 @@ class User_Service
               const cow_string& request_raw_query)>;
 
     // Adds a new WebSocket authentication handler for users. If a new handler
-    // already exists, an exception is thrown.
+    // already exists, an exception is thrown. All messages from and to clients
+    // that connect to `path` will use `encoding`.
     void
-    add_ws_authenticator(const phcow_string& path, const ws_authenticator_type& handler);
+    add_ws_authenticator(const phcow_string& path, const ws_authenticator_type& handler,
+                         User_WS_Encoding encoding = user_ws_encoding_json);
 
     // Adds a new WebSocket authentication handler, or replaces an existing one,
     // for users. If a new handler has been added, `true` is returned. If an
-    // existent handler has been overwritten, `false` is returned.
+    // existent handler has been overwritten, `false` is returned. All messages
+    // from and to clients that connect to `path` will use `encoding`.
     bool
-    set_ws_authenticator(const phcow_string& path, const ws_authenticator_type& handler);
+    set_ws_authenticator(const phcow_string& path, const ws_authenticator_type& handler,
+                         User_WS_Encoding encoding = user_ws_encoding_json);
 
     // Removes a WebSocket authentication handler for requests from users.
     bool
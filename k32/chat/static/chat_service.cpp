@@ -5,6 +5,7 @@
 #define K32_FRIENDS_A40BD99F_5E7D_486F_A905_656CBDBE52AB_
 #include "chat_service.hpp"
 #include "../globals.hpp"
+#include "../../common/base/save_scheduler.hpp"
 #include <poseidon/base/config_file.hpp>
 #include <poseidon/easy/easy_ws_server.hpp>
 #include <poseidon/easy/easy_timer.hpp>
@@ -14,27 +15,89 @@
 #include <poseidon/fiber/mysql_query_future.hpp>
 #include <poseidon/mysql/mysql_connection.hpp>
 #include <poseidon/static/mysql_connector.hpp>
-#include <map>
-#include <list>
+#include <poseidon/fiber/abstract_future.hpp>
 #include <algorithm>
 namespace k32::chat {
 namespace {
 
 const cow_dictionary<Chat_Thread> empty_chat_thread_map;
 
+// Messages are stored in segments of this size. The segment of a message is its
+// serial number divided by this value, so this must not be changed, otherwise
+// existing data can't be loaded.
+constexpr uint32_t messages_per_segment = 100;
+
+// Threads are loaded from MySQL in batches of this size.
+constexpr size_t threads_per_load_batch = 100;
+
+// New messages are published to agents as this topic followed by thread keys.
+constexpr char chat_topic_prefix[] = "chat:";
+
+// Agents shall refresh their subscriptions within this period.
+constexpr seconds agent_subscription_ttl = 3min;
+
+class Thread_Load_Ticket
+  :
+    public ::poseidon::Abstract_Future
+  {
+  public:
+    bool failed = false;
+
+  private:
+    virtual
+    void
+    do_on_abstract_future_initialize()
+      override
+      { }
+
+  public:
+    Thread_Load_Ticket() = default;
+    Thread_Load_Ticket(const Thread_Load_Ticket&) = delete;
+    Thread_Load_Ticket& operator=(const Thread_Load_Ticket&) = delete;
+
+    void
+    wake()
+      { this->do_abstract_future_initialize_once();  }
+  };
+
+struct Agent_Subscription
+  {
+    ::std::vector<phcow_string> thread_keys;
+    steady_time expiry_time;
+  };
+
 struct Implementation
   {
     uint32_t max_number_of_messages_per_thread;
+    uint32_t max_number_of_messages_per_check;
     seconds cached_thread_ttl;
+    seconds handover_delay;
 
     ::poseidon::Easy_Timer save_timer;
+    ::poseidon::Easy_Timer subscription_timer;
 
     // remote data from mysql
     bool db_ready = false;
     cow_dictionary<Chat_Thread> chat_threads;
-    ::std::list<static_vector<phcow_string, 255>> save_buckets;
+    cow_dictionary<shptr<Thread_Load_Ticket>> thread_load_tickets;
+    Save_Scheduler<phcow_string, phcow_string::hash> save_scheduler;
+
+    // chat services in this zone, which share threads
+    ::std::vector<::poseidon::UUID> chat_services;
+    steady_time handover_end_time;
+
+    // subscriptions of agents
+    cow_uuid_dictionary<Agent_Subscription> agent_subscriptions;
+    cow_dictionary<cow_vector<::poseidon::UUID>> thread_subscribers;
   };
 
+bool
+do_is_thread_local(const phcow_string& thread_key)
+  {
+    // Each thread belongs to exactly one chat service in a zone.
+    return service.find_service_for_key(&"chat", thread_key.rdstr()) == service.service_uuid();
+  }
+
 void
 do_mysql_check_table_chat(::poseidon::Abstract_Fiber& fiber)
   {
@@ -70,6 +133,252 @@ do_mysql_check_table_chat(::poseidon::Abstract_Fiber& fiber)
     POSEIDON_LOG_INFO(("Finished verification of MySQL table `$1`"), table.name);
   }
 
+void
+do_mysql_check_table_chat_segment(::poseidon::Abstract_Fiber& fiber)
+  {
+    ::poseidon::MySQL_Table_Structure table;
+    table.name = &"chat_segment";
+    table.engine = ::poseidon::mysql_engine_innodb;
+
+    ::poseidon::MySQL_Table_Column column;
+    column.name = &"thread_key";
+    column.type = ::poseidon::mysql_column_varchar;
+    table.columns.emplace_back(column);
+
+    column.clear();
+    column.name = &"segment";
+    column.type = ::poseidon::mysql_column_int64;
+    table.columns.emplace_back(column);
+
+    column.clear();
+    column.name = &"update_time";
+    column.type = ::poseidon::mysql_column_datetime;
+    table.columns.emplace_back(column);
+
+    column.clear();
+    column.name = &"whole";
+    column.type = ::poseidon::mysql_column_blob;
+    table.columns.emplace_back(column);
+
+    ::poseidon::MySQL_Table_Index index;
+    index.name = &"PRIMARY";
+    index.type = ::poseidon::mysql_index_unique;
+    index.columns.emplace_back(&"thread_key");
+    index.columns.emplace_back(&"segment");
+    table.indexes.emplace_back(index);
+
+    // This is in the default database.
+    auto task = new_sh<::poseidon::MySQL_Check_Table_Future>(::poseidon::mysql_connector, table);
+    ::poseidon::task_scheduler.launch(task);
+    fiber.yield(task);
+    POSEIDON_LOG_INFO(("Finished verification of MySQL table `$1`"), table.name);
+  }
+
+void
+do_mysql_load_threads(::poseidon::Abstract_Fiber& fiber, cow_dictionary<Chat_Thread>& threads,
+                      const ::std::vector<phcow_string>& thread_keys)
+  {
+    // Each segment is stored as a thread of its own, and the first one tells
+    // the serial number of the first message. All batches are sent at once.
+    cow_vector<shptr<::poseidon::MySQL_Query_Future>> tasks;
+    for(size_t off = 0;  off < thread_keys.size();  off += threads_per_load_batch) {
+      cow_string stmt = &R"!!!(
+            SELECT `thread_key`
+                   , `segment`
+                   , `whole`
+              FROM `chat_segment`
+              WHERE `thread_key` IN ()!!!";
+
+      cow_vector<::poseidon::MySQL_Value> sql_args;
+      for(size_t k = off;  k != ::std::min(off + threads_per_load_batch, thread_keys.size());  ++k) {
+        if(sql_args.size() != 0)
+          stmt += ", ";
+        stmt += "?";
+
+        sql_args.emplace_back(thread_keys[k].rdstr());    // `thread_key`
+      }
+
+      stmt += R"!!!()
+              ORDER BY `thread_key`, `segment`
+          )!!!";
+
+      auto task1 = new_sh<::poseidon::MySQL_Query_Future>(::poseidon::mysql_connector, stmt, sql_args);
+      ::poseidon::task_scheduler.launch(task1);
+      tasks.emplace_back(task1);
+    }
+
+    for(const auto& task1 : tasks)
+      fiber.yield(task1);
+
+    for(const auto& task1 : tasks)
+      for(const auto& row : task1->result_rows()) {
+        phcow_string thread_key = row.at(0).as_blob();    // SELECT `thread_key`
+        uint64_t serial = static_cast<uint64_t>(row.at(1).as_integer()) * messages_per_segment;
+                                                          //        , `segment`
+        Chat_Thread segment;
+        segment.parse_from_string(row.at(2).as_blob());   //        , `whole`
+
+        auto& thread = threads.open(thread_key);
+        thread.thread_key = thread_key;
+
+        if(thread.messages.empty() || (thread.messages.end_position() != serial)) {
+          // Segments must be contiguous. If one is missing, drop messages before
+          // it.
+          if(!thread.messages.empty())
+            POSEIDON_LOG_WARN(("Segment missing before message `$1` of thread `$2`"), serial, thread_key);
+
+          thread.messages.reset(serial);
+        }
+
+        thread.update_time = segment.update_time;
+        for(const auto& msg : segment.messages)
+          thread.messages.emplace_back(msg.first, msg.second);
+
+        thread._saved_serial = thread.messages.end_position();
+        thread._purged_serial = thread.messages.begin_position();
+      }
+
+    // Threads that were stored by earlier versions are in the `chat` table, and
+    // will be written as segments.
+    ::std::vector<phcow_string> legacy_keys;
+    for(const auto& thread_key : thread_keys)
+      if(threads.count(thread_key) == 0)
+        legacy_keys.emplace_back(thread_key);
+
+    tasks.clear();
+    for(size_t off = 0;  off < legacy_keys.size();  off += threads_per_load_batch) {
+      cow_string stmt = &R"!!!(
+            SELECT `thread_key`
+                   , `whole`
+              FROM `chat`
+              WHERE `thread_key` IN ()!!!";
+
+      cow_vector<::poseidon::MySQL_Value> sql_args;
+      for(size_t k = off;  k != ::std::min(off + threads_per_load_batch, legacy_keys.size());  ++k) {
+        if(sql_args.size() != 0)
+          stmt += ", ";
+        stmt += "?";
+
+        sql_args.emplace_back(legacy_keys[k].rdstr());    // `thread_key`
+      }
+
+      stmt += R"!!!()
+          )!!!";
+
+      auto task1 = new_sh<::poseidon::MySQL_Query_Future>(::poseidon::mysql_connector, stmt, sql_args);
+      ::poseidon::task_scheduler.launch(task1);
+      tasks.emplace_back(task1);
+    }
+
+    for(const auto& task1 : tasks)
+      fiber.yield(task1);
+
+    for(const auto& task1 : tasks)
+      for(const auto& row : task1->result_rows()) {
+        phcow_string thread_key = row.at(0).as_blob();    // SELECT `thread_key`
+        auto& thread = threads.open(thread_key);
+        thread.parse_from_string(row.at(1).as_blob());    //        , `whole`
+        thread.thread_key = thread_key;
+        thread._saved_serial = 0;
+        thread._purged_serial = 0;
+      }
+  }
+
+void
+do_release_thread_load_tickets(const shptr<Implementation>& impl, const ::std::vector<phcow_string>& thread_keys,
+                               bool failed)
+  {
+    for(const auto& thread_key : thread_keys) {
+      shptr<Thread_Load_Ticket> ticket;
+      if(impl->thread_load_tickets.find_and_copy(ticket, thread_key)) {
+        impl->thread_load_tickets.erase(thread_key);
+        ticket->failed = failed;
+        ticket->wake();
+      }
+    }
+  }
+
+void
+do_load_threads(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber,
+                const ::std::vector<phcow_string>& thread_keys)
+  {
+    // Threads that are being loaded by other fibers are not loaded again. Wait
+    // for them instead, so a burst of requests for the same thread results in
+    // only one query.
+    ::std::vector<phcow_string> load_keys;
+    cow_vector<shptr<Thread_Load_Ticket>> wait_tickets;
+    for(const auto& thread_key : thread_keys)
+      if(impl->chat_threads.count(thread_key) == 0) {
+        shptr<Thread_Load_Ticket> ticket;
+        if(impl->thread_load_tickets.find_and_copy(ticket, thread_key))
+          wait_tickets.emplace_back(ticket);
+        else {
+          impl->thread_load_tickets.try_emplace(thread_key, new_sh<Thread_Load_Ticket>());
+          load_keys.emplace_back(thread_key);
+        }
+      }
+
+    if(!load_keys.empty()) {
+      cow_dictionary<Chat_Thread> threads;
+      try {
+        do_mysql_load_threads(fiber, threads, load_keys);
+      }
+      catch(exception&) {
+        // Wake up waiting fibers, which shall fail too.
+        do_release_thread_load_tickets(impl, load_keys, true);
+        throw;
+      }
+
+      // Threads that don't exist in MySQL are not cached.
+      for(const auto& thread_key : load_keys)
+        if(auto pth = threads.mut_ptr(thread_key)) {
+          bool migrated = pth->_saved_serial == 0;
+          if(impl->chat_threads.try_emplace(thread_key, move(*pth)).second) {
+            impl->save_scheduler.insert(thread_key, steady_clock::now());
+            if(migrated)
+              impl->save_scheduler.mark_dirty(thread_key, steady_clock::now());
+          }
+        }
+
+      do_release_thread_load_tickets(impl, load_keys, false);
+    }
+
+    for(const auto& ticket : wait_tickets) {
+      fiber.yield(ticket);
+      if(ticket->failed)
+        POSEIDON_THROW(("Could not load chat threads"));
+    }
+  }
+
+void
+do_set_agent_subscription(const shptr<Implementation>& impl, const ::poseidon::UUID& agent_service_uuid,
+                          const ::std::vector<phcow_string>& thread_keys, steady_time expiry_time)
+  {
+    if(auto pold = impl->agent_subscriptions.ptr(agent_service_uuid))
+      for(const auto& thread_key : pold->thread_keys)
+        if(auto psubs = impl->thread_subscribers.mut_ptr(thread_key)) {
+          auto pos = ::std::find(psubs->begin(), psubs->end(), agent_service_uuid);
+          if(pos != psubs->end())
+            psubs->erase(pos);
+          if(psubs->empty())
+            impl->thread_subscribers.erase(thread_key);
+        }
+
+    impl->agent_subscriptions.erase(agent_service_uuid);
+    if(thread_keys.empty())
+      return;
+
+    auto& sub = impl->agent_subscriptions.open(agent_service_uuid);
+    sub.expiry_time = expiry_time;
+    for(const auto& thread_key : thread_keys) {
+      auto& subs = impl->thread_subscribers.open(thread_key);
+      if(::std::find(subs.begin(), subs.end(), agent_service_uuid) == subs.end()) {
+        subs.emplace_back(agent_service_uuid);
+        sub.thread_keys.emplace_back(thread_key);
+      }
+    }
+  }
+
 void
 do_thread_check_multi(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber,
                       const ::poseidon::UUID& /*request_service_uuid*/,
@@ -79,19 +388,32 @@ do_thread_check_multi(const shptr<Implementation>& impl, ::poseidon::Abstract_Fi
     //
     //   - `thread_key_list` <sub>array of strings</sub> : List of threads to check.
     //   - `last_check_time` <sub>timestamp, optional</sub> : Timestamp of last check.
+    //   - `limit` <sub>integer, optional</sub> : Maximum number of messages to return.
     //
     // * Response Parameters
     //
     //   - `status` <sub>string</sub> : [General status code.](#general-status-codes)
     //   - `raw_payload_list` <sub>array of strings</sub> : Message payloads, encoded
     //     in JSON and sorted by time of creation.
-    //   - `check_time` <sub>timestamp</sub> : Timestamp on the server.
+    //   - `check_time` <sub>timestamp</sub> : Timestamp on the server, or timestamp
+    //     of the last message if there are more messages.
+    //   - `has_more` <sub>boolean</sub> : Whether there are more messages.
+    //   - `foreign_thread_key_list` <sub>array of strings</sub> : List of threads that
+    //     belong to other chat services, which are ignored.
     //
     // * Description
     //
     //   Retrieves messages from all threads in `thread_key_list`. If `last_check_time`
     //   is specified, only messages whose timestamps are _greater than_ `last_check_time`
-    //   are returned.
+    //   are returned. At most `limit` messages are returned, which is also capped by
+    //   `chat.max_number_of_messages_per_check`, except that messages with the same
+    //   timestamp are never separated. The caller should pass `check_time` as
+    //   `last_check_time` in the next request, and repeat while `has_more` is `true`.
+    //
+    //   If there are multiple chat services in a zone, each thread belongs to one of
+    //   them, which can be found with `Service::find_service_for_key()`. After chat
+    //   services have come or gone, threads that have not been loaded can't be
+    //   checked for a few seconds, and `gs_chat_thread_handover` is returned.
 
     ////////////////////////////////////////////////////////////
     //
@@ -104,53 +426,55 @@ do_thread_check_multi(const shptr<Implementation>& impl, ::poseidon::Abstract_Fi
     if(auto ptr = request.ptr(&"last_check_time"))
       last_check_time = ptr->as_time();
 
+    size_t limit = impl->max_number_of_messages_per_check;
+    if(auto ptr = request.ptr(&"limit")) {
+      POSEIDON_CHECK(ptr->as_integer() >= 1);
+      limit = static_cast<size_t>(::std::min<int64_t>(ptr->as_integer(), static_cast<int64_t>(limit)));
+    }
+
     POSEIDON_CHECK(impl->db_ready);
 
     ////////////////////////////////////////////////////////////
     //
-    for(const auto& thread_key : thread_key_list)
-      if(!impl->chat_threads.count(thread_key)) {
-        // Load thread from MySQL.
-        static constexpr char select_from_chat[] =
-            R"!!!(
-              SELECT `whole`
-                FROM `chat`
-                WHERE `thread_key` = ?
-            )!!!";
-
-        cow_vector<::poseidon::MySQL_Value> sql_args;
-        sql_args.emplace_back(thread_key.rdstr());     // WHERE `thread_key` = ?
-
-        auto task1 = new_sh<::poseidon::MySQL_Query_Future>(::poseidon::mysql_connector,
-                                                            &select_from_chat, sql_args);
-        ::poseidon::task_scheduler.launch(task1);
-        fiber.yield(task1);
-
-        if(task1->result_row_count() == 0)
-          continue;
-
-        Chat_Thread thread;
-        thread.parse_from_string(task1->result_row(0).at(0).as_blob());    // SELECT `whole`
-        impl->chat_threads.try_emplace(thread_key, thread);
+    // Threads that belong to other services are not loaded.
+    ::taxon::V_array foreign_thread_key_list;
+    for(auto it = thread_key_list.begin();  it != thread_key_list.end();  )
+      if(do_is_thread_local(*it))
+        ++ it;
+      else {
+        foreign_thread_key_list.emplace_back(it->rdstr());
+        it = thread_key_list.erase(it);
       }
 
-    // Copy messages.
-    ::std::multimap<system_time, cow_string> sorted_messages;
+    if(steady_clock::now() < impl->handover_end_time)
+      for(const auto& thread_key : thread_key_list)
+        if(!impl->chat_threads.count(thread_key)) {
+          response.try_emplace(&"status", &"gs_chat_thread_handover");
+          return;
+        }
+
+    // Load threads that are not cached from MySQL.
+    do_load_threads(impl, fiber, thread_key_list);
+
+    // Merge new messages from all threads. As whole segments are trimmed, a
+    // thread may contain more messages than the limit, and old ones are not
+    // returned.
+    ::std::vector<const Chat_Thread*> threads;
     for(const auto& thread_key : thread_key_list)
       if(auto pth = impl->chat_threads.ptr(thread_key))
-        sorted_messages.insert(
-            ::std::upper_bound(pth->messages.begin(), pth->messages.end(),
-                               ::std::make_pair(last_check_time, cow_string())),
-            pth->messages.end());
+        threads.emplace_back(pth);
 
-    // Pack sorted messages.
     ::taxon::V_array raw_payload_list;
-    raw_payload_list.reserve(sorted_messages.size());
-    for(const auto& r : sorted_messages)
-      raw_payload_list.emplace_back(r.second);
+    system_time check_time;
+    bool has_more = chat_merge_messages(raw_payload_list, check_time, threads, last_check_time,
+                                        impl->max_number_of_messages_per_thread, limit);
+    if(!has_more)
+      check_time = system_clock::now();
 
     response.try_emplace(&"raw_payload_list", raw_payload_list);
-    response.try_emplace(&"check_time", system_clock::now());
+    response.try_emplace(&"check_time", check_time);
+    response.try_emplace(&"has_more", has_more);
+    response.try_emplace(&"foreign_thread_key_list", foreign_thread_key_list);
     response.try_emplace(&"status", &"gs_ok");
   }
 
@@ -170,7 +494,15 @@ do_thread_append(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber&
     //
     // * Description
     //
-    //   Appends a new message to the end of `thread_key`.
+    //   Appends a new message to the end of `thread_key`. If agents have subscribed to
+    //   this thread, the message is published to them with `agent/topic/publish`,
+    //   where `client_opcode` is `ntfy/chat/message`, and `client_data` contains
+    //   `thread_key`, `message_time` and `raw_payload`.
+    //
+    //   If `thread_key` belongs to another chat service, `gs_chat_thread_foreign` is
+    //   returned. After chat services have come or gone, a thread that has not been
+    //   loaded can't be appended to for a few seconds, and `gs_chat_thread_handover`
+    //   is returned.
 
     ////////////////////////////////////////////////////////////
     //
@@ -184,113 +516,305 @@ do_thread_append(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber&
 
     ////////////////////////////////////////////////////////////
     //
-    Chat_Thread thread;
-    if(!impl->chat_threads.find_and_copy(thread, thread_key)) {
-      // Load thread from MySQL. If no such thread exists, create a new one.
-      static constexpr char select_from_chat[] =
-          R"!!!(
-            SELECT `whole`
-              FROM `chat`
-              WHERE `thread_key` = ?
-          )!!!";
+    if(!do_is_thread_local(thread_key)) {
+      response.try_emplace(&"status", &"gs_chat_thread_foreign");
+      return;
+    }
 
-      cow_vector<::poseidon::MySQL_Value> sql_args;
-      sql_args.emplace_back(thread_key.rdstr());     // WHERE `thread_key` = ?
+    if(!impl->chat_threads.count(thread_key) && (steady_clock::now() < impl->handover_end_time)) {
+      response.try_emplace(&"status", &"gs_chat_thread_handover");
+      return;
+    }
 
-      auto task1 = new_sh<::poseidon::MySQL_Query_Future>(::poseidon::mysql_connector,
-                                                          &select_from_chat, sql_args);
-      ::poseidon::task_scheduler.launch(task1);
-      fiber.yield(task1);
+    if(!impl->chat_threads.count(thread_key)) {
+      // Load thread from MySQL. If no such thread exists, create a new one.
+      ::std::vector<phcow_string> thread_keys;
+      thread_keys.emplace_back(thread_key);
+      do_load_threads(impl, fiber, thread_keys);
 
+      Chat_Thread thread;
       thread.thread_key = thread_key;
       thread.update_time = system_clock::now();
-
-      if(task1->result_row_count() != 0)
-        thread.parse_from_string(task1->result_row(0).at(0).as_blob());    // SELECT `whole`
-
-      auto result = impl->chat_threads.try_emplace(thread_key, thread);
-      if(!result.second)
-        thread = result.first->second;  // load conflict
+      impl->chat_threads.try_emplace(thread_key, move(thread));
     }
 
-    // Truncate the message list.
-    if(thread.messages.size() > impl->max_number_of_messages_per_thread + 200)
-      thread.messages.erase(0, thread.messages.size() - impl->max_number_of_messages_per_thread);
+    // Modify the thread in place. Copying it would copy all messages.
+    auto& thread = impl->chat_threads.mut(thread_key);
+
+    // Truncate the message list. Only whole segments are dropped, so they can be
+    // deleted from MySQL.
+    if(thread.messages.size() >= impl->max_number_of_messages_per_thread + messages_per_segment)
+      thread.messages.pop_front((thread.messages.size() - impl->max_number_of_messages_per_thread)
+                                / messages_per_segment * messages_per_segment);
 
     // Append a new message. The timestamp is truncated to milliseconds to avoid
     // round-off errors.
     thread.update_time = system_clock::now();
-    thread.messages.emplace_back(time_point_cast<milliseconds>(thread.update_time), raw_payload);
-    impl->chat_threads.insert_or_assign(thread_key, thread);
+    system_time message_time = time_point_cast<milliseconds>(thread.update_time);
+    thread.messages.emplace_back(message_time, raw_payload);
+    impl->save_scheduler.mark_dirty(thread_key, steady_clock::now());
+
+    // Publish the message to agents that have subscribed to this thread. This is
+    // a best-effort notification, so there is no need to wait for responses.
+    if(auto psubs = impl->thread_subscribers.ptr(thread_key)) {
+      cow_string topic = &chat_topic_prefix;
+      topic += thread_key.rdstr();
+
+      ::taxon::V_object client_data;
+      client_data.try_emplace(&"thread_key", thread_key.rdstr());
+      client_data.try_emplace(&"message_time", message_time);
+      client_data.try_emplace(&"raw_payload", raw_payload);
+
+      ::taxon::V_object tx_args;
+      tx_args.try_emplace(&"topic", topic);
+      tx_args.try_emplace(&"client_opcode", &"ntfy/chat/message");
+      tx_args.try_emplace(&"client_data", client_data);
+
+      auto srv_q = new_sh<Service_Future>(*psubs, &"agent/topic/publish", tx_args);
+      service.launch(srv_q);
+    }
 
     response.try_emplace(&"status", &"gs_ok");
   }
 
 void
-do_save_timer_callback(const shptr<Implementation>& impl,
-                       const shptr<::poseidon::Abstract_Timer>& /*timer*/,
-                       ::poseidon::Abstract_Fiber& fiber, steady_time /*now*/)
+do_thread_subscribe(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& /*fiber*/,
+                    const ::poseidon::UUID& request_service_uuid,
+                    ::taxon::V_object& response, const ::taxon::V_object& request)
   {
-    if(impl->db_ready == false) {
-      // Check tables.
-      do_mysql_check_table_chat(fiber);
-      impl->db_ready = true;
-    }
+    // * Request Parameters
+    //
+    //   - `thread_key_list` <sub>array of strings</sub> : List of threads to subscribe
+    //     to.
+    //
+    // * Response Parameters
+    //
+    //   - `status` <sub>string</sub> : [General status code.](#general-status-codes)
+    //
+    // * Description
+    //
+    //   Replaces all subscriptions of the requesting agent with `thread_key_list`.
+    //   When a message is appended to one of these threads, it is sent to the agent
+    //   with `agent/topic/publish`, where `topic` is `chat:` followed by the thread
+    //   key. Subscriptions expire after three minutes, so agents shall send this
+    //   request periodically. An empty list cancels all subscriptions.
 
-    if(impl->save_buckets.empty()) {
-      // Arrange online chat threads for writing. Initially, threads are divided
-      // into 20 buckets. For each time tick, one bucket will be popped and
-      // written.
-      while(impl->save_buckets.size() < 20)
-        impl->save_buckets.emplace_back();
-
-      for(const auto& r : impl->chat_threads) {
-        auto current_bucket = impl->save_buckets.begin();
-        impl->save_buckets.splice(impl->save_buckets.end(), impl->save_buckets, current_bucket);
-        if(current_bucket->size() >= current_bucket->capacity()) {
-          ptrdiff_t sp = static_cast<ptrdiff_t>(current_bucket->capacity() / 2);
-          impl->save_buckets.emplace_back(current_bucket->move_begin(), current_bucket->move_begin() + sp);
-          current_bucket->erase(current_bucket->begin(), current_bucket->begin() + sp);
-        }
-        current_bucket->push_back(r.first);
+    ////////////////////////////////////////////////////////////
+    //
+    ::std::vector<phcow_string> thread_key_list;
+    if(auto plist = request.ptr(&"thread_key_list"))
+      for(const auto& r : plist->as_array()) {
+        POSEIDON_CHECK(r.as_string() != "");
+        thread_key_list.emplace_back(r.as_string());
       }
+
+    ////////////////////////////////////////////////////////////
+    //
+    do_set_agent_subscription(impl, request_service_uuid, thread_key_list,
+                              steady_clock::now() + agent_subscription_ttl);
+
+    response.try_emplace(&"status", &"gs_ok");
+  }
+
+void
+do_save_thread(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber,
+               const phcow_string& thread_key)
+  {
+    auto pth = impl->chat_threads.ptr(thread_key);
+    if(!pth)
+      return;
+
+    if(!do_is_thread_local(thread_key) && (steady_clock::now() >= impl->handover_end_time)) {
+      // This thread belongs to another service, which may have loaded it and
+      // accepted new messages after the handover window. It must not be written
+      // any more, otherwise segments of the new owner would be overwritten. If
+      // messages have not been saved, they are lost.
+      uint64_t unsaved_count = pth->messages.end_position()
+                               - ::std::max(pth->_saved_serial, pth->messages.begin_position());
+      if(unsaved_count != 0)
+        POSEIDON_LOG_ERROR((
+            "Chat thread `$1` has been handed over with $2 message(s) unsaved; ",
+            "these messages are LOST"),
+            thread_key, unsaved_count);
+
+      impl->chat_threads.erase(thread_key);
+      impl->save_scheduler.erase(thread_key);
+      return;
     }
 
-    auto bucket = move(impl->save_buckets.back());
-    impl->save_buckets.pop_back();
-    while(!bucket.empty()) {
-      phcow_string thread_key = move(bucket.back());
-      bucket.pop_back();
+    // Write segments with new messages to MySQL. Messages that have been
+    // saved are not written again, except those in the same segment as the
+    // first new message. The thread is not copied, so everything must be
+    // prepared before yielding.
+    const Chat_Thread& thread = *pth;
+    cow_string thread_key_str = thread.thread_key.rdstr();
+    uint64_t begin_serial = thread.messages.begin_position();
+    uint64_t end_serial = thread.messages.end_position();
+    uint64_t start_serial = ::std::max(thread._saved_serial, begin_serial);
+    bool purge = thread._purged_serial < begin_serial;
+    cow_vector<shptr<::poseidon::MySQL_Query_Future>> tasks;
+
+    if(start_serial < end_serial) {
+      cow_string stmt = &R"!!!(
+            REPLACE INTO `chat_segment`
+              (`thread_key`, `segment`, `update_time`, `whole`)
+              VALUES )!!!";
 
-      Chat_Thread thread;
-      if(!impl->chat_threads.find_and_copy(thread, thread_key))
-        continue;
+      cow_vector<::poseidon::MySQL_Value> sql_args;
+      for(uint64_t seg = start_serial / messages_per_segment;  seg * messages_per_segment < end_serial;  ++seg) {
+        Chat_Thread segment;
+        segment.thread_key = thread.thread_key;
+        segment.update_time = thread.update_time;
+
+        uint64_t first = ::std::max<uint64_t>(seg * messages_per_segment, begin_serial);
+        uint64_t last = ::std::min<uint64_t>((seg + 1) * messages_per_segment, end_serial);
+        segment.messages.reserve(static_cast<size_t>(last - first));
+        for(uint64_t k = first;  k != last;  ++k) {
+          const auto& msg = thread.messages[static_cast<size_t>(k - begin_serial)];
+          segment.messages.emplace_back(msg.first, msg.second);
+        }
 
-      if(system_clock::now() - thread.update_time > impl->cached_thread_ttl)
-        impl->chat_threads.erase(thread_key);
+        if(sql_args.size() != 0)
+          stmt += ", ";
+        stmt += "(?, ?, ?, ?)";
 
-      // Truncate the message list.
-      if(thread.messages.size() > impl->max_number_of_messages_per_thread)
-        thread.messages.erase(0, thread.messages.size() - impl->max_number_of_messages_per_thread);
+        sql_args.emplace_back(thread_key_str);                   // `thread_key`
+        sql_args.emplace_back(static_cast<int64_t>(seg));        // `segment`
+        sql_args.emplace_back(thread.update_time);               // `update_time`
+        sql_args.emplace_back(segment.serialize_to_string());    // `whole`
+      }
 
-      // Write this thread to MySQL.
-      static constexpr char replace_into_chat[] =
+      auto task1 = new_sh<::poseidon::MySQL_Query_Future>(::poseidon::mysql_connector, stmt, sql_args);
+      ::poseidon::task_scheduler.launch(task1);
+      tasks.emplace_back(task1);
+    }
+
+    if(purge) {
+      // Delete segments that have been trimmed.
+      static constexpr char delete_from_chat_segment[] =
           R"!!!(
-            REPLACE INTO `chat`
-              SET `thread_key` = ?
-                  , `update_time` = ?
-                  , `whole` = ?
+            DELETE FROM `chat_segment`
+              WHERE `thread_key` = ?
+                    AND `segment` < ?
           )!!!";
 
       cow_vector<::poseidon::MySQL_Value> sql_args;
-      sql_args.emplace_back(thread.thread_key.rdstr());      // SET `thread_key` = ?
-      sql_args.emplace_back(thread.update_time);             //     , `update_time` = ?
-      sql_args.emplace_back(thread.serialize_to_string());   //     , `whole` = ?
+      sql_args.emplace_back(thread_key_str);                // WHERE `thread_key` = ?
+      sql_args.emplace_back(static_cast<int64_t>(begin_serial / messages_per_segment));
+                                                            //       AND `segment` < ?
 
       auto task1 = new_sh<::poseidon::MySQL_Query_Future>(::poseidon::mysql_connector,
-                                                          &replace_into_chat, sql_args);
+                                                          &delete_from_chat_segment, sql_args);
       ::poseidon::task_scheduler.launch(task1);
+      tasks.emplace_back(task1);
+    }
+
+    for(const auto& task1 : tasks)
       fiber.yield(task1);
+
+    auto pmut = impl->chat_threads.mut_ptr(thread_key);
+    if(!pmut)
+      return;
+
+    // If a write has failed, segments after it must be written again, so serial
+    // numbers can't be updated. Try again later. A thread that belongs to another
+    // service is retried only until the end of the handover window.
+    for(const auto& task1 : tasks)
+      if(!task1->successful()) {
+        POSEIDON_LOG_ERROR(("Could not save chat thread `$1` into MySQL"), thread_key);
+        impl->save_scheduler.mark_dirty(thread_key, steady_clock::now());
+        return;
+      }
+
+    // Messages may have been appended in between, so only update serial
+    // numbers.
+    pmut->_saved_serial = ::std::max(pmut->_saved_serial, end_serial);
+    pmut->_purged_serial = ::std::max(pmut->_purged_serial, begin_serial);
+
+    // Evict threads that have been idle for too long, or belong to other
+    // services now, but only if everything has been saved. If not, the thread
+    // is dirty, and will be saved again.
+    if((pmut->_saved_serial >= pmut->messages.end_position())
+        && (pmut->_purged_serial >= pmut->messages.begin_position())
+        && ((system_clock::now() - pmut->update_time > impl->cached_thread_ttl)
+            || !do_is_thread_local(thread_key))) {
+      impl->chat_threads.erase(thread_key);
+      impl->save_scheduler.erase(thread_key);
+    }
+  }
+
+void
+do_save_timer_callback(const shptr<Implementation>& impl,
+                       const shptr<::poseidon::Abstract_Timer>& /*timer*/,
+                       ::poseidon::Abstract_Fiber& fiber, steady_time /*now*/)
+  {
+    if(impl->db_ready == false) {
+      // Check tables.
+      do_mysql_check_table_chat(fiber);
+      do_mysql_check_table_chat_segment(fiber);
+      impl->db_ready = true;
+    }
+
+    // Check for chat services that have come or gone. Threads that belong to
+    // other services now are written and evicted immediately. Threads that
+    // belong to this service now shall not be loaded until other services have
+    // done that.
+    ::std::vector<::poseidon::UUID> chat_services;
+    for(const auto& r : service.all_service_records())
+      if((r.second.zone_id == service.zone_id()) && (r.second.service_type == "chat"))
+        chat_services.emplace_back(r.first);
+
+    ::std::sort(chat_services.begin(), chat_services.end());
+
+    if(chat_services != impl->chat_services) {
+      POSEIDON_LOG_INFO(("Chat services changed: $1 online"), chat_services.size());
+      impl->chat_services.swap(chat_services);
+      impl->handover_end_time = steady_clock::now() + impl->handover_delay;
+
+      ::std::vector<phcow_string> foreign_keys;
+      for(const auto& r : impl->chat_threads)
+        if(!do_is_thread_local(r.first))
+          foreign_keys.emplace_back(r.first);
+
+      for(const auto& thread_key : foreign_keys)
+        do_save_thread(impl, fiber, thread_key);
+
+      if(!foreign_keys.empty())
+        POSEIDON_LOG_INFO(("Handed over $1 thread(s) to other chat services"), foreign_keys.size());
+    }
+
+    // Write threads that are due to MySQL. Threads that have received new
+    // messages are written first.
+    steady_time save_start_time = steady_clock::now();
+    ::std::vector<phcow_string> thread_keys;
+    impl->save_scheduler.pop_due(thread_keys, save_start_time);
+
+    for(const auto& thread_key : thread_keys)
+      do_save_thread(impl, fiber, thread_key);
+
+    if(!thread_keys.empty())
+      POSEIDON_LOG_INFO(("#sav# Saved into MySQL: $1 thread(s), total $2 ms; $3 due, lag $4 ms"),
+                        thread_keys.size(),
+                        duration_cast<milliseconds>(steady_clock::now() - save_start_time).count(),
+                        impl->save_scheduler.count_due(save_start_time),
+                        impl->save_scheduler.lag(save_start_time).count());
+  }
+
+void
+do_subscription_timer_callback(const shptr<Implementation>& impl,
+                               const shptr<::poseidon::Abstract_Timer>& /*timer*/,
+                               ::poseidon::Abstract_Fiber& /*fiber*/, steady_time now)
+  {
+    // Cancel subscriptions of agents that have not refreshed them, or have gone
+    // offline.
+    ::std::vector<::poseidon::UUID> expired_agents;
+    for(const auto& r : impl->agent_subscriptions)
+      if((r.second.expiry_time < now) || !service.find_service_record_opt(r.first))
+        expired_agents.emplace_back(r.first);
+
+    for(const auto& agent_service_uuid : expired_agents) {
+      POSEIDON_LOG_DEBUG(("Cancelling chat subscriptions of `$1`"), agent_service_uuid);
+      do_set_agent_subscription(impl, agent_service_uuid, { }, now);
     }
   }
 
@@ -346,20 +870,41 @@ reload(const ::poseidon::Config_File& conf_file)
     uint32_t max_number_of_messages_per_thread = static_cast<uint32_t>(conf_file.get_integer_opt(
                         &"chat.max_number_of_messages_per_thread", 1, 99999999).value_or(100));
 
+    // `chat.max_number_of_messages_per_check`
+    uint32_t max_number_of_messages_per_check = static_cast<uint32_t>(conf_file.get_integer_opt(
+                        &"chat.max_number_of_messages_per_check", 1, 99999999).value_or(1000));
+
+    // `chat.handover_delay`
+    seconds handover_delay = seconds(static_cast<int>(conf_file.get_integer_opt(
+                        &"chat.handover_delay", 0, 999).value_or(10)));
+
     // `chat.cached_thread_ttl`
     seconds cached_thread_ttl = seconds(static_cast<int>(conf_file.get_integer_opt(
                         &"chat.cached_thread_ttl", 600, 999999999).value_or(900)));
 
+    // `chat.save_rate_limit`
+    uint32_t save_rate_limit = static_cast<uint32_t>(conf_file.get_integer_opt(
+                        &"chat.save_rate_limit", 1, 999999).value_or(100)));
+
+    // `chat.save_max_staleness`
+    seconds save_max_staleness = seconds(static_cast<int>(conf_file.get_integer_opt(
+                        &"chat.save_max_staleness", 1, 86400).value_or(300)));
+
     // Set up new configuration. This operation shall be atomic.
     this->m_impl->max_number_of_messages_per_thread = max_number_of_messages_per_thread;
+    this->m_impl->max_number_of_messages_per_check = max_number_of_messages_per_check;
     this->m_impl->cached_thread_ttl = cached_thread_ttl;
+    this->m_impl->handover_delay = handover_delay;
+    this->m_impl->save_scheduler.set_limits(save_rate_limit, save_max_staleness);
 
     // Set up request handlers.
     service.set_handler(&"chat/thread/check_multi", bindw(this->m_impl, do_thread_check_multi));
     service.set_handler(&"chat/thread/append", bindw(this->m_impl, do_thread_append));
+    service.set_handler(&"chat/thread/subscribe", bindw(this->m_impl, do_thread_subscribe));
 
     // Restart the service.
-    this->m_impl->save_timer.start(100ms, 11001ms, bindw(this->m_impl, do_save_timer_callback));
+    this->m_impl->save_timer.start(100ms, 1001ms, bindw(this->m_impl, do_save_timer_callback));
+    this->m_impl->subscription_timer.start(30s, bindw(this->m_impl, do_subscription_timer_callback));
   }
 
 }  // namespace k32::chat
@@ -0,0 +1,110 @@
+// This file is part of k32.
+// Copyright (C) 2024-2026 LH_Mouse. All wrongs reserved.
+
+#include "../../xprecompiled.hpp"
+#include "blob_codec.hpp"
+#include <zlib.h>
+namespace k32 {
+namespace {
+
+// Preset dictionary #1. These are strings that occur in every role record, as
+// written by `Role_Record::serialize_to_string()` and the logic server. zlib
+// prefers the most common strings near the end. This must not be changed, or
+// existing data can't be decoded; add a new version instead.
+constexpr char dictionary_v1[] =
+    R"(":true,":false,":null,":[],":{},":0,":1,":"",":[{":{"}],"},")"
+    "\xA4roid\xA8username\xA8nickname\xABupdate_time\xA6""avatar\xA7profile\xA5whole"
+    "\xAA@home_host\xA8@home_db\xAA@home_zone\xD7\xFF"
+    R"({"roid":,"username":"","nickname":"",")";
+
+constexpr size_t max_decoded_size = 64 << 20;
+
+}  // namespace
+
+void
+blob_encode(cow_string& out, const char* data, size_t size)
+  {
+    if(size > UINT32_MAX)
+      POSEIDON_THROW(("Blob too large: `$1` bytes"), size);
+
+    ::z_stream strm = { };
+    if(::deflateInit2(&strm, 6, Z_DEFLATED, -15, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+      POSEIDON_THROW(("Could not initialize deflate stream"));
+
+    ::deflateSetDictionary(&strm, reinterpret_cast<const ::Bytef*>(dictionary_v1),
+                           sizeof(dictionary_v1) - 1);
+
+    cow_string temp;
+    temp.push_back(static_cast<char>(blob_codec_version_deflate_v1));
+    temp.append(::deflateBound(&strm, static_cast<::uLong>(size)), '\0');
+
+    strm.next_in = const_cast<::Bytef*>(reinterpret_cast<const ::Bytef*>(data));
+    strm.avail_in = static_cast<::uInt>(size);
+    strm.next_out = reinterpret_cast<::Bytef*>(temp.mut_data() + 1);
+    strm.avail_out = static_cast<::uInt>(temp.size() - 1);
+    int err = ::deflate(&strm, Z_FINISH);
+    ::deflateEnd(&strm);
+
+    if(err != Z_STREAM_END)
+      POSEIDON_THROW(("Could not compress blob: $1"), err);
+
+    temp.erase(1 + strm.total_out);
+    if((temp.size() < size) || ((size != 0) && (static_cast<uint8_t>(data[0]) == blob_codec_version_deflate_v1)))
+      out.append(temp);
+    else
+      out.append(data, size);
+  }
+
+void
+blob_decode(cow_string& out, const char* data, size_t size)
+  {
+    if((size == 0) || (static_cast<uint8_t>(data[0]) != blob_codec_version_deflate_v1)) {
+      out.append(data, size);
+      return;
+    }
+
+    if(size > UINT32_MAX)
+      POSEIDON_THROW(("Blob too large: `$1` bytes"), size);
+
+    ::z_stream strm = { };
+    if(::inflateInit2(&strm, -15) != Z_OK)
+      POSEIDON_THROW(("Could not initialize inflate stream"));
+
+    // For raw streams, the dictionary may be set right after initialization.
+    ::inflateSetDictionary(&strm, reinterpret_cast<const ::Bytef*>(dictionary_v1),
+                           sizeof(dictionary_v1) - 1);
+
+    strm.next_in = const_cast<::Bytef*>(reinterpret_cast<const ::Bytef*>(data + 1));
+    strm.avail_in = static_cast<::uInt>(size - 1);
+
+    size_t out_start = out.size();
+    int err = Z_OK;
+    while(err != Z_STREAM_END) {
+      size_t chunk = ::std::max<size_t>(size * 4, 1024);
+      if(out.size() - out_start + chunk > max_decoded_size) {
+        ::inflateEnd(&strm);
+        POSEIDON_THROW(("Decoded blob too large"));
+      }
+
+      size_t out_pos = out.size();
+      out.append(chunk, '\0');
+      strm.next_out = reinterpret_cast<::Bytef*>(out.mut_data() + out_pos);
+      strm.avail_out = static_cast<::uInt>(chunk);
+      err = ::inflate(&strm, Z_FINISH);
+      out.erase(out.size() - strm.avail_out);
+
+      if((err != Z_STREAM_END) && (err != Z_BUF_ERROR) && (err != Z_OK)) {
+        ::inflateEnd(&strm);
+        POSEIDON_THROW(("Could not decompress blob: $1"), err);
+      }
+
+      if((err != Z_STREAM_END) && (strm.avail_in == 0) && (strm.avail_out != 0)) {
+        ::inflateEnd(&strm);
+        POSEIDON_THROW(("Compressed blob truncated"));
+      }
+    }
+
+    ::inflateEnd(&strm);
+  }
+
+}  // namespace k32
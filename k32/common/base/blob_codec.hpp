@@ -0,0 +1,57 @@
+// This file is part of k32.
+// Copyright (C) 2024-2026 LH_Mouse. All wrongs reserved.
+
+#ifndef K32_COMMON_BASE_BLOB_CODEC_
+#define K32_COMMON_BASE_BLOB_CODEC_
+
+#include "../../fwd.hpp"
+namespace k32 {
+
+// Versions of the compact format, which are stored in the first byte. Strings
+// that don't begin with any of these bytes are not encoded.
+enum Blob_Codec_Version : uint8_t
+  {
+    blob_codec_version_deflate_v1  = 0x01,  // raw deflate with dictionary #1
+  };
+
+// Checks whether a string is in the compact format.
+inline
+bool
+blob_is_encoded(const cow_string& data)
+  noexcept
+  {
+    return (data.size() != 0) && (static_cast<uint8_t>(data[0]) == blob_codec_version_deflate_v1);
+  }
+
+// Encodes a string in the compact format, and appends it to `out`. If this does
+// not make it shorter, it is appended as is, unless it could be mistaken for an
+// encoded one.
+void
+blob_encode(cow_string& out, const char* data, size_t size);
+
+inline
+cow_string
+blob_encode(const cow_string& text)
+  {
+    cow_string out;
+    blob_encode(out, text.data(), text.size());
+    return out;
+  }
+
+// Decodes a string in the compact format, and appends it to `out`. Strings that
+// are not encoded, such as those that were stored by earlier versions, are
+// appended as is. If the string is corrupted, an exception is thrown.
+void
+blob_decode(cow_string& out, const char* data, size_t size);
+
+inline
+cow_string
+blob_decode(const cow_string& data)
+  {
+    cow_string out;
+    blob_decode(out, data.data(), data.size());
+    return out;
+  }
+
+}  // namespace k32
+#endif
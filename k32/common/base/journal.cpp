@@ -0,0 +1,241 @@
+// This file is part of k32.
+// Copyright (C) 2024-2026 LH_Mouse. All wrongs reserved.
+
+#include "../../xprecompiled.hpp"
+#include "journal.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+namespace k32 {
+namespace {
+
+// The file begins with a header of 16 bytes, which is followed by records.
+// Each record consists of its size (32 bits), its checksum (32 bits), its key
+// (64 bits), and its data, and is padded to a multiple of 8 bytes. The rest of
+// the file is filled with zeroes. All integers are in native byte order, as
+// the file is not meant to be copied to other machines.
+constexpr char file_magic[16] = "k32-journal-v1";
+constexpr size_t header_size = 16;
+constexpr size_t capacity_granularity = 1048576;
+
+size_t
+do_round_up(size_t value, size_t alignment)
+  {
+    return (value + alignment - 1) / alignment * alignment;
+  }
+
+uint32_t
+do_checksum(int64_t key, const char* data, size_t size)
+  {
+    // FNV-1a
+    uint32_t h = 0x811C9DC5;
+    for(uint32_t k = 0;  k != 8;  ++k)
+      h = (h ^ (static_cast<uint64_t>(key) >> k * 8 & 0xFF)) * 0x01000193;
+    for(size_t k = 0;  k != size;  ++k)
+      h = (h ^ static_cast<unsigned char>(data[k])) * 0x01000193;
+    return h;
+  }
+
+}  // namespace
+
+Journal::
+~Journal()
+  {
+    this->close();
+  }
+
+void
+Journal::
+do_map(int fd, size_t capacity)
+  {
+    if(::ftruncate(fd, static_cast<::off_t>(capacity)) != 0)
+      POSEIDON_THROW((
+          "Could not resize journal file `$1` to `$2` bytes",
+          "[`ftruncate()` failed: ${errno:full}]"),
+          this->m_path, capacity);
+
+    void* data = ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(data == MAP_FAILED)
+      POSEIDON_THROW((
+          "Could not map journal file `$1`",
+          "[`mmap()` failed: ${errno:full}]"),
+          this->m_path);
+
+    this->do_unmap();
+    this->m_data = static_cast<char*>(data);
+    this->m_capacity = capacity;
+  }
+
+void
+Journal::
+do_unmap()
+  noexcept
+  {
+    if(this->m_data)
+      ::munmap(this->m_data, this->m_capacity);
+
+    this->m_data = nullptr;
+    this->m_capacity = 0;
+  }
+
+void
+Journal::
+open(cow_int64_dictionary<cow_string>& records, const cow_string& path)
+  {
+    this->close();
+    this->m_path = path;
+
+    this->m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(this->m_fd == -1)
+      POSEIDON_THROW((
+          "Could not open journal file `$1`",
+          "[`open()` failed: ${errno:full}]"),
+          path);
+
+    struct ::stat st;
+    if(::fstat(this->m_fd, &st) != 0)
+      POSEIDON_THROW((
+          "Could not get properties of journal file `$1`",
+          "[`fstat()` failed: ${errno:full}]"),
+          path);
+
+    size_t file_size = static_cast<size_t>(st.st_size);
+    this->do_map(this->m_fd, do_round_up(::std::max(file_size, header_size), capacity_granularity));
+
+    if(file_size == 0)
+      ::memcpy(this->m_data, file_magic, header_size);
+    else if(::memcmp(this->m_data, file_magic, header_size) != 0)
+      POSEIDON_THROW(("Invalid journal file `$1`"), path);
+
+    // Read records until the first one that is empty or broken.
+    size_t offset = header_size;
+    while(this->m_capacity - offset >= 16) {
+      uint32_t rsize, checksum;
+      int64_t key;
+      ::memcpy(&rsize, this->m_data + offset, 4);
+      ::memcpy(&checksum, this->m_data + offset + 4, 4);
+      ::memcpy(&key, this->m_data + offset + 8, 8);
+
+      if(rsize == 0)
+        break;
+
+      if((rsize < 16) || (rsize > this->m_capacity - offset)
+         || (checksum != do_checksum(key, this->m_data + offset + 16, rsize - 16U))) {
+        // Discard this record and everything after it, so they will not be
+        // mistaken for valid ones in the future.
+        POSEIDON_LOG_WARN(("Discarding incomplete record at offset `$1` in journal file `$2`"), offset, path);
+        ::memset(this->m_data + offset, 0, this->m_capacity - offset);
+        break;
+      }
+
+      records.insert_or_assign(key, cow_string(this->m_data + offset + 16, rsize - 16U));
+      offset += do_round_up(rsize, 8);
+    }
+
+    this->m_size = offset;
+    POSEIDON_LOG_INFO(("Opened journal file `$1`: $2 bytes in use"), path, this->m_size);
+  }
+
+void
+Journal::
+close()
+  noexcept
+  {
+    this->do_unmap();
+
+    if(this->m_fd != -1)
+      ::close(this->m_fd);
+
+    this->m_fd = -1;
+    this->m_size = 0;
+  }
+
+void
+Journal::
+append(int64_t key, const cow_string& data)
+  {
+    if(!this->m_data)
+      POSEIDON_THROW(("Journal not open"));
+
+    if(data.size() > UINT32_MAX - 16)
+      POSEIDON_THROW(("Journal record too large: `$1` bytes"), data.size());
+
+    uint32_t rsize = static_cast<uint32_t>(16 + data.size());
+    size_t asize = do_round_up(rsize, 8);
+    if(asize > this->m_capacity - this->m_size)
+      this->do_map(this->m_fd, do_round_up(::std::max(this->m_capacity * 2, this->m_size + asize),
+                                           capacity_granularity));
+
+    // Write the size last, so an incomplete record will fail the checksum.
+    uint32_t checksum = do_checksum(key, data.data(), data.size());
+    char* rptr = this->m_data + this->m_size;
+    ::memcpy(rptr + 8, &key, 8);
+    ::memcpy(rptr + 16, data.data(), data.size());
+    ::memcpy(rptr + 4, &checksum, 4);
+    ::memcpy(rptr, &rsize, 4);
+    this->m_size += asize;
+  }
+
+void
+Journal::
+flush()
+  {
+    if(!this->m_data)
+      return;
+
+    if(::msync(this->m_data, this->m_size, MS_ASYNC) != 0)
+      POSEIDON_THROW((
+          "Could not flush journal file `$1`",
+          "[`msync()` failed: ${errno:full}]"),
+          this->m_path);
+  }
+
+void
+Journal::
+rewrite(const cow_int64_dictionary<cow_string>& records)
+  {
+    if(!this->m_data)
+      POSEIDON_THROW(("Journal not open"));
+
+    size_t size = header_size;
+    for(const auto& r : records)
+      size += do_round_up(16 + r.second.size(), 8);
+
+    Journal temp;
+    temp.m_path = this->m_path + ".new";
+    temp.m_fd = ::open(temp.m_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(temp.m_fd == -1)
+      POSEIDON_THROW((
+          "Could not create journal file `$1`",
+          "[`open()` failed: ${errno:full}]"),
+          temp.m_path);
+
+    temp.do_map(temp.m_fd, do_round_up(size, capacity_granularity));
+    ::memcpy(temp.m_data, file_magic, header_size);
+    temp.m_size = header_size;
+
+    for(const auto& r : records)
+      temp.append(r.first, r.second);
+
+    // The new file must have been written to disk before it replaces the old
+    // one, otherwise both may be lost after a system crash.
+    if(::fsync(temp.m_fd) != 0)
+      POSEIDON_THROW((
+          "Could not write journal file `$1`",
+          "[`fsync()` failed: ${errno:full}]"),
+          temp.m_path);
+
+    if(::rename(temp.m_path.c_str(), this->m_path.c_str()) != 0)
+      POSEIDON_THROW((
+          "Could not rename journal file `$1` to `$2`",
+          "[`rename()` failed: ${errno:full}]"),
+          temp.m_path, this->m_path);
+
+    ::std::swap(this->m_fd, temp.m_fd);
+    ::std::swap(this->m_data, temp.m_data);
+    ::std::swap(this->m_capacity, temp.m_capacity);
+    ::std::swap(this->m_size, temp.m_size);
+  }
+
+}  // namespace k32
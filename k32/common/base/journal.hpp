@@ -0,0 +1,85 @@
+// This file is part of k32.
+// Copyright (C) 2024-2026 LH_Mouse. All wrongs reserved.
+
+#ifndef K32_COMMON_BASE_JOURNAL_
+#define K32_COMMON_BASE_JOURNAL_
+
+#include "../../fwd.hpp"
+namespace k32 {
+
+// This class maintains an append-only file of records, each of which consists
+// of an integer key and a string. The file is mapped into memory, so appending
+// a record is merely a copy. Records survive crashes of the process as soon as
+// they have been appended, and crashes of the system after `flush()`.
+class Journal
+  {
+  private:
+    cow_string m_path;
+    int m_fd = -1;
+    char* m_data = nullptr;
+    size_t m_capacity = 0;
+    size_t m_size = 0;
+
+  private:
+    void
+    do_map(int fd, size_t capacity);
+
+    void
+    do_unmap()
+      noexcept;
+
+  public:
+    Journal() noexcept = default;
+
+  public:
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) & = delete;
+    ~Journal();
+
+    // Gets the path to the file, which has been passed to `open()`.
+    const cow_string&
+    path()
+      const noexcept
+      { return this->m_path;  }
+
+    bool
+    is_open()
+      const noexcept
+      { return this->m_fd != -1;  }
+
+    // Gets the number of bytes that are in use, including the file header.
+    size_t
+    size()
+      const noexcept
+      { return this->m_size;  }
+
+    // Opens a journal file, creating one if it doesn't exist, and reads all
+    // records from it. For each key, only the last record is stored into
+    // `records`. An incomplete record at the end of the file, which is likely
+    // the result of a system crash, is discarded.
+    void
+    open(cow_int64_dictionary<cow_string>& records, const cow_string& path);
+
+    // Closes the file. Records that have been appended are not lost.
+    void
+    close()
+      noexcept;
+
+    // Appends a record to the end of the file. If there is not enough space,
+    // the file is extended.
+    void
+    append(int64_t key, const cow_string& data);
+
+    // Schedules all records that have been appended to be written to disk. This
+    // function does not block.
+    void
+    flush();
+
+    // Replaces all records in the file with `records`. A new file is written and
+    // then renamed to the old one, so this operation is atomic.
+    void
+    rewrite(const cow_int64_dictionary<cow_string>& records);
+  };
+
+}  // namespace k32
+#endif
@@ -0,0 +1,634 @@
+// This file is part of k32.
+// Copyright (C) 2024-2026 LH_Mouse. All wrongs reserved.
+
+#include "../../xprecompiled.hpp"
+#include "msgpack.hpp"
+namespace k32 {
+namespace {
+
+constexpr int max_nesting_depth = 64;
+
+void
+do_put_bits(cow_string& str, uint64_t bits, size_t n)
+  {
+    for(size_t k = n;  k != 0;  --k)
+      str.push_back(static_cast<char>(bits >> (k - 1) * 8));
+  }
+
+void
+do_put_be(cow_string& str, uint8_t tag, uint64_t bits, size_t n)
+  {
+    str.push_back(static_cast<char>(tag));
+    do_put_bits(str, bits, n);
+  }
+
+void
+do_put_header(cow_string& str, size_t len, uint8_t fix_tag, size_t fix_limit,
+              int tag8, uint8_t tag16, uint8_t tag32)
+  {
+    if(len < fix_limit)
+      str.push_back(static_cast<char>(fix_tag | len));
+    else if((tag8 >= 0) && (len <= UINT8_MAX))
+      do_put_be(str, static_cast<uint8_t>(tag8), len, 1);
+    else if(len <= UINT16_MAX)
+      do_put_be(str, tag16, len, 2);
+    else if(len <= UINT32_MAX)
+      do_put_be(str, tag32, len, 4);
+    else
+      POSEIDON_THROW(("MessagePack length `$1` out of range"), len);
+  }
+
+void
+do_encode(cow_string& str, const ::taxon::Value& value)
+  {
+    switch(value.type())
+      {
+      case ::taxon::t_null:
+        msgpack_put_nil(str);
+        break;
+
+      case ::taxon::t_boolean:
+        msgpack_put_boolean(str, value.as_boolean());
+        break;
+
+      case ::taxon::t_integer:
+        msgpack_put_integer(str, value.as_integer());
+        break;
+
+      case ::taxon::t_number:
+        msgpack_put_number(str, value.as_number());
+        break;
+
+      case ::taxon::t_string:
+        msgpack_put_string(str, value.as_string().data(), value.as_string_length());
+        break;
+
+      case ::taxon::t_binary:
+        msgpack_put_binary(str, value.as_binary_data(), value.as_binary_size());
+        break;
+
+      case ::taxon::t_time:
+        msgpack_put_time(str, value.as_time());
+        break;
+
+      case ::taxon::t_array:
+        msgpack_put_array_header(str, value.as_array().size());
+        for(const auto& r : value.as_array())
+          do_encode(str, r);
+        break;
+
+      case ::taxon::t_object:
+        msgpack_put_map_header(str, value.as_object().size());
+        for(const auto& r : value.as_object()) {
+          msgpack_put_string(str, r.first.data(), r.first.size());
+          do_encode(str, r.second);
+        }
+        break;
+
+      default:
+        POSEIDON_THROW(("Value type `$1` not encodable"), static_cast<int>(value.type()));
+      }
+  }
+
+void
+do_decode(::taxon::Value& value, Msgpack_Reader& reader, int depth)
+  {
+    if(depth > max_nesting_depth)
+      POSEIDON_THROW(("MessagePack nesting too deep"));
+
+    switch(reader.peek_type())
+      {
+      case msgpack_type_nil:
+        reader.get_nil();
+        value.clear();
+        break;
+
+      case msgpack_type_boolean:
+        value = reader.get_boolean();
+        break;
+
+      case msgpack_type_integer:
+        value = reader.get_integer();
+        break;
+
+      case msgpack_type_number:
+        value = reader.get_number();
+        break;
+
+      case msgpack_type_string:
+        {
+          const char* data;
+          size_t len = reader.get_string_ref(data);
+          value = cow_string(data, len);
+          break;
+        }
+
+      case msgpack_type_binary:
+        {
+          const unsigned char* data;
+          size_t len = reader.get_binary_ref(data);
+          auto& bin = value.open_binary();
+          bin.clear();
+          bin.append(data, len);
+          break;
+        }
+
+      case msgpack_type_time:
+        value = reader.get_time();
+        break;
+
+      case msgpack_type_array:
+        {
+          size_t count = reader.get_array_header();
+          auto& arr = value.open_array();
+          arr.clear();
+          arr.reserve(count);
+          for(size_t k = 0;  k != count;  ++k)
+            do_decode(arr.emplace_back(), reader, depth + 1);
+          break;
+        }
+
+      case msgpack_type_map:
+        {
+          size_t count = reader.get_map_header();
+          auto& obj = value.open_object();
+          obj.clear();
+          for(size_t k = 0;  k != count;  ++k) {
+            if(reader.peek_type() != msgpack_type_string)
+              POSEIDON_THROW(("MessagePack map key not a string"));
+
+            const char* data;
+            size_t len = reader.get_string_ref(data);
+            do_decode(obj.open(cow_string(data, len)), reader, depth + 1);
+          }
+          break;
+        }
+
+      default:
+        ROCKET_UNREACHABLE();
+      }
+  }
+
+}  // namespace
+
+void
+msgpack_encode(cow_string& str, const ::taxon::Value& value)
+  {
+    do_encode(str, value);
+  }
+
+void
+msgpack_decode(::taxon::Value& value, const char* data, size_t size)
+  {
+    Msgpack_Reader reader(data, size);
+    do_decode(value, reader, 0);
+
+    if(reader.avail() != 0)
+      POSEIDON_THROW(("Trailing garbage after MessagePack value"));
+  }
+
+void
+msgpack_put_nil(cow_string& str)
+  {
+    str.push_back('\xC0');
+  }
+
+void
+msgpack_put_boolean(cow_string& str, bool value)
+  {
+    str.push_back(value ? '\xC3' : '\xC2');
+  }
+
+void
+msgpack_put_integer(cow_string& str, int64_t value)
+  {
+    if(value >= 0) {
+      if(value <= 0x7F)
+        str.push_back(static_cast<char>(value));
+      else if(value <= UINT8_MAX)
+        do_put_be(str, 0xCC, static_cast<uint64_t>(value), 1);
+      else if(value <= UINT16_MAX)
+        do_put_be(str, 0xCD, static_cast<uint64_t>(value), 2);
+      else if(value <= UINT32_MAX)
+        do_put_be(str, 0xCE, static_cast<uint64_t>(value), 4);
+      else
+        do_put_be(str, 0xCF, static_cast<uint64_t>(value), 8);
+    }
+    else {
+      if(value >= -32)
+        str.push_back(static_cast<char>(value));
+      else if(value >= INT8_MIN)
+        do_put_be(str, 0xD0, static_cast<uint64_t>(value), 1);
+      else if(value >= INT16_MIN)
+        do_put_be(str, 0xD1, static_cast<uint64_t>(value), 2);
+      else if(value >= INT32_MIN)
+        do_put_be(str, 0xD2, static_cast<uint64_t>(value), 4);
+      else
+        do_put_be(str, 0xD3, static_cast<uint64_t>(value), 8);
+    }
+  }
+
+void
+msgpack_put_number(cow_string& str, double value)
+  {
+    uint64_t bits;
+    ::memcpy(&bits, &value, 8);
+    do_put_be(str, 0xCB, bits, 8);
+  }
+
+void
+msgpack_put_string(cow_string& str, const char* data, size_t size)
+  {
+    do_put_header(str, size, 0xA0, 32, 0xD9, 0xDA, 0xDB);
+    str.append(data, size);
+  }
+
+void
+msgpack_put_binary(cow_string& str, const unsigned char* data, size_t size)
+  {
+    do_put_header(str, size, 0, 0, 0xC4, 0xC5, 0xC6);
+    str.append(reinterpret_cast<const char*>(data), size);
+  }
+
+void
+msgpack_put_time(cow_string& str, system_time value)
+  {
+    // Use the 64-bit form if possible, and the 96-bit form otherwise.
+    auto ns = duration_cast<nanoseconds>(value.time_since_epoch()).count();
+    int64_t sec = ns / 1000000000;
+    int64_t nsec = ns % 1000000000;
+    if(nsec < 0) {
+      sec --;
+      nsec += 1000000000;
+    }
+
+    if((sec >= 0) && (sec >> 34 == 0)) {
+      do_put_be(str, 0xD7, 0xFF, 1);
+      do_put_bits(str, static_cast<uint64_t>(nsec) << 34 | static_cast<uint64_t>(sec), 8);
+    }
+    else {
+      do_put_be(str, 0xC7, 12, 1);
+      str.push_back('\xFF');
+      do_put_bits(str, static_cast<uint64_t>(nsec), 4);
+      do_put_bits(str, static_cast<uint64_t>(sec), 8);
+    }
+  }
+
+void
+msgpack_put_array_header(cow_string& str, size_t count)
+  {
+    do_put_header(str, count, 0x90, 16, -1, 0xDC, 0xDD);
+  }
+
+void
+msgpack_put_map_header(cow_string& str, size_t count)
+  {
+    do_put_header(str, count, 0x80, 16, -1, 0xDE, 0xDF);
+  }
+
+const unsigned char*
+Msgpack_Reader::
+do_get_bytes(size_t n)
+  {
+    if(this->avail() < n)
+      POSEIDON_THROW(("MessagePack data truncated"));
+
+    auto ptr = this->m_bp;
+    this->m_bp += n;
+    return ptr;
+  }
+
+uint64_t
+Msgpack_Reader::
+do_get_be(size_t n)
+  {
+    auto ptr = this->do_get_bytes(n);
+    uint64_t bits = 0;
+    for(size_t k = 0;  k != n;  ++k)
+      bits = bits << 8 | ptr[k];
+    return bits;
+  }
+
+Msgpack_Type
+Msgpack_Reader::
+peek_type()
+  const
+  {
+    if(this->m_bp == this->m_ep)
+      POSEIDON_THROW(("MessagePack data truncated"));
+
+    uint8_t tag = this->m_bp[0];
+    if((tag <= 0x7F) || (tag >= 0xE0))
+      return msgpack_type_integer;
+    else if(tag <= 0x8F)
+      return msgpack_type_map;
+    else if(tag <= 0x9F)
+      return msgpack_type_array;
+    else if(tag <= 0xBF)
+      return msgpack_type_string;
+
+    switch(tag)
+      {
+      case 0xC0:
+        return msgpack_type_nil;
+
+      case 0xC2:
+      case 0xC3:
+        return msgpack_type_boolean;
+
+      case 0xC4:
+      case 0xC5:
+      case 0xC6:
+        return msgpack_type_binary;
+
+      case 0xC7:
+      case 0xC8:
+      case 0xC9:
+      case 0xD4:
+      case 0xD5:
+      case 0xD6:
+      case 0xD7:
+      case 0xD8:
+        return msgpack_type_time;
+
+      case 0xCA:
+      case 0xCB:
+        return msgpack_type_number;
+
+      case 0xCF:
+        // An unsigned integer that doesn't fit in `int64_t` is a number.
+        if((this->avail() >= 2) && (this->m_bp[1] & 0x80))
+          return msgpack_type_number;
+        return msgpack_type_integer;
+
+      case 0xCC:
+      case 0xCD:
+      case 0xCE:
+      case 0xD0:
+      case 0xD1:
+      case 0xD2:
+      case 0xD3:
+        return msgpack_type_integer;
+
+      case 0xD9:
+      case 0xDA:
+      case 0xDB:
+        return msgpack_type_string;
+
+      case 0xDC:
+      case 0xDD:
+        return msgpack_type_array;
+
+      case 0xDE:
+      case 0xDF:
+        return msgpack_type_map;
+
+      default:
+        POSEIDON_THROW(("MessagePack tag `$1` invalid"), static_cast<int>(tag));
+      }
+  }
+
+void
+Msgpack_Reader::
+get_nil()
+  {
+    if(this->peek_type() != msgpack_type_nil)
+      POSEIDON_THROW(("MessagePack value not nil"));
+
+    this->m_bp ++;
+  }
+
+bool
+Msgpack_Reader::
+get_boolean()
+  {
+    if(this->peek_type() != msgpack_type_boolean)
+      POSEIDON_THROW(("MessagePack value not a boolean"));
+
+    return *(this->m_bp ++) == 0xC3;
+  }
+
+int64_t
+Msgpack_Reader::
+get_integer()
+  {
+    if(this->peek_type() != msgpack_type_integer)
+      POSEIDON_THROW(("MessagePack value not an integer"));
+
+    uint8_t tag = *(this->m_bp ++);
+    if((tag <= 0x7F) || (tag >= 0xE0))
+      return static_cast<int8_t>(tag);
+    else if(tag <= 0xCF)
+      return static_cast<int64_t>(this->do_get_be(1U << (tag - 0xCC)));
+
+    // Sign-extend the value.
+    unsigned int shift = 64U - (8U << (tag - 0xD0));
+    uint64_t bits = this->do_get_be(1U << (tag - 0xD0)) << shift;
+    return static_cast<int64_t>(bits) >> shift;
+  }
+
+double
+Msgpack_Reader::
+get_number()
+  {
+    Msgpack_Type type = this->peek_type();
+    if(type == msgpack_type_integer)
+      return static_cast<double>(this->get_integer());
+    else if(type != msgpack_type_number)
+      POSEIDON_THROW(("MessagePack value not a number"));
+
+    uint8_t tag = *(this->m_bp ++);
+    if(tag == 0xCF)
+      return static_cast<double>(this->do_get_be(8));
+
+    if(tag == 0xCA) {
+      uint32_t bits = static_cast<uint32_t>(this->do_get_be(4));
+      float val;
+      ::memcpy(&val, &bits, 4);
+      return static_cast<double>(val);
+    }
+
+    uint64_t bits = this->do_get_be(8);
+    double val;
+    ::memcpy(&val, &bits, 8);
+    return val;
+  }
+
+size_t
+Msgpack_Reader::
+get_string_ref(const char*& data)
+  {
+    if(this->peek_type() != msgpack_type_string)
+      POSEIDON_THROW(("MessagePack value not a string"));
+
+    uint8_t tag = *(this->m_bp ++);
+    size_t len;
+    if(tag <= 0xBF)
+      len = tag & 0x1FU;
+    else
+      len = static_cast<size_t>(this->do_get_be(1U << (tag - 0xD9)));
+
+    data = reinterpret_cast<const char*>(this->do_get_bytes(len));
+    return len;
+  }
+
+void
+Msgpack_Reader::
+get_string(cow_string& str)
+  {
+    const char* data;
+    size_t len = this->get_string_ref(data);
+    str.assign(data, len);
+  }
+
+size_t
+Msgpack_Reader::
+get_binary_ref(const unsigned char*& data)
+  {
+    if(this->peek_type() != msgpack_type_binary)
+      POSEIDON_THROW(("MessagePack value not a binary"));
+
+    uint8_t tag = *(this->m_bp ++);
+    size_t len = static_cast<size_t>(this->do_get_be(1U << (tag - 0xC4)));
+    data = this->do_get_bytes(len);
+    return len;
+  }
+
+system_time
+Msgpack_Reader::
+get_time()
+  {
+    if(this->peek_type() != msgpack_type_time)
+      POSEIDON_THROW(("MessagePack value not a timestamp"));
+
+    uint8_t tag = *(this->m_bp ++);
+    size_t len;
+    if(tag <= 0xC9)
+      len = static_cast<size_t>(this->do_get_be(1U << (tag - 0xC7)));
+    else
+      len = 1U << (tag - 0xD4);
+
+    int8_t type = static_cast<int8_t>(this->do_get_be(1));
+    if(type != -1)
+      POSEIDON_THROW(("MessagePack extension type `$1` not supported"), static_cast<int>(type));
+
+    int64_t sec, nsec;
+    if(len == 4) {
+      sec = static_cast<int64_t>(this->do_get_be(4));
+      nsec = 0;
+    }
+    else if(len == 8) {
+      uint64_t bits = this->do_get_be(8);
+      sec = static_cast<int64_t>(bits & 0x3FFFFFFFFULL);
+      nsec = static_cast<int64_t>(bits >> 34);
+    }
+    else if(len == 12) {
+      nsec = static_cast<int64_t>(this->do_get_be(4));
+      sec = static_cast<int64_t>(this->do_get_be(8));
+    }
+    else
+      POSEIDON_THROW(("MessagePack timestamp length `$1` invalid"), len);
+
+    if((nsec >= 1000000000) || (sec < -9000000000LL) || (sec > 9000000000LL))
+      POSEIDON_THROW(("MessagePack timestamp out of range"));
+
+    return system_time(duration_cast<system_clock::duration>(seconds(sec) + nanoseconds(nsec)));
+  }
+
+size_t
+Msgpack_Reader::
+get_array_header()
+  {
+    if(this->peek_type() != msgpack_type_array)
+      POSEIDON_THROW(("MessagePack value not an array"));
+
+    uint8_t tag = *(this->m_bp ++);
+    size_t count;
+    if(tag <= 0x9F)
+      count = tag & 0x0FU;
+    else
+      count = static_cast<size_t>(this->do_get_be(2U << (tag - 0xDC)));
+
+    // Each element takes at least one byte.
+    if(count > this->avail())
+      POSEIDON_THROW(("MessagePack data truncated"));
+
+    return count;
+  }
+
+size_t
+Msgpack_Reader::
+get_map_header()
+  {
+    if(this->peek_type() != msgpack_type_map)
+      POSEIDON_THROW(("MessagePack value not a map"));
+
+    uint8_t tag = *(this->m_bp ++);
+    size_t count;
+    if(tag <= 0x8F)
+      count = tag & 0x0FU;
+    else
+      count = static_cast<size_t>(this->do_get_be(2U << (tag - 0xDE)));
+
+    // Each pair takes at least two bytes.
+    if(count > this->avail() / 2)
+      POSEIDON_THROW(("MessagePack data truncated"));
+
+    return count;
+  }
+
+void
+Msgpack_Reader::
+skip()
+  {
+    // Count values instead of recursing, so deep nesting is harmless.
+    const char* sdata;
+    const unsigned char* bdata;
+    size_t pending = 1;
+    while(pending != 0) {
+      pending --;
+      switch(this->peek_type())
+        {
+        case msgpack_type_nil:
+          this->get_nil();
+          break;
+
+        case msgpack_type_boolean:
+          this->get_boolean();
+          break;
+
+        case msgpack_type_integer:
+          this->get_integer();
+          break;
+
+        case msgpack_type_number:
+          this->get_number();
+          break;
+
+        case msgpack_type_string:
+          this->get_string_ref(sdata);
+          break;
+
+        case msgpack_type_binary:
+          this->get_binary_ref(bdata);
+          break;
+
+        case msgpack_type_time:
+          this->get_time();
+          break;
+
+        case msgpack_type_array:
+          pending += this->get_array_header();
+          break;
+
+        case msgpack_type_map:
+          pending += this->get_map_header() * 2;
+          break;
+
+        default:
+          ROCKET_UNREACHABLE();
+        }
+    }
+  }
+
+}  // namespace k32
@@ -0,0 +1,184 @@
+// This file is part of k32.
+// Copyright (C) 2024-2026 LH_Mouse. All wrongs reserved.
+
+#ifndef K32_COMMON_BASE_MSGPACK_
+#define K32_COMMON_BASE_MSGPACK_
+
+#include "../../fwd.hpp"
+namespace k32 {
+
+// Encodes a value in MessagePack, and appends it to `str`. Integers are stored
+// in their shortest forms. Timestamps are stored as the predefined timestamp
+// extension type (-1).
+void
+msgpack_encode(cow_string& str, const ::taxon::Value& value);
+
+// Decodes a value in MessagePack. Maps must have string keys. If the buffer
+// contains invalid data or trailing garbage, an exception is thrown.
+void
+msgpack_decode(::taxon::Value& value, const char* data, size_t size);
+
+// Checks whether a string begins with a MessagePack map header. This tells
+// MessagePack records from JSON ones, which never begin with these bytes. It
+// is also needed for blobs, which are stored as is if they don't compress.
+inline
+bool
+msgpack_is_map(const cow_string& data)
+  noexcept
+  {
+    if(data.size() == 0)
+      return false;
+
+    uint8_t b = static_cast<uint8_t>(data[0]);
+    return ((b & 0xF0) == 0x80) || (b == 0xDE) || (b == 0xDF);
+  }
+
+// Types of MessagePack values
+enum Msgpack_Type : uint8_t
+  {
+    msgpack_type_nil      = 0,
+    msgpack_type_boolean  = 1,
+    msgpack_type_integer  = 2,
+    msgpack_type_number   = 3,
+    msgpack_type_string   = 4,
+    msgpack_type_binary   = 5,
+    msgpack_type_time     = 6,
+    msgpack_type_array    = 7,
+    msgpack_type_map      = 8,
+  };
+
+// These functions append a single value to `str`, without building a tree of
+// `::taxon::Value`. After an array or map header, the caller shall append the
+// exact number of elements or key-value pairs.
+void
+msgpack_put_nil(cow_string& str);
+
+void
+msgpack_put_boolean(cow_string& str, bool value);
+
+void
+msgpack_put_integer(cow_string& str, int64_t value);
+
+void
+msgpack_put_number(cow_string& str, double value);
+
+void
+msgpack_put_string(cow_string& str, const char* data, size_t size);
+
+inline
+void
+msgpack_put_string(cow_string& str, const char* data)
+  {
+    msgpack_put_string(str, data, ::strlen(data));
+  }
+
+inline
+void
+msgpack_put_string(cow_string& str, const cow_string& value)
+  {
+    msgpack_put_string(str, value.data(), value.size());
+  }
+
+void
+msgpack_put_binary(cow_string& str, const unsigned char* data, size_t size);
+
+void
+msgpack_put_time(cow_string& str, system_time value);
+
+void
+msgpack_put_array_header(cow_string& str, size_t count);
+
+void
+msgpack_put_map_header(cow_string& str, size_t count);
+
+// This class reads values from a buffer one by one, without building a tree of
+// `::taxon::Value`. Strings and binaries may be referenced in place. If a value
+// is not of the expected type, or the buffer is truncated, an exception is
+// thrown.
+class Msgpack_Reader
+  {
+  private:
+    const unsigned char* m_bp;
+    const unsigned char* m_ep;
+
+  private:
+    const unsigned char*
+    do_get_bytes(size_t n);
+
+    uint64_t
+    do_get_be(size_t n);
+
+  public:
+    Msgpack_Reader(const char* data, size_t size)
+      noexcept
+      : m_bp(reinterpret_cast<const unsigned char*>(data)),
+        m_ep(reinterpret_cast<const unsigned char*>(data) + size)
+      { }
+
+  public:
+    Msgpack_Reader(const Msgpack_Reader&) = default;
+    Msgpack_Reader& operator=(const Msgpack_Reader&) & = default;
+
+    // Gets the number of bytes that have not been read.
+    size_t
+    avail()
+      const noexcept
+      { return static_cast<size_t>(this->m_ep - this->m_bp);  }
+
+    // Gets the type of the next value, without consuming it.
+    Msgpack_Type
+    peek_type()
+      const;
+
+    void
+    get_nil();
+
+    bool
+    get_boolean();
+
+    int64_t
+    get_integer();
+
+    // Integers are also accepted, and converted.
+    double
+    get_number();
+
+    // Gets a string, which points into the buffer, and returns its length.
+    size_t
+    get_string_ref(const char*& data);
+
+    void
+    get_string(cow_string& str);
+
+    // Gets a binary, which points into the buffer, and returns its size.
+    size_t
+    get_binary_ref(const unsigned char*& data);
+
+    system_time
+    get_time();
+
+    // Gets the number of elements of an array.
+    size_t
+    get_array_header();
+
+    // Gets the number of key-value pairs of a map.
+    size_t
+    get_map_header();
+
+    // Skips a value of any type, including all of its elements.
+    void
+    skip();
+  };
+
+// Checks whether a string which has been got with `get_string_ref()` equals
+// `name`.
+inline
+bool
+msgpack_key_equals(const char* data, size_t size, const char* name)
+  noexcept
+  {
+    return (::strlen(name) == size) && (::memcmp(data, name, size) == 0);
+  }
+
+}  // namespace k32
+#endif
@@ -0,0 +1,322 @@
+// This file is part of k32.
+// Copyright (C) 2024-2026 LH_Mouse. All wrongs reserved.
+
+#ifndef K32_COMMON_BASE_RING_BUFFER_
+#define K32_COMMON_BASE_RING_BUFFER_
+
+#include "../../fwd.hpp"
+#include <vector>
+#include <iterator>
+namespace k32 {
+
+// This is a queue where elements are appended to the end and removed from the
+// beginning, both in constant time, without moving other elements. Storage is
+// allocated in powers of two, and grows as needed. Unlike copy-on-write
+// containers, copying a ring buffer copies all elements.
+//
+// Each element has a position, which is the number of elements that have ever
+// been appended before it. Iterators refer to positions, so they stay valid
+// until their elements are removed, even if storage is reallocated.
+template<typename xValue>
+class Ring_Buffer
+  {
+  public:
+    using value_type = xValue;
+    using size_type = size_t;
+    using difference_type = ptrdiff_t;
+
+    class const_iterator
+      {
+      public:
+        using iterator_category = ::std::random_access_iterator_tag;
+        using value_type = xValue;
+        using difference_type = ptrdiff_t;
+        using pointer = const xValue*;
+        using reference = const xValue&;
+
+      private:
+        friend class Ring_Buffer;
+
+        const Ring_Buffer* m_ring = nullptr;
+        uint64_t m_pos = 0;
+
+        const_iterator(const Ring_Buffer* ring, uint64_t pos)
+          noexcept
+          : m_ring(ring), m_pos(pos)
+          { }
+
+      public:
+        const_iterator() noexcept = default;
+
+        // Gets the position of the element.
+        uint64_t
+        position()
+          const noexcept
+          { return this->m_pos;  }
+
+        reference
+        operator*()
+          const noexcept
+          { return this->m_ring->do_slot(this->m_pos);  }
+
+        pointer
+        operator->()
+          const noexcept
+          { return &(this->m_ring->do_slot(this->m_pos));  }
+
+        reference
+        operator[](difference_type n)
+          const noexcept
+          { return this->m_ring->do_slot(this->m_pos + static_cast<uint64_t>(n));  }
+
+        const_iterator&
+        operator+=(difference_type n)
+          noexcept
+          { this->m_pos += static_cast<uint64_t>(n);  return *this;  }
+
+        const_iterator&
+        operator-=(difference_type n)
+          noexcept
+          { this->m_pos -= static_cast<uint64_t>(n);  return *this;  }
+
+        const_iterator&
+        operator++()
+          noexcept
+          { this->m_pos ++;  return *this;  }
+
+        const_iterator&
+        operator--()
+          noexcept
+          { this->m_pos --;  return *this;  }
+
+        const_iterator
+        operator++(int)
+          noexcept
+          { auto old = *this;  this->m_pos ++;  return old;  }
+
+        const_iterator
+        operator--(int)
+          noexcept
+          { auto old = *this;  this->m_pos --;  return old;  }
+
+        friend
+        const_iterator
+        operator+(const_iterator it, difference_type n)
+          noexcept
+          { return it += n;  }
+
+        friend
+        const_iterator
+        operator+(difference_type n, const_iterator it)
+          noexcept
+          { return it += n;  }
+
+        friend
+        const_iterator
+        operator-(const_iterator it, difference_type n)
+          noexcept
+          { return it -= n;  }
+
+        friend
+        difference_type
+        operator-(const const_iterator& lhs, const const_iterator& rhs)
+          noexcept
+          { return static_cast<difference_type>(lhs.m_pos - rhs.m_pos);  }
+
+        friend
+        bool
+        operator==(const const_iterator& lhs, const const_iterator& rhs)
+          noexcept
+          { return lhs.m_pos == rhs.m_pos;  }
+
+        friend
+        bool
+        operator!=(const const_iterator& lhs, const const_iterator& rhs)
+          noexcept
+          { return lhs.m_pos != rhs.m_pos;  }
+
+        friend
+        bool
+        operator<(const const_iterator& lhs, const const_iterator& rhs)
+          noexcept
+          { return lhs.m_pos < rhs.m_pos;  }
+
+        friend
+        bool
+        operator>(const const_iterator& lhs, const const_iterator& rhs)
+          noexcept
+          { return lhs.m_pos > rhs.m_pos;  }
+
+        friend
+        bool
+        operator<=(const const_iterator& lhs, const const_iterator& rhs)
+          noexcept
+          { return lhs.m_pos <= rhs.m_pos;  }
+
+        friend
+        bool
+        operator>=(const const_iterator& lhs, const const_iterator& rhs)
+          noexcept
+          { return lhs.m_pos >= rhs.m_pos;  }
+      };
+
+    using iterator = const_iterator;
+
+  private:
+    ::std::vector<xValue> m_slots;  // size is zero or a power of two
+    uint64_t m_begin = 0;
+    uint64_t m_end = 0;
+
+  private:
+    xValue&
+    do_slot(uint64_t pos)
+      noexcept
+      { return this->m_slots[static_cast<size_t>(pos & (this->m_slots.size() - 1))];  }
+
+    const xValue&
+    do_slot(uint64_t pos)
+      const noexcept
+      { return this->m_slots[static_cast<size_t>(pos & (this->m_slots.size() - 1))];  }
+
+    void
+    do_reallocate(size_t capacity)
+      {
+        ::std::vector<xValue> slots(capacity);
+        for(uint64_t pos = this->m_begin;  pos != this->m_end;  ++pos)
+          slots[static_cast<size_t>(pos & (capacity - 1))] = move(this->do_slot(pos));
+
+        this->m_slots.swap(slots);
+      }
+
+  public:
+    Ring_Buffer() noexcept = default;
+
+    Ring_Buffer(const Ring_Buffer&) = default;
+    Ring_Buffer(Ring_Buffer&&) = default;
+    Ring_Buffer& operator=(const Ring_Buffer&) & = default;
+    Ring_Buffer& operator=(Ring_Buffer&&) & = default;
+
+    bool
+    empty()
+      const noexcept
+      { return this->m_begin == this->m_end;  }
+
+    size_t
+    size()
+      const noexcept
+      { return static_cast<size_t>(this->m_end - this->m_begin);  }
+
+    size_t
+    capacity()
+      const noexcept
+      { return this->m_slots.size();  }
+
+    // Gets the position of the first element, which is also the number of
+    // elements that have been removed.
+    uint64_t
+    begin_position()
+      const noexcept
+      { return this->m_begin;  }
+
+    // Gets the position after the last element, which is also the number of
+    // elements that have been appended.
+    uint64_t
+    end_position()
+      const noexcept
+      { return this->m_end;  }
+
+    const_iterator
+    begin()
+      const noexcept
+      { return const_iterator(this, this->m_begin);  }
+
+    const_iterator
+    end()
+      const noexcept
+      { return const_iterator(this, this->m_end);  }
+
+    const xValue&
+    front()
+      const noexcept
+      { return this->do_slot(this->m_begin);  }
+
+    const xValue&
+    back()
+      const noexcept
+      { return this->do_slot(this->m_end - 1);  }
+
+    const xValue&
+    at(size_t index)
+      const
+      {
+        if(index >= this->size())
+          POSEIDON_THROW(("Ring buffer subscript `$1` out of range"), index);
+
+        return this->do_slot(this->m_begin + index);
+      }
+
+    const xValue&
+    operator[](size_t index)
+      const noexcept
+      { return this->do_slot(this->m_begin + index);  }
+
+    // Ensures that `count` elements can be stored without reallocation.
+    void
+    reserve(size_t count)
+      {
+        if(count <= this->m_slots.size())
+          return;
+
+        size_t capacity = 16;
+        while(capacity < count)
+          capacity *= 2;
+
+        this->do_reallocate(capacity);
+      }
+
+    // Appends an element to the end. This takes amortized constant time.
+    template<typename... xParams>
+    xValue&
+    emplace_back(xParams&&... params)
+      {
+        if(this->size() == this->m_slots.size())
+          this->reserve(this->size() + 1);
+
+        auto& slot = this->do_slot(this->m_end);
+        slot = xValue(forward<xParams>(params)...);
+        this->m_end ++;
+        return slot;
+      }
+
+    // Removes `count` elements from the beginning. Other elements are not
+    // moved.
+    void
+    pop_front(size_t count = 1)
+      noexcept
+      {
+        ROCKET_ASSERT(count <= this->size());
+        for(size_t k = 0;  k != count;  ++k)
+          this->do_slot(this->m_begin ++) = xValue();
+      }
+
+    // Removes all elements. Positions are not reset.
+    void
+    clear()
+      noexcept
+      {
+        this->pop_front(this->size());
+      }
+
+    // Removes all elements, and sets the position of the next element.
+    void
+    reset(uint64_t position)
+      noexcept
+      {
+        this->clear();
+        this->m_begin = position;
+        this->m_end = position;
+      }
+  };
+
+}  // namespace k32
+#endif
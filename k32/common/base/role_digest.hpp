@@ -0,0 +1,44 @@
+// This file is part of k32.
+// Copyright (C) 2024-2026 LH_Mouse. All wrongs reserved.
+
+#ifndef K32_COMMON_BASE_ROLE_DIGEST_
+#define K32_COMMON_BASE_ROLE_DIGEST_
+
+#include "../../fwd.hpp"
+namespace k32 {
+
+// Digest of online roles, which agents and logic servers compare to detect
+// inconsistency. Elements may be added in any order.
+struct Role_Digest
+  {
+    uint64_t count = 0;
+    uint64_t hash = 0;
+
+    void
+    add(const phcow_string& username, int64_t roid)
+      noexcept
+      {
+        // FNV-1a, so this is stable across processes.
+        uint64_t h = 0xCBF29CE484222325;
+        for(char ch : username)
+          h = (h ^ static_cast<unsigned char>(ch)) * 0x100000001B3;
+        for(uint32_t k = 0;  k != 8;  ++k)
+          h = (h ^ (static_cast<uint64_t>(roid) >> k * 8 & 0xFF)) * 0x100000001B3;
+
+        this->count ++;
+        this->hash += h;
+      }
+
+    bool
+    operator==(const Role_Digest& other)
+      const noexcept
+      { return (this->count == other.count) && (this->hash == other.hash);  }
+
+    bool
+    operator!=(const Role_Digest& other)
+      const noexcept
+      { return !(*this == other);  }
+  };
+
+}  // namespace k32
+#endif
@@ -0,0 +1,167 @@
+// This file is part of k32.
+// Copyright (C) 2024-2026 LH_Mouse. All wrongs reserved.
+
+#ifndef K32_COMMON_BASE_SAVE_SCHEDULER_
+#define K32_COMMON_BASE_SAVE_SCHEDULER_
+
+#include "../../fwd.hpp"
+#include <map>
+namespace k32 {
+
+// This class decides which entities shall be written to storage, and when.
+// Every entity is written at least once every `max_staleness`. An entity that
+// has been marked dirty is written as soon as possible, subject to a rate limit
+// on writes per second. Entities that have been waiting for longer are written
+// first, and entities that have been overdue for another `max_staleness` are
+// written regardless of the rate limit.
+template<typename xKey, typename xHash>
+class Save_Scheduler
+  {
+  private:
+    struct X_Entry
+      {
+        steady_time due_time;
+        bool dirty = false;
+      };
+
+    uint32_t m_rate_limit = 100;
+    seconds m_max_staleness = 60s;
+
+    ::std::multimap<steady_time, xKey> m_queue;
+    cow_hashmap<xKey, X_Entry, xHash> m_entries;
+    double m_credit = 0;
+    steady_time m_credit_time;
+
+  private:
+    void
+    do_unqueue(const xKey& key, steady_time due_time)
+      {
+        auto range = this->m_queue.equal_range(due_time);
+        for(auto it = range.first;  it != range.second;  ++it)
+          if(it->second == key) {
+            this->m_queue.erase(it);
+            break;
+          }
+      }
+
+    void
+    do_schedule(const xKey& key, steady_time due_time, bool dirty)
+      {
+        if(auto ptr = this->m_entries.ptr(key))
+          this->do_unqueue(key, ptr->due_time);
+
+        X_Entry entry;
+        entry.due_time = due_time;
+        entry.dirty = dirty;
+        this->m_entries.insert_or_assign(key, entry);
+        this->m_queue.emplace(due_time, key);
+      }
+
+  public:
+    Save_Scheduler() noexcept = default;
+
+    Save_Scheduler(const Save_Scheduler&) = delete;
+    Save_Scheduler& operator=(const Save_Scheduler&) & = delete;
+
+    // Sets the maximum number of writes per second, and the maximum interval
+    // between two writes of the same entity.
+    void
+    set_limits(uint32_t rate_limit, seconds max_staleness)
+      noexcept
+      {
+        this->m_rate_limit = rate_limit;
+        this->m_max_staleness = max_staleness;
+      }
+
+    // Gets the number of entities that are being tracked.
+    size_t
+    size()
+      const noexcept
+      { return this->m_entries.size();  }
+
+    // Starts tracking an entity which has just been written. If the entity is
+    // being tracked already, there is no effect.
+    void
+    insert(const xKey& key, steady_time now)
+      {
+        if(this->m_entries.count(key) == 0)
+          this->do_schedule(key, now + this->m_max_staleness, false);
+      }
+
+    // Requests that an entity be written as soon as possible. If the entity is
+    // not being tracked, it is tracked. If it has been marked dirty, its
+    // position in the queue is unchanged.
+    void
+    mark_dirty(const xKey& key, steady_time now)
+      {
+        auto ptr = this->m_entries.ptr(key);
+        if(!ptr || (!ptr->dirty && (ptr->due_time > now)))
+          this->do_schedule(key, now, true);
+        else if(!ptr->dirty)
+          this->m_entries.mut(key).dirty = true;
+      }
+
+    // Stops tracking an entity.
+    void
+    erase(const xKey& key)
+      {
+        X_Entry entry;
+        if(this->m_entries.find_and_erase(entry, key))
+          this->do_unqueue(key, entry.due_time);
+      }
+
+    // Gets the number of entities that are due to be written.
+    size_t
+    count_due(steady_time now)
+      const noexcept
+      {
+        size_t count = 0;
+        for(auto it = this->m_queue.begin();  (it != this->m_queue.end()) && (it->first <= now);  ++it)
+          count ++;
+        return count;
+      }
+
+    // Gets how long the oldest entity has been waiting to be written.
+    milliseconds
+    lag(steady_time now)
+      const noexcept
+      {
+        if(this->m_queue.empty() || (this->m_queue.begin()->first >= now))
+          return 0ms;
+
+        return duration_cast<milliseconds>(now - this->m_queue.begin()->first);
+      }
+
+    // Takes entities that shall be written now, oldest first, and appends them
+    // to `keys`. These entities are rescheduled as if they had been written.
+    void
+    pop_due(::std::vector<xKey>& keys, steady_time now)
+      {
+        // Accumulate credit for writes, which is capped at one second.
+        double limit = static_cast<double>(this->m_rate_limit);
+        double elapsed = duration_cast<::std::chrono::duration<double>>(now - this->m_credit_time).count();
+        this->m_credit = ::std::min(this->m_credit + elapsed * limit, limit);
+        this->m_credit_time = now;
+
+        while(!this->m_queue.empty()) {
+          auto it = this->m_queue.begin();
+          if(it->first > now)
+            break;
+
+          // An entity that has been waiting for too long is written regardless
+          // of the rate limit.
+          if((this->m_credit < 1) && (now - it->first < this->m_max_staleness))
+            break;
+
+          xKey key = it->second;
+          this->m_queue.erase(it);
+          this->m_entries.erase(key);
+          this->do_schedule(key, now + this->m_max_staleness, false);
+          keys.push_back(key);
+          this->m_credit = ::std::max(this->m_credit - 1, 0.0);
+        }
+      }
+  };
+
+}  // namespace k32
+#endif
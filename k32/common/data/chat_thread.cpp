@@ -4,6 +4,9 @@
 #include "../../xprecompiled.hpp"
 #define K32_FRIENDS_A40BD99F_5E7D_486F_A905_656CBDBE52AB_
 #include "chat_thread.hpp"
+#include "../base/msgpack.hpp"
+#include "../base/blob_codec.hpp"
+#include <algorithm>
 namespace k32 {
 
 const Chat_Thread Chat_Thread::null;
@@ -17,20 +20,72 @@ void
 Chat_Thread::
 parse_from_string(const cow_string& str)
   {
-    ::taxon::Value temp_value;
-    POSEIDON_CHECK(temp_value.parse(str));
-    ::taxon::V_object root = temp_value.as_object();
-    temp_value.clear();
-
-    this->thread_key = root.at(&"thread_key").as_string();
-    this->update_time = root.at(&"update_time").as_time();
-
-    this->messages.clear();
-    for(const auto& r : root.at(&"messages").as_array()) {
-      auto& msg = this->messages.emplace_back();
-      msg.first = r.as_array().at(0).as_time();
-      msg.second = r.as_array().at(1).as_string();
+    if(!blob_is_encoded(str) && !msgpack_is_map(str)) {
+      // Threads that were stored by earlier versions are in JSON.
+      ::taxon::Value temp_value;
+      POSEIDON_CHECK(temp_value.parse(str));
+      ::taxon::V_object root = temp_value.as_object();
+      temp_value.clear();
+
+      this->thread_key = root.at(&"thread_key").as_string();
+      this->update_time = root.at(&"update_time").as_time();
+
+      this->messages.clear();
+      for(const auto& r : root.at(&"messages").as_array()) {
+        auto& msg = this->messages.emplace_back();
+        msg.first = r.as_array().at(0).as_time();
+        msg.second = r.as_array().at(1).as_string();
+      }
+      return;
     }
+
+    // Newer ones are in MessagePack, and compressed unless that would not make
+    // them shorter. Messages are read directly into this object, without
+    // building a tree of values.
+    cow_string data = blob_decode(str);
+    Msgpack_Reader reader(data.data(), data.size());
+    uint32_t seen = 0;
+
+    size_t count = reader.get_map_header();
+    while(count != 0) {
+      count --;
+      const char* kstr;
+      size_t klen = reader.get_string_ref(kstr);
+
+      if(msgpack_key_equals(kstr, klen, "thread_key")) {
+        const char* vstr;
+        size_t vlen = reader.get_string_ref(vstr);
+        this->thread_key = cow_string(vstr, vlen);
+        seen |= 1U << 0;
+      }
+      else if(msgpack_key_equals(kstr, klen, "update_time")) {
+        this->update_time = reader.get_time();
+        seen |= 1U << 1;
+      }
+      else if(msgpack_key_equals(kstr, klen, "messages")) {
+        size_t nmsgs = reader.get_array_header();
+        this->messages.clear();
+        this->messages.reserve(nmsgs);
+        while(nmsgs != 0) {
+          nmsgs --;
+          if(reader.get_array_header() != 2)
+            POSEIDON_THROW(("Chat message not a pair"));
+
+          auto& msg = this->messages.emplace_back();
+          msg.first = reader.get_time();
+          reader.get_string(msg.second);
+        }
+        seen |= 1U << 2;
+      }
+      else
+        reader.skip();
+    }
+
+    if(seen != 0x7U)
+      POSEIDON_THROW(("Chat thread incomplete"));
+
+    if(reader.avail() != 0)
+      POSEIDON_THROW(("Trailing garbage after chat thread"));
   }
 
 cow_string
@@ -38,19 +93,71 @@ Chat_Thread::
 serialize_to_string()
   const
   {
-    ::taxon::V_object root;
+    cow_string data;
+    msgpack_put_map_header(data, 3);
 
-    root.try_emplace(&"thread_key", this->thread_key);
-    root.try_emplace(&"update_time", this->update_time);
+    msgpack_put_string(data, "thread_key");
+    msgpack_put_string(data, this->thread_key.rdstr());
+    msgpack_put_string(data, "update_time");
+    msgpack_put_time(data, this->update_time);
 
-    auto pa = &(root.open(&"messages").open_array());
+    msgpack_put_string(data, "messages");
+    msgpack_put_array_header(data, this->messages.size());
     for(const auto& msg : this->messages) {
-      auto& sub = pa->emplace_back().open_array();
-      sub.emplace_back(msg.first);   // 0
-      sub.emplace_back(msg.second);  // 1
+      msgpack_put_array_header(data, 2);
+      msgpack_put_time(data, msg.first);  // 0
+      msgpack_put_string(data, msg.second);  // 1
+    }
+
+    // Messages are usually short, and have a lot in common.
+    return blob_encode(data);
+  }
+
+bool
+chat_merge_messages(::taxon::V_array& payloads, system_time& last_time,
+                    const ::std::vector<const Chat_Thread*>& threads, system_time since,
+                    size_t max_per_thread, size_t limit)
+  {
+    // Find new messages in each thread. Messages are compared by timestamps
+    // only, so those at `since` are not returned again.
+    using message_iterator = decltype(Chat_Thread::messages)::const_iterator;
+    ::std::vector<::std::pair<message_iterator, message_iterator>> heap;
+    heap.reserve(threads.size());
+    for(const Chat_Thread* pth : threads) {
+      auto begin = pth->messages.begin();
+      if(pth->messages.size() > max_per_thread)
+        begin += static_cast<ptrdiff_t>(pth->messages.size() - max_per_thread);
+
+      begin = ::std::upper_bound(begin, pth->messages.end(), since,
+                    [](system_time t, const auto& m) { return t < m.first;  });
+      if(begin != pth->messages.end())
+        heap.emplace_back(begin, pth->messages.end());
+    }
+
+    // Merge messages from all threads, which are sorted by time already. The
+    // thread with the earliest message is on the top of the heap.
+    auto heap_greater = [](const auto& x, const auto& y) { return x.first->first > y.first->first;  };
+    ::std::make_heap(heap.begin(), heap.end(), heap_greater);
+
+    size_t count = 0;
+    while(!heap.empty()) {
+      ::std::pop_heap(heap.begin(), heap.end(), heap_greater);
+      auto& top = heap.back();
+
+      if((count >= limit) && (top.first->first != last_time))
+        return true;
+
+      last_time = top.first->first;
+      payloads.emplace_back(top.first->second);
+      count ++;
+
+      if(++ top.first == top.second)
+        heap.pop_back();
+      else
+        ::std::push_heap(heap.begin(), heap.end(), heap_greater);
     }
 
-    return ::taxon::Value(root).to_string();
+    return false;
   }
 
 }  // namespace k32
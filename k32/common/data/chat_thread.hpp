@@ -5,13 +5,19 @@
 #define K32_COMMON_DATA_CHAT_THREAD_
 
 #include "../../fwd.hpp"
+#include "../base/ring_buffer.hpp"
 namespace k32 {
 
 struct Chat_Thread
   {
     phcow_string thread_key;
     system_time update_time;
-    cow_bivector<system_time, cow_string> messages;
+    Ring_Buffer<::std::pair<system_time, cow_string>> messages;
+
+    // The chat service stores messages in segments, and numbers them with their
+    // positions in `messages`. These are not serialized.
+    uint64_t _saved_serial = 0;  // messages before this have been saved
+    uint64_t _purged_serial = 0;  // segments before this have been deleted
 
 #ifdef K32_FRIENDS_A40BD99F_5E7D_486F_A905_656CBDBE52AB_
     Chat_Thread() noexcept = default;
@@ -34,5 +40,17 @@ struct Chat_Thread
       const;
   };
 
+// Merges messages of `threads` whose timestamps are greater than `since`, and
+// appends their payloads to `payloads` in chronological order. Only the last
+// `max_per_thread` messages of each thread are considered. At most `limit`
+// messages are appended, except that messages with the same timestamp are
+// never separated. If messages are left, `true` is returned, and `last_time` is
+// set to the timestamp of the last message appended, which shall be passed as
+// `since` to get the others.
+bool
+chat_merge_messages(::taxon::V_array& payloads, system_time& last_time,
+                    const ::std::vector<const Chat_Thread*>& threads, system_time since,
+                    size_t max_per_thread, size_t limit);
+
 }  // namespace k32
 #endif
@@ -4,7 +4,118 @@
 #include "../../xprecompiled.hpp"
 #define K32_FRIENDS_3543B0B1_DC5A_4F34_B9BB_CAE513821771_
 #include "role_record.hpp"
+#include "../base/msgpack.hpp"
+#include "../base/blob_codec.hpp"
 namespace k32 {
+namespace {
+
+// bits of fields in a record, to check that all of them have been found
+enum : uint32_t
+  {
+    field_roid         = 1U << 0,
+    field_username     = 1U << 1,
+    field_nickname     = 1U << 2,
+    field_update_time  = 1U << 3,
+    field_avatar       = 1U << 4,
+    field_profile      = 1U << 5,
+    field_whole        = 1U << 6,
+    field_home_host    = 1U << 7,
+    field_home_db      = 1U << 8,
+    field_home_zone    = 1U << 9,
+
+    fields_head  = field_roid | field_username | field_nickname | field_update_time
+                   | field_home_host | field_home_db | field_home_zone,
+  };
+
+void
+do_parse_msgpack(Role_Record& roinfo, const cow_string& str, uint32_t required)
+  {
+    // Fields are read directly into `roinfo`, without building a tree of values.
+    // Unknown fields are ignored, and missing ones are errors.
+    cow_string data = blob_decode(str);
+    Msgpack_Reader reader(data.data(), data.size());
+    uint32_t seen = 0;
+
+    size_t count = reader.get_map_header();
+    while(count != 0) {
+      count --;
+      const char* kstr;
+      size_t klen = reader.get_string_ref(kstr);
+
+      if(msgpack_key_equals(kstr, klen, "roid")) {
+        roinfo.roid = reader.get_integer();
+        seen |= field_roid;
+      }
+      else if(msgpack_key_equals(kstr, klen, "username")) {
+        const char* vstr;
+        size_t vlen = reader.get_string_ref(vstr);
+        roinfo.username = cow_string(vstr, vlen);
+        seen |= field_username;
+      }
+      else if(msgpack_key_equals(kstr, klen, "nickname")) {
+        reader.get_string(roinfo.nickname);
+        seen |= field_nickname;
+      }
+      else if(msgpack_key_equals(kstr, klen, "update_time")) {
+        roinfo.update_time = reader.get_time();
+        seen |= field_update_time;
+      }
+      else if(msgpack_key_equals(kstr, klen, "avatar")) {
+        reader.get_string(roinfo.avatar);
+        seen |= field_avatar;
+      }
+      else if(msgpack_key_equals(kstr, klen, "profile")) {
+        reader.get_string(roinfo.profile);
+        seen |= field_profile;
+      }
+      else if(msgpack_key_equals(kstr, klen, "whole")) {
+        reader.get_string(roinfo.whole);
+        seen |= field_whole;
+      }
+      else if(msgpack_key_equals(kstr, klen, "@home_host")) {
+        reader.get_string(roinfo._home_host);
+        seen |= field_home_host;
+      }
+      else if(msgpack_key_equals(kstr, klen, "@home_db")) {
+        reader.get_string(roinfo._home_db);
+        seen |= field_home_db;
+      }
+      else if(msgpack_key_equals(kstr, klen, "@home_zone")) {
+        roinfo._home_zone = static_cast<int>(reader.get_integer());
+        seen |= field_home_zone;
+      }
+      else
+        reader.skip();
+    }
+
+    if((seen & required) != required)
+      POSEIDON_THROW(("Role record incomplete"));
+
+    if(reader.avail() != 0)
+      POSEIDON_THROW(("Trailing garbage after role record"));
+  }
+
+void
+do_put_head(cow_string& data, const Role_Record& roinfo)
+  {
+    msgpack_put_string(data, "roid");
+    msgpack_put_integer(data, roinfo.roid);
+    msgpack_put_string(data, "username");
+    msgpack_put_string(data, roinfo.username.rdstr());
+    msgpack_put_string(data, "nickname");
+    msgpack_put_string(data, roinfo.nickname);
+    msgpack_put_string(data, "update_time");
+    msgpack_put_time(data, roinfo.update_time);
+
+    msgpack_put_string(data, "@home_host");
+    msgpack_put_string(data, roinfo._home_host);
+    msgpack_put_string(data, "@home_db");
+    msgpack_put_string(data, roinfo._home_db);
+    msgpack_put_string(data, "@home_zone");
+    msgpack_put_integer(data, roinfo._home_zone);
+  }
+
+}  // namespace
 
 const Role_Record Role_Record::null;
 
@@ -17,22 +128,30 @@ void
 Role_Record::
 parse_from_string(const cow_string& str)
   {
-    ::taxon::Value temp_value;
-    POSEIDON_CHECK(temp_value.parse(str));
-    ::taxon::V_object root = temp_value.as_object();
-    temp_value.clear();
+    if(!blob_is_encoded(str) && !msgpack_is_map(str)) {
+      // Records that were stored by earlier versions are in JSON.
+      ::taxon::Value temp_value;
+      POSEIDON_CHECK(temp_value.parse(str));
+      ::taxon::V_object root = temp_value.as_object();
+      temp_value.clear();
+
+      this->roid = root.at(&"roid").as_integer();
+      this->username = root.at(&"username").as_string();
+      this->nickname = root.at(&"nickname").as_string();
+      this->update_time = root.at(&"update_time").as_time();
+      this->avatar = root.at(&"avatar").as_string();   // JSON as string
+      this->profile = root.at(&"profile").as_string();   // JSON as string
+      this->whole = root.at(&"whole").as_string();   // JSON as string
 
-    this->roid = root.at(&"roid").as_integer();
-    this->username = root.at(&"username").as_string();
-    this->nickname = root.at(&"nickname").as_string();
-    this->update_time = root.at(&"update_time").as_time();
-    this->avatar = root.at(&"avatar").as_string();   // JSON as string
-    this->profile = root.at(&"profile").as_string();   // JSON as string
-    this->whole = root.at(&"whole").as_string();   // JSON as string
+      this->_home_host = root.at(&"@home_host").as_string();
+      this->_home_db = root.at(&"@home_db").as_string();
+      this->_home_zone = static_cast<int>(root.at(&"@home_zone").as_integer());
+      return;
+    }
 
-    this->_home_host = root.at(&"@home_host").as_string();
-    this->_home_db = root.at(&"@home_db").as_string();
-    this->_home_zone = static_cast<int>(root.at(&"@home_zone").as_integer());
+    // Newer ones are in MessagePack, and compressed unless that would not make
+    // them shorter.
+    do_parse_msgpack(*this, str, fields_head | field_avatar | field_profile | field_whole);
   }
 
 cow_string
@@ -40,21 +159,69 @@ Role_Record::
 serialize_to_string()
   const
   {
-    ::taxon::V_object root;
+    // Avatars, profiles and whole data are JSON, which are stored as strings
+    // without escaping, and usually compress very well.
+    cow_string data;
+    data.reserve(256 + this->avatar.size() + this->profile.size() + this->whole.size());
+    msgpack_put_map_header(data, 10);
+    do_put_head(data, *this);
 
-    root.try_emplace(&"roid", this->roid);
-    root.try_emplace(&"username", this->username.rdstr());
-    root.try_emplace(&"nickname", this->nickname);
-    root.try_emplace(&"update_time", this->update_time);
-    root.try_emplace(&"avatar", this->avatar);  // JSON as string
-    root.try_emplace(&"profile", this->profile);  // JSON as string
-    root.try_emplace(&"whole", this->whole);  // JSON as string
+    msgpack_put_string(data, "avatar");
+    msgpack_put_string(data, this->avatar);  // JSON as string
+    msgpack_put_string(data, "profile");
+    msgpack_put_string(data, this->profile);  // JSON as string
+    msgpack_put_string(data, "whole");
+    msgpack_put_string(data, this->whole);  // JSON as string
 
-    root.try_emplace(&"@home_host", this->_home_host);
-    root.try_emplace(&"@home_db", this->_home_db);
-    root.try_emplace(&"@home_zone", static_cast<int64_t>(this->_home_zone));
+    return blob_encode(data);
+  }
+
+void
+Role_Record::
+parse_from_redis_hash(const ::taxon::V_array& fields)
+  {
+    // Parts that don't exist are empty, which is the case for new roles.
+    bool head_found = false;
+    this->avatar.clear();
+    this->profile.clear();
+    this->whole.clear();
+
+    for(size_t k = 0;  k + 1 < fields.size();  k += 2) {
+      const cow_string& name = fields.at(k).as_string();
+      const cow_string& value = fields.at(k + 1).as_string();
+
+      if(name == "head") {
+        this->parse_head_from_string(value);
+        head_found = true;
+      }
+      else if(name == "avatar")
+        this->avatar = blob_decode(value);
+      else if(name == "profile")
+        this->profile = blob_decode(value);
+      else if(name == "whole")
+        this->whole = blob_decode(value);
+    }
+
+    if(!head_found)
+      POSEIDON_THROW(("Role record incomplete"));
+  }
 
-    return ::taxon::Value(root).to_string();
+void
+Role_Record::
+parse_head_from_string(const cow_string& str)
+  {
+    do_parse_msgpack(*this, str, fields_head);
+  }
+
+cow_string
+Role_Record::
+serialize_head_to_string()
+  const
+  {
+    cow_string data;
+    msgpack_put_map_header(data, 7);
+    do_put_head(data, *this);
+    return blob_encode(data);
   }
 
 }  // namespace k32
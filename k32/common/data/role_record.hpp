@@ -40,6 +40,19 @@ struct Role_Record
     cow_string
     serialize_to_string()
       const;
+
+    // Redis stores a role as a hash, so its parts can be written and read
+    // separately. The `head` field contains all fields except `avatar`, `profile`
+    // and `whole`, which are stored in their own fields in the compact format.
+    void
+    parse_from_redis_hash(const ::taxon::V_array& fields);  // result of `HGETALL`
+
+    void
+    parse_head_from_string(const cow_string& str);
+
+    cow_string
+    serialize_head_to_string()
+      const;
   };
 
 }  // namespace k32
@@ -18,6 +18,7 @@ class Service_Future
     phcow_string m_opcode;
     ::taxon::V_object m_request;
     cow_vector<Service_Response> m_responses;
+    bool m_any_of = false;
 
   public:
     Service_Future(const cow_vector<::poseidon::UUID>& multicast_list,
@@ -53,6 +54,20 @@ class Service_Future
       const noexcept
       { return this->m_request;  }
 
+    // Gets the completion mode. If this is `true`, the future completes as soon
+    // as any target service responds with `gs_ok`, and responses from all the
+    // other services are abandoned, with `error` set to `Abandoned`. This must
+    // be set before the future is launched.
+    bool
+    any_of()
+      const noexcept
+      { return this->m_any_of;  }
+
+    void
+    set_any_of(bool any_of)
+      noexcept
+      { this->m_any_of = any_of;  }
+
     // Gets a vector of all target services with their responses, after all
     // operations have completed successfully. If `successful()` yields `false`,
     // an exception is thrown, and there is no effect.
@@ -87,6 +87,50 @@ do_salt_password(char* pw, const ::poseidon::UUID& s, int64_t ts, const cow_stri
     ::poseidon::hex_encode_16_partial(pw, bytes);
   }
 
+uint64_t
+do_rendezvous_weight(const ::poseidon::UUID& service_uuid, const cow_string& key)
+  {
+    // This is FNV-1a, followed by the finalizer of SplitMix64, as FNV-1a alone
+    // doesn't mix the last few bytes well.
+    uint64_t h = 0xCBF29CE484222325;
+    for(size_t k = 0;  k != service_uuid.size();  ++k)
+      h = (h ^ static_cast<uint8_t>(service_uuid.data()[k])) * 0x100000001B3;
+    for(size_t k = 0;  k != key.size();  ++k)
+      h = (h ^ static_cast<uint8_t>(key[k])) * 0x100000001B3;
+
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EB;
+    return h ^ (h >> 31);
+  }
+
+void
+do_check_complete(const shptr<Service_Future>& req)
+  {
+    bool all_received = true;
+    bool any_ok = false;
+    for(const auto& resp : req->mf_responses())
+      if(!resp.complete)
+        all_received = false;
+      else if(resp.error.empty()) {
+        auto ptr = resp.obj.ptr(&"status");
+        any_ok |= ptr && ptr->is_string() && (ptr->as_string() == "gs_ok");
+      }
+
+    if(!all_received && req->any_of() && any_ok) {
+      // Don't wait for the others. Their responses will be ignored.
+      for(auto p = req->mf_responses().mut_begin();  p != req->mf_responses().end();  ++p)
+        if(!p->complete) {
+          p->error = &"Abandoned";
+          p->complete = true;
+        }
+
+      all_received = true;
+    }
+
+    if(all_received)
+      req->mf_abstract_future_complete();
+  }
+
 void
 do_set_response(const wkptr<Service_Future>& weak_req, const ::poseidon::UUID& request_uuid,
                 const ::taxon::V_object& response, const cow_string& error)
@@ -98,18 +142,17 @@ do_set_response(const wkptr<Service_Future>& weak_req, const ::poseidon::UUID& r
     if(!req)
       return;
 
-    bool all_received = true;
+    bool updated = false;
     for(auto p = req->mf_responses().mut_begin();  p != req->mf_responses().end();  ++p)
-      if(p->request_uuid != request_uuid)
-        all_received &= p->complete;
-      else {
+      if((p->request_uuid == request_uuid) && !p->complete) {
         p->obj = response;
         p->error = error;
         p->complete = true;
+        updated = true;
       }
 
-    if(all_received)
-      req->mf_abstract_future_complete();
+    if(updated)
+      do_check_complete(req);
   }
 
 struct Local_Request_Fiber final : ::poseidon::Abstract_Fiber
@@ -220,18 +263,17 @@ do_client_ws_callback(const shptr<Implementation>& impl,
 
           for(const auto& r : conn.weak_futures)
             if(auto req = r.first.lock()) {
-              bool all_received = true;
+              bool updated = false;
               for(auto p = req->mf_responses().mut_begin();  p != req->mf_responses().end();  ++p)
-                if(p->service_uuid != remote_service_uuid)
-                  all_received &= p->complete;
-                else {
+                if((p->service_uuid == remote_service_uuid) && !p->complete) {
                   POSEIDON_LOG_ERROR(("Connection to service `$1` has been lost"), remote_service_uuid);
                   p->error = &"Connection lost";
                   p->complete = true;
+                  updated = true;
                 }
 
-              if(all_received)
-                req->mf_abstract_future_complete();
+              if(updated)
+                do_check_complete(req);
             }
 
           POSEIDON_LOG_INFO(("Disconnected from `$1`: $2"), session->remote_address(), data);
@@ -547,18 +589,17 @@ do_subscribe_timer_callback(const shptr<Implementation>& impl,
 
       for(const auto& r : conn.weak_futures)
         if(auto req = r.first.lock()) {
-          bool all_received = true;
+          bool updated = false;
           for(auto p = req->mf_responses().mut_begin();  p != req->mf_responses().end();  ++p)
-            if(p->service_uuid != remote_service_uuid)
-              all_received &= p->complete;
-            else {
+            if((p->service_uuid == remote_service_uuid) && !p->complete) {
               POSEIDON_LOG_ERROR(("Connection to service `$1` has been lost"), remote_service_uuid);
               p->error = &"Connection lost";
               p->complete = true;
+              updated = true;
             }
 
-          if(all_received)
-            req->mf_abstract_future_complete();
+          if(updated)
+            do_check_complete(req);
         }
 
     }
@@ -784,6 +825,31 @@ find_service_record_opt(const ::poseidon::UUID& remote_service_uuid)
     return *ptr;
   }
 
+::poseidon::UUID
+Service::
+find_service_for_key(const cow_string& service_type, const cow_string& key)
+  const noexcept
+  {
+    if(!this->m_impl)
+      return ::poseidon::UUID();
+
+    // Each service has a weight for each key, and the one with the highest
+    // weight wins. Ties are broken by UUIDs.
+    ::poseidon::UUID selected_uuid;
+    uint64_t selected_weight = 0;
+    for(const auto& r : this->m_impl->remote_services)
+      if((r.second.zone_id == this->m_impl->zone_id) && (r.second.service_type == service_type)) {
+        uint64_t weight = do_rendezvous_weight(r.first, key);
+        if(selected_uuid.is_nil() || (weight > selected_weight)
+            || ((weight == selected_weight) && (r.first < selected_uuid))) {
+          selected_uuid = r.first;
+          selected_weight = weight;
+        }
+      }
+
+    return selected_uuid;
+  }
+
 void
 Service::
 reload(const ::poseidon::Config_File& conf_file, const cow_string& service_type)
@@ -934,6 +1000,8 @@ launch(const shptr<Service_Future>& req)
 
     if(all_received)
       req->mf_abstract_future_complete();
+    else if(req->any_of())
+      do_check_complete(req);
   }
 
 }  // namespace k32
@@ -96,6 +96,14 @@ class Service
     find_service_record_opt(const ::poseidon::UUID& remote_service_uuid)
       const noexcept;
 
+    // Selects a service of `service_type` in this zone for `key`, by rendezvous
+    // hashing. All services that have the same service records make the same
+    // choice, and when a service comes or goes, only keys that belong to it are
+    // moved. If no such service is online, a nil UUID is returned.
+    ::poseidon::UUID
+    find_service_for_key(const cow_string& service_type, const cow_string& key)
+      const noexcept;
+
     // Reloads configuration. If `application_name` or `application_password`
     // is changed, a new service (with a new UUID) is initiated.
     void
@@ -31,6 +31,13 @@ enum User_WS_Status : uint16_t
     user_ws_status_ban                       = 4306,
   };
 
+// Encodings of WebSocket messages from and to clients
+enum User_WS_Encoding : uint8_t
+  {
+    user_ws_encoding_json      = 0,  // JSON in text frames
+    user_ws_encoding_msgpack   = 1,  // MessagePack in binary frames
+  };
+
 // Broken-down wallclock time
 struct Clock_Fields
   {
@@ -42,6 +42,14 @@ make_db_record(::taxon::V_object& db_record)
     POSEIDON_LOG_FATAL(("make_db_record: $1: $2"), *this, db_record);
   }
 
+void
+Role::
+make_client_state(::taxon::V_object& state)
+  {
+    state.try_emplace(&"roid", this->m_roid);
+    state.try_emplace(&"nickname", this->m_nickname);
+  }
+
 void
 Role::
 on_login()
@@ -7,6 +7,15 @@
 #include "../../fwd.hpp"
 namespace k32::logic {
 
+// Parts of a role that are stored separately
+enum Role_Dirty : uint8_t
+  {
+    role_dirty_avatar      = 0x01,  // `make_avatar()`
+    role_dirty_profile     = 0x02,  // `make_profile()`
+    role_dirty_db_record   = 0x04,  // `make_db_record()`
+    role_dirty_all         = 0x07,
+  };
+
 class Role
   {
   private:
@@ -17,6 +26,14 @@ class Role
     ::poseidon::UUID m_monitor_srv;
     steady_time m_dc_since;
 
+    uint64_t m_avatar_gen = 0;
+    uint64_t m_profile_gen = 0;
+    uint64_t m_db_record_gen = 0;
+
+    bool m_client_state_dirty = false;
+    steady_time m_client_state_keyframe_time;
+    cow_dictionary<cow_string> m_client_state_sent;
+
   public:
 #ifdef K32_FRIENDS_3543B0B1_DC5A_4F34_B9BB_CAE513821771_
     int64_t& mf_roid() { return this->m_roid;  }
@@ -25,6 +42,12 @@ class Role
     ::poseidon::UUID& mf_agent_srv() { return this->m_agent_srv;  }
     ::poseidon::UUID& mf_monitor_srv() { return this->m_monitor_srv;  }
     steady_time& mf_dc_since() { return this->m_dc_since;  }
+    uint64_t& mf_avatar_gen() { return this->m_avatar_gen;  }
+    uint64_t& mf_profile_gen() { return this->m_profile_gen;  }
+    uint64_t& mf_db_record_gen() { return this->m_db_record_gen;  }
+    bool& mf_client_state_dirty() { return this->m_client_state_dirty;  }
+    steady_time& mf_client_state_keyframe_time() { return this->m_client_state_keyframe_time;  }
+    cow_dictionary<cow_string>& mf_client_state_sent() { return this->m_client_state_sent;  }
     Role() noexcept = default;
 #endif
     Role(const Role&) = delete;
@@ -70,6 +93,36 @@ class Role
     void
     make_db_record(::taxon::V_object& db_record);
 
+    // Request that parts of this role be written to Redis. This should be called
+    // after any change that affects `make_avatar()`, `make_profile()` or
+    // `make_db_record()`, with the corresponding bits set in `parts`. Parts that
+    // have not been marked are not serialized again, and if nothing has been
+    // marked, saving this role only renews its expiry time. Cultivation data
+    // are marked after each client request and on logout, and all parts are
+    // written every `logic.save_full_interval` anyway.
+    void
+    mark_dirty(uint32_t parts = role_dirty_all)
+      noexcept
+      {
+        this->m_avatar_gen += (parts & role_dirty_avatar) != 0;
+        this->m_profile_gen += (parts & role_dirty_profile) != 0;
+        this->m_db_record_gen += (parts & role_dirty_db_record) != 0;
+      }
+
+    // Create a snapshot of this role for its own client. This is what the owner
+    // can see about themselves. Changes are sent to the client as top-level
+    // fields, so fields that change independently should not be combined.
+    void
+    make_client_state(::taxon::V_object& state);
+
+    // Request that the client state be synchronized to the client. This should
+    // be called after any change that affects `make_client_state()`. Multiple
+    // calls are coalesced, so it's cheap.
+    void
+    mark_client_state_dirty()
+      noexcept
+      { this->m_client_state_dirty = true;  }
+
     // This function is called right after a role has been loaded from Redis.
     void
     on_login();
@@ -6,12 +6,15 @@
 #include "role_service.hpp"
 #include "../globals.hpp"
 #include "../../common/data/role_record.hpp"
+#include "../../common/base/save_scheduler.hpp"
+#include "../../common/base/role_digest.hpp"
+#include "../../common/base/journal.hpp"
+#include "../../common/base/blob_codec.hpp"
 #include <poseidon/base/config_file.hpp>
 #include <poseidon/base/datetime.hpp>
 #include <poseidon/easy/easy_timer.hpp>
 #include <poseidon/fiber/redis_query_future.hpp>
 #include <poseidon/static/task_scheduler.hpp>
-#include <list>
 namespace k32::logic {
 namespace {
 
@@ -19,21 +22,60 @@ struct Hydrated_Role
   {
     Role_Record roinfo;
     shptr<Role> role;
+
+    // generations of parts in `roinfo`, which are compared with those of `role`
+    uint64_t avatar_gen = UINT64_MAX;
+    uint64_t profile_gen = UINT64_MAX;
+    uint64_t db_record_gen = UINT64_MAX;
+
+    // serial number of the last record of this role in the journal
+    uint64_t journal_serial = 0;
+
+    // when all parts shall be written again, whether they have been marked or not
+    steady_time full_save_time;
+  };
+
+struct Journaled_Role
+  {
+    uint64_t serial = 0;
+    cow_string data;
+    bool failed = false;
   };
 
 struct Implementation
   {
     seconds redis_role_ttl;
     seconds disconnect_to_logout_duration;
+    milliseconds client_state_sync_interval;
+    seconds client_state_keyframe_interval;
+    size_t journal_compaction_size;
+    uint32_t flush_batch_size;
+    seconds save_full_interval;
 
     cow_dictionary<Role_Service::handler_type> handlers;
 
     ::poseidon::Easy_Timer save_timer;
     ::poseidon::Easy_Timer every_second_timer;
+    ::poseidon::Easy_Timer client_state_timer;
+    ::poseidon::Easy_Timer flush_timer;
 
     // online roles
     cow_int64_dictionary<Hydrated_Role> hyd_roles;
-    ::std::list<static_vector<int64_t, 255>> save_buckets;
+    Save_Scheduler<int64_t, ::std::hash<int64_t>> save_scheduler;
+
+    // roles to be written into MySQL, and their monitors
+    cow_int64_dictionary<::poseidon::UUID> pending_flushes;
+
+    // roles that have been written into the journal but not into Redis yet; if
+    // a write has failed, the record will be replayed
+    Journal journal;
+    size_t journal_compaction_threshold = 0;
+    uint64_t journal_serial = 0;
+    cow_int64_dictionary<Journaled_Role> journaled_roles;
+
+    // agents whose digests of online roles don't match ours, and when the first
+    // mismatch was seen
+    cow_uuid_dictionary<steady_time> suspicious_agents;
   };
 
 void
@@ -45,50 +87,352 @@ do_set_role_record_common_fields(::taxon::V_object& temp_obj, const shptr<Role>&
   }
 
 void
-do_store_role_into_redis(::poseidon::Abstract_Fiber& fiber, Hydrated_Role& hyd, seconds ttl)
+do_reset_client_state(const shptr<Role>& role)
   {
-    POSEIDON_LOG_DEBUG(("Storing role `$1`: preparing data"), hyd.roinfo.roid);
+    // Force a keyframe on the next synchronization.
+    role->mf_client_state_dirty() = true;
+    role->mf_client_state_keyframe_time() = steady_time();
+    role->mf_client_state_sent().clear();
+  }
+
+bool
+do_is_role_dirty(const Hydrated_Role& hyd)
+  {
+    return (hyd.role->mf_avatar_gen() != hyd.avatar_gen)
+           || (hyd.role->mf_profile_gen() != hyd.profile_gen)
+           || (hyd.role->mf_db_record_gen() != hyd.db_record_gen);
+  }
 
+shptr<::poseidon::Redis_Query_Future>
+do_launch_store_role_into_redis(const shptr<Implementation>& impl, Hydrated_Role& hyd)
+  {
     ASTERIA_ASSERT(hyd.roinfo.roid == hyd.role->roid());
+    uint64_t avatar_gen = hyd.role->mf_avatar_gen();
+    uint64_t profile_gen = hyd.role->mf_profile_gen();
+    uint64_t db_record_gen = hyd.role->mf_db_record_gen();
+
+    if(!do_is_role_dirty(hyd)) {
+      // Nothing has changed, so only renew the role and its lease.
+      static constexpr char redis_renew[] =
+          R"!!!(
+            redis.call('EXPIRE', KEYS[1], ARGV[2])
+            if redis.call('GET', KEYS[2]) == ARGV[1] then
+              redis.call('EXPIRE', KEYS[2], ARGV[2])
+            end
+            return nil
+          )!!!";
+
+      cow_vector<cow_string> redis_cmd;
+      redis_cmd.emplace_back(&"EVAL");
+      redis_cmd.emplace_back(&redis_renew);
+      redis_cmd.emplace_back(&"2");   // two keys
+      redis_cmd.emplace_back(sformat("$1/role/$2", service.application_name(), hyd.roinfo.roid));  // KEYS[1]
+      redis_cmd.emplace_back(sformat("$1/role_owner/$2", service.application_name(), hyd.roinfo.roid));  // KEYS[2]
+      redis_cmd.emplace_back(service.service_uuid().to_string());  // ARGV[1]
+      redis_cmd.emplace_back(sformat("$1", impl->redis_role_ttl.count()));  // ARGV[2]
+
+      auto task2 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
+      ::poseidon::task_scheduler.launch(task2);
+      return task2;
+    }
+
+    POSEIDON_LOG_DEBUG(("Storing role `$1`: preparing data"), hyd.roinfo.roid);
+
     hyd.roinfo.username = hyd.role->username();
     hyd.roinfo.nickname = hyd.role->nickname();
     hyd.roinfo.update_time = system_clock::now();
 
+    // Serialize parts that have changed, and write only these parts into Redis.
+    // Changes that are made after this function returns will be stored next
+    // time. If the role has expired from Redis, a partial write would leave an
+    // incomplete record, so the script refuses it, and the role will be written
+    // as a whole next time.
+    cow_vector<cow_string> redis_parts;
+    bool full = (hyd.avatar_gen == UINT64_MAX) && (hyd.profile_gen == UINT64_MAX)
+                && (hyd.db_record_gen == UINT64_MAX);
+
     ::taxon::V_object temp_obj;
-    hyd.role->make_avatar(temp_obj);
-    do_set_role_record_common_fields(temp_obj, hyd.role);
-    hyd.roinfo.avatar = ::taxon::Value(temp_obj).to_string();
+    if(avatar_gen != hyd.avatar_gen) {
+      hyd.role->make_avatar(temp_obj);
+      do_set_role_record_common_fields(temp_obj, hyd.role);
+      hyd.roinfo.avatar = ::taxon::Value(temp_obj).to_string();
+      hyd.avatar_gen = avatar_gen;
+      redis_parts.emplace_back(&"avatar");
+      redis_parts.emplace_back(blob_encode(hyd.roinfo.avatar));
+    }
 
-    temp_obj.clear();
-    hyd.role->make_profile(temp_obj);
-    do_set_role_record_common_fields(temp_obj, hyd.role);
-    hyd.roinfo.profile = ::taxon::Value(temp_obj).to_string();
+    if(profile_gen != hyd.profile_gen) {
+      temp_obj.clear();
+      hyd.role->make_profile(temp_obj);
+      do_set_role_record_common_fields(temp_obj, hyd.role);
+      hyd.roinfo.profile = ::taxon::Value(temp_obj).to_string();
+      hyd.profile_gen = profile_gen;
+      redis_parts.emplace_back(&"profile");
+      redis_parts.emplace_back(blob_encode(hyd.roinfo.profile));
+    }
 
-    temp_obj.clear();
-    hyd.role->make_db_record(temp_obj);
-    do_set_role_record_common_fields(temp_obj, hyd.role);
-    hyd.roinfo.whole = ::taxon::Value(temp_obj).to_string();
+    if(db_record_gen != hyd.db_record_gen) {
+      temp_obj.clear();
+      hyd.role->make_db_record(temp_obj);
+      do_set_role_record_common_fields(temp_obj, hyd.role);
+      hyd.roinfo.whole = ::taxon::Value(temp_obj).to_string();
+      hyd.db_record_gen = db_record_gen;
+      redis_parts.emplace_back(&"whole");
+      redis_parts.emplace_back(blob_encode(hyd.roinfo.whole));
+    }
 
     POSEIDON_LOG_INFO(("#sav# Saving into Redis: role `$1` (`$2`), updated on `$3`"),
                       hyd.roinfo.roid, hyd.roinfo.nickname, hyd.roinfo.update_time);
 
+    if(impl->journal.is_open()) {
+      // Write the role into the journal first, so it will not be lost if Redis
+      // is unavailable. Records are always complete, as older ones are
+      // discarded by compaction.
+      cow_string data = hyd.roinfo.serialize_to_string();
+      impl->journal.append(hyd.roinfo.roid, data);
+      hyd.journal_serial = ++ impl->journal_serial;
+
+      auto& jr = impl->journaled_roles.open(hyd.roinfo.roid);
+      jr.serial = hyd.journal_serial;
+      jr.data = data;
+      jr.failed = false;
+    }
+
+    // Renew the lease of this role at the same time.
+    static constexpr char redis_store_and_renew[] =
+        R"!!!(
+          if ARGV[3] ~= '1' and redis.call('EXISTS', KEYS[1]) == 0 then
+            return 1
+          end
+          redis.call('HSET', KEYS[1], unpack(ARGV, 4))
+          redis.call('EXPIRE', KEYS[1], ARGV[2])
+          if redis.call('GET', KEYS[2]) == ARGV[1] then
+            redis.call('EXPIRE', KEYS[2], ARGV[2])
+          end
+          return nil
+        )!!!";
+
     cow_vector<cow_string> redis_cmd;
-    redis_cmd.emplace_back(&"SET");
-    redis_cmd.emplace_back(sformat("$1/role/$2", service.application_name(), hyd.roinfo.roid));
-    redis_cmd.emplace_back(hyd.roinfo.serialize_to_string());
-    redis_cmd.emplace_back(&"EX");
-    redis_cmd.emplace_back(sformat("$1", ttl.count()));
+    redis_cmd.emplace_back(&"EVAL");
+    redis_cmd.emplace_back(&redis_store_and_renew);
+    redis_cmd.emplace_back(&"2");   // two keys
+    redis_cmd.emplace_back(sformat("$1/role/$2", service.application_name(), hyd.roinfo.roid));  // KEYS[1]
+    redis_cmd.emplace_back(sformat("$1/role_owner/$2", service.application_name(), hyd.roinfo.roid));  // KEYS[2]
+    redis_cmd.emplace_back(service.service_uuid().to_string());  // ARGV[1]
+    redis_cmd.emplace_back(sformat("$1", impl->redis_role_ttl.count()));  // ARGV[2]
+    redis_cmd.emplace_back(full ? &"1" : &"0");  // ARGV[3]
+    redis_cmd.emplace_back(&"head");  // ARGV[4]
+    redis_cmd.emplace_back(hyd.roinfo.serialize_head_to_string());  // ARGV[5]
+    redis_cmd.append(redis_parts.begin(), redis_parts.end());  // ARGV[6...]
 
     auto task2 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
     ::poseidon::task_scheduler.launch(task2);
+    return task2;
+  }
+
+void
+do_mark_db_record_dirty(const shptr<Implementation>& impl, int64_t roid)
+  {
+    auto ptr = impl->hyd_roles.ptr(roid);
+    if(ptr)
+      ptr->role->mark_dirty(role_dirty_db_record);
+  }
+
+void
+do_schedule_if_dirty(const shptr<Implementation>& impl, int64_t roid, steady_time now)
+  {
+    auto ptr = impl->hyd_roles.ptr(roid);
+    if(ptr && do_is_role_dirty(*ptr))
+      impl->save_scheduler.mark_dirty(roid, now);
+  }
+
+void
+do_finish_store_role_into_redis(const shptr<Implementation>& impl, Hydrated_Role& hyd,
+                                const shptr<::poseidon::Redis_Query_Future>& task2)
+  {
+    bool stored = task2->successful() && task2->result().is_nil();
+    if(!stored) {
+      // Either the role has expired from Redis, or the write has failed. Parts
+      // that were not written have been marked clean, so write all parts next
+      // time. This doesn't rely on the journal, which may be disabled.
+      if(task2->successful())
+        POSEIDON_LOG_WARN(("Role `$1` not found in Redis; rewriting all parts"), hyd.roinfo.roid);
+      else
+        POSEIDON_LOG_WARN(("Could not save role `$1` into Redis; rewriting all parts"), hyd.roinfo.roid);
+
+      hyd.avatar_gen = UINT64_MAX;
+      hyd.profile_gen = UINT64_MAX;
+      hyd.db_record_gen = UINT64_MAX;
+      impl->save_scheduler.mark_dirty(hyd.roinfo.roid, steady_clock::now());
+    }
+
+    auto ptr = impl->journaled_roles.ptr(hyd.roinfo.roid);
+    if(!ptr || (ptr->serial != hyd.journal_serial))
+      return;
+
+    if(!stored) {
+      // Keep the record, which will be replayed later.
+      POSEIDON_LOG_WARN(("Could not save role `$1` into Redis; keeping it in journal"), hyd.roinfo.roid);
+      impl->journaled_roles.mut(hyd.roinfo.roid).failed = true;
+      return;
+    }
+
+    impl->journaled_roles.erase(hyd.roinfo.roid);
+  }
+
+void
+do_store_role_into_redis(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber,
+                         Hydrated_Role& hyd)
+  {
+    bool dirty = do_is_role_dirty(hyd);
+    auto task2 = do_launch_store_role_into_redis(impl, hyd);
     fiber.yield(task2);
+    do_finish_store_role_into_redis(impl, hyd, task2);
 
-    POSEIDON_LOG_INFO(("#sav# Saved into Redis: role `$1` (`$2`), updated on `$3`"),
-                      hyd.roinfo.roid, hyd.roinfo.nickname, hyd.roinfo.update_time);
+    if(task2->successful() && !task2->result().is_nil()) {
+      // The role has expired from Redis, so write it again as a whole.
+      task2 = do_launch_store_role_into_redis(impl, hyd);
+      fiber.yield(task2);
+      do_finish_store_role_into_redis(impl, hyd, task2);
+    }
+
+    if(dirty && task2->successful() && task2->result().is_nil())
+      POSEIDON_LOG_INFO(("#sav# Saved into Redis: role `$1` (`$2`), updated on `$3`"),
+                        hyd.roinfo.roid, hyd.roinfo.nickname, hyd.roinfo.update_time);
+  }
+
+bool
+do_acquire_role_lease(::poseidon::Abstract_Fiber& fiber, int64_t roid, seconds ttl)
+  {
+    // Take ownership of a role. If it is owned by another logic service that is
+    // still online, this operation fails. If the owner has gone away, ownership
+    // is transferred to us, provided that nobody else has taken it in between.
+    static constexpr char redis_acquire_lease[] =
+        R"!!!(
+          local owner = redis.call('GET', KEYS[1])
+          if owner and owner ~= ARGV[1] and owner ~= ARGV[2] then
+            return owner
+          end
+          redis.call('SET', KEYS[1], ARGV[1], 'EX', ARGV[3])
+          return nil
+        )!!!";
+
+    cow_string expected_owner;
+    for(;;) {
+      cow_vector<cow_string> redis_cmd;
+      redis_cmd.emplace_back(&"EVAL");
+      redis_cmd.emplace_back(&redis_acquire_lease);
+      redis_cmd.emplace_back(&"1");   // one key
+      redis_cmd.emplace_back(sformat("$1/role_owner/$2", service.application_name(), roid));  // KEYS[1]
+      redis_cmd.emplace_back(service.service_uuid().to_string());  // ARGV[1]
+      redis_cmd.emplace_back(expected_owner);  // ARGV[2]
+      redis_cmd.emplace_back(sformat("$1", ttl.count()));  // ARGV[3]
+
+      auto task2 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
+      ::poseidon::task_scheduler.launch(task2);
+      fiber.yield(task2);
+
+      if(task2->result().is_nil())
+        return true;
+
+      // Check whether the current owner is still online. If it is the same one
+      // that we have seen last time, then it must have renewed its lease.
+      cow_string owner = task2->result().as_string();
+      if((owner == expected_owner) || service.find_service_record_opt(::poseidon::UUID(owner))) {
+        POSEIDON_LOG_WARN(("Role `$1` is owned by logic service `$2`"), roid, owner);
+        return false;
+      }
+
+      POSEIDON_LOG_WARN(("Taking over role `$1` from logic service `$2`"), roid, owner);
+      expected_owner = owner;
+    }
   }
 
 void
-do_flush_role_to_mysql(::poseidon::Abstract_Fiber& fiber, Hydrated_Role& hyd)
+do_release_role_lease(::poseidon::Abstract_Fiber& fiber, int64_t roid)
+  {
+    static constexpr char redis_release_lease[] =
+        R"!!!(
+          if redis.call('GET', KEYS[1]) == ARGV[1] then
+            redis.call('DEL', KEYS[1])
+          end
+          return nil
+        )!!!";
+
+    cow_vector<cow_string> redis_cmd;
+    redis_cmd.emplace_back(&"EVAL");
+    redis_cmd.emplace_back(&redis_release_lease);
+    redis_cmd.emplace_back(&"1");   // one key
+    redis_cmd.emplace_back(sformat("$1/role_owner/$2", service.application_name(), roid));  // KEYS[1]
+    redis_cmd.emplace_back(service.service_uuid().to_string());  // ARGV[1]
+
+    auto task2 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
+    ::poseidon::task_scheduler.launch(task2);
+    fiber.yield(task2);
+  }
+
+void
+do_flush_pending_roles(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber)
+  {
+    if(impl->pending_flushes.empty())
+      return;
+
+    // Take all pending flushes, so new ones can be added while we are waiting
+    // for monitors. Roles are grouped by monitor.
+    cow_int64_dictionary<::poseidon::UUID> pending_flushes;
+    pending_flushes.swap(impl->pending_flushes);
+
+    cow_uuid_dictionary<::taxon::V_array> roid_lists;
+    for(const auto& r : pending_flushes)
+      roid_lists.open(r.second).emplace_back(r.first);
+
+    cow_vector<shptr<Service_Future>> requests;
+    ::std::vector<::std::pair<::poseidon::UUID, ::taxon::V_array>> request_roid_lists;
+    for(const auto& r : roid_lists)
+      for(size_t offset = 0;  offset < r.second.size();  offset += impl->flush_batch_size) {
+        ::taxon::V_array roid_list;
+        size_t count = ::std::min<size_t>(r.second.size() - offset, impl->flush_batch_size);
+        roid_list.append(r.second.begin() + static_cast<ptrdiff_t>(offset),
+                         r.second.begin() + static_cast<ptrdiff_t>(offset + count));
+
+        ::taxon::V_object tx_args;
+        tx_args.try_emplace(&"roid_list", roid_list);
+
+        auto srv_q = new_sh<Service_Future>(r.first, &"monitor/role/flush_multi", tx_args);
+        service.launch(srv_q);
+        requests.emplace_back(srv_q);
+        request_roid_lists.emplace_back(r.first, move(roid_list));
+      }
+
+    for(const auto& srv_q : requests)
+      fiber.yield(srv_q);
+
+    // Queue roles that have not been written again. If a role has been queued
+    // again in the meantime, that one is kept.
+    size_t retry_count = 0;
+    for(size_t k = 0;  k != requests.size();  ++k) {
+      const auto& srv_q = requests[k];
+      const auto& monitor_service_uuid = request_roid_lists[k].first;
+      if(!srv_q->successful() || (srv_q->response(0).error != "")) {
+        POSEIDON_LOG_ERROR(("Could not flush $1 role(s) via monitor `$2`"),
+                           request_roid_lists[k].second.size(), monitor_service_uuid);
+
+        for(const auto& r : request_roid_lists[k].second)
+          retry_count += impl->pending_flushes.try_emplace(r.as_integer(), monitor_service_uuid).second;
+        continue;
+      }
+
+      for(const auto& r : srv_q->response(0).obj.at(&"unsaved_roid_list").as_array())
+        retry_count += impl->pending_flushes.try_emplace(r.as_integer(), monitor_service_uuid).second;
+    }
+
+    POSEIDON_LOG_INFO(("#sav# Flushed to MySQL: $1 role(s) in $2 batch(es), $3 to retry"),
+                      pending_flushes.size(), requests.size(), retry_count);
+  }
+
+void
+do_flush_role_to_mysql(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber,
+                       Hydrated_Role& hyd)
   {
     ::poseidon::UUID monitor_service_uuid;
     for(const auto& r : service.all_service_records())
@@ -104,15 +448,136 @@ do_flush_role_to_mysql(::poseidon::Abstract_Fiber& fiber, Hydrated_Role& hyd)
       hyd.role->mf_monitor_srv() = monitor_service_uuid;
     }
 
-    ::taxon::V_object tx_args;
-    tx_args.try_emplace(&"roid", hyd.roinfo.roid);
+    // Flushes are batched. Multiple flushes of the same role are coalesced, as
+    // monitors always take the latest data from Redis.
+    impl->pending_flushes.insert_or_assign(hyd.roinfo.roid, monitor_service_uuid);
+    if(impl->pending_flushes.size() >= impl->flush_batch_size)
+      do_flush_pending_roles(impl, fiber);
+  }
 
-    auto srv_q = new_sh<Service_Future>(monitor_service_uuid, &"monitor/role/flush", tx_args);
-    service.launch(srv_q);
-    fiber.yield(srv_q);
+void
+do_flush_timer_callback(const shptr<Implementation>& impl,
+                        const shptr<::poseidon::Abstract_Timer>& /*timer*/,
+                        ::poseidon::Abstract_Fiber& fiber, steady_time /*now*/)
+  {
+    do_flush_pending_roles(impl, fiber);
+  }
 
-    POSEIDON_LOG_INFO(("#sav# Flushed to MySQL: role `$1` (`$2`), updated on `$3`"),
-                      hyd.roinfo.roid, hyd.roinfo.nickname, hyd.roinfo.update_time);
+void
+do_replay_journal(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber)
+  {
+    // Write roles whose writes have failed into Redis again, unless they have
+    // been overwritten with newer data. If Redis is still unavailable, stop and
+    // try again next time.
+    cow_int64_dictionary<Journaled_Role> journaled_roles;
+    for(const auto& r : impl->journaled_roles)
+      if(r.second.failed)
+        journaled_roles.try_emplace(r.first, r.second);
+
+    for(const auto& r : journaled_roles) {
+      Role_Record roinfo;
+      roinfo.parse_from_string(r.second.data);
+
+      cow_vector<cow_string> redis_cmd;
+      redis_cmd.emplace_back(&"HGET");
+      redis_cmd.emplace_back(sformat("$1/role/$2", service.application_name(), roinfo.roid));
+      redis_cmd.emplace_back(&"head");
+
+      auto task2 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
+      ::poseidon::task_scheduler.launch(task2);
+      fiber.yield(task2);
+
+      if(!task2->successful()) {
+        POSEIDON_LOG_WARN(("Redis still unavailable; $1 role(s) pending in journal"), journaled_roles.size());
+        return;
+      }
+
+      cow_string old_head;
+      if(!task2->result().is_nil()) {
+        old_head = task2->result().as_string();
+
+        Role_Record old_roinfo;
+        old_roinfo.parse_head_from_string(old_head);
+        if(old_roinfo.update_time >= roinfo.update_time) {
+          // This record is out of date, so discard it.
+          auto ptr = impl->journaled_roles.ptr(roinfo.roid);
+          if(ptr && (ptr->serial == r.second.serial))
+            impl->journaled_roles.erase(roinfo.roid);
+          continue;
+        }
+      }
+
+      static constexpr char redis_replace[] =
+          R"!!!(
+            if (redis.call('HGET', KEYS[1], 'head') or '') ~= ARGV[1] then
+              return 1
+            end
+            redis.call('DEL', KEYS[1])
+            redis.call('HSET', KEYS[1], 'head', ARGV[3], 'avatar', ARGV[4],
+                       'profile', ARGV[5], 'whole', ARGV[6])
+            redis.call('EXPIRE', KEYS[1], ARGV[2])
+            return nil
+          )!!!";
+
+      redis_cmd.clear();
+      redis_cmd.emplace_back(&"EVAL");
+      redis_cmd.emplace_back(&redis_replace);
+      redis_cmd.emplace_back(&"1");   // one key
+      redis_cmd.emplace_back(sformat("$1/role/$2", service.application_name(), roinfo.roid));  // KEYS[1]
+      redis_cmd.emplace_back(old_head);  // ARGV[1]
+      redis_cmd.emplace_back(sformat("$1", impl->redis_role_ttl.count()));  // ARGV[2]
+      redis_cmd.emplace_back(roinfo.serialize_head_to_string());  // ARGV[3]
+      redis_cmd.emplace_back(blob_encode(roinfo.avatar));  // ARGV[4]
+      redis_cmd.emplace_back(blob_encode(roinfo.profile));  // ARGV[5]
+      redis_cmd.emplace_back(blob_encode(roinfo.whole));  // ARGV[6]
+
+      task2 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
+      ::poseidon::task_scheduler.launch(task2);
+      fiber.yield(task2);
+
+      if(!task2->successful())
+        return;
+
+      if(!task2->result().is_nil())
+        continue;  // changed in between; retry next time
+
+      auto ptr = impl->journaled_roles.ptr(roinfo.roid);
+      if(ptr && (ptr->serial == r.second.serial))
+        impl->journaled_roles.erase(roinfo.roid);
+
+      POSEIDON_LOG_INFO(("#sav# Replayed from journal: role `$1` (`$2`), updated on `$3`"),
+                        roinfo.roid, roinfo.nickname, roinfo.update_time);
+
+      if(old_head.empty() && !impl->hyd_roles.count(roinfo.roid)) {
+        // The role has been unloaded from Redis, so the record that we have just
+        // written would expire. Ask a monitor to copy it into MySQL.
+        for(const auto& rr : service.all_service_records())
+          if((rr.second.zone_id == roinfo._home_zone) && (rr.second.service_type == "monitor"))
+            impl->pending_flushes.insert_or_assign(roinfo.roid, rr.first);
+      }
+    }
+  }
+
+void
+do_compact_journal(const shptr<Implementation>& impl)
+  {
+    if(impl->journal.size() < impl->journal_compaction_threshold)
+      return;
+
+    // Records that have been written into Redis are no longer needed. If Redis
+    // has been unavailable for a long time, pending records may take a lot of
+    // space, so don't do this again until the file doubles.
+    cow_int64_dictionary<cow_string> records;
+    for(const auto& r : impl->journaled_roles)
+      records.try_emplace(r.first, r.second.data);
+
+    size_t old_size = impl->journal.size();
+    impl->journal.rewrite(records);
+    impl->journal_compaction_threshold = ::std::max(impl->journal_compaction_size,
+                                                    impl->journal.size() * 2);
+
+    POSEIDON_LOG_INFO(("#sav# Compacted journal `$1`: $2 record(s), $3 -> $4 bytes"),
+                      impl->journal.path(), records.size(), old_size, impl->journal.size());
   }
 
 void
@@ -120,9 +585,14 @@ do_save_timer_callback(const shptr<Implementation>& impl,
                        const shptr<::poseidon::Abstract_Timer>& /*timer*/,
                        ::poseidon::Abstract_Fiber& fiber, steady_time now)
   {
+    if(!impl->journaled_roles.empty())
+      do_replay_journal(impl, fiber);
+
     if(!impl->hyd_roles.empty()) {
       // Check that every user is still on the same agent with the same role.
-      // Requests are made in parallel.
+      // Agents send digests of their online roles to us, so this is only
+      // necessary for agents whose digests haven't matched ours for a while,
+      // and agents that have gone away. Requests are made in parallel.
       struct Agent_Request
         {
           cow_dictionary<int64_t> roids_by_username;
@@ -130,9 +600,19 @@ do_save_timer_callback(const shptr<Implementation>& impl,
           shptr<Service_Future> srv_q;
         };
 
+      cow_uuid_dictionary<steady_time> suspicious_agents;
+      for(const auto& r : impl->suspicious_agents)
+        if(now - r.second >= 10s)
+          suspicious_agents.try_emplace(r.first, r.second);
+
+      for(const auto& r : suspicious_agents)
+        impl->suspicious_agents.erase(r.first);
+
       cow_uuid_dictionary<Agent_Request> agent_requests;
       for(const auto& r : impl->hyd_roles)
-        if(r.second.role->agent_service_uuid() != ::poseidon::UUID()) {
+        if((r.second.role->agent_service_uuid() != ::poseidon::UUID())
+           && (suspicious_agents.count(r.second.role->agent_service_uuid())
+               || !service.find_service_record_opt(r.second.role->agent_service_uuid()))) {
           auto& ar = agent_requests.open(r.second.role->agent_service_uuid());
           ar.roids_by_username.try_emplace(r.second.roinfo.username, r.second.roinfo.roid);
           ar.username_list.emplace_back(r.second.roinfo.username.rdstr());
@@ -181,59 +661,94 @@ do_save_timer_callback(const shptr<Implementation>& impl,
           if(agent_down) {
             // It's likely that the application is being shut down, so flush all
             // roles immediately.
-            do_store_role_into_redis(fiber, hyd, impl->redis_role_ttl);
+            do_store_role_into_redis(impl, fiber, hyd);
             impl->hyd_roles.find_and_assign(rr.second, hyd);
-            do_flush_role_to_mysql(fiber, hyd);
+            do_flush_role_to_mysql(impl, fiber, hyd);
           }
         }
       }
-    }
 
-    if(impl->save_buckets.empty()) {
-      // Arrange online roles for writing. Initially, users are divided into 20
-      // buckets. For each timer tick, one bucket will be popped and written.
-      while(impl->save_buckets.size() < 20)
-        impl->save_buckets.emplace_back();
-
-      for(const auto& r : impl->hyd_roles) {
-        auto current_bucket = impl->save_buckets.begin();
-        impl->save_buckets.splice(impl->save_buckets.end(), impl->save_buckets, current_bucket);
-        if(current_bucket->size() >= current_bucket->capacity()) {
-          ptrdiff_t sp = static_cast<ptrdiff_t>(current_bucket->capacity() / 2);
-          impl->save_buckets.emplace_back(current_bucket->move_begin(), current_bucket->move_begin() + sp);
-          current_bucket->erase(current_bucket->begin(), current_bucket->begin() + sp);
-        }
-        current_bucket->push_back(r.first);
-      }
+      do_flush_pending_roles(impl, fiber);
     }
 
-    auto bucket = move(impl->save_buckets.back());
-    impl->save_buckets.pop_back();
-    while(!bucket.empty()) {
-      int64_t roid = bucket.back();
-      bucket.pop_back();
-
-      // Serialize role data for saving. As this is an asynchronous operation,
-      // `impl->hyd_roles` may change between iterations. It's crucial that we
-      // limit scopes of pointers, references, and iterators.
-      Hydrated_Role hyd;
-      impl->hyd_roles.find_and_copy(hyd, roid);
-      if(!hyd.role)
+    // Serialize roles that are due and write them into Redis in parallel, so
+    // they take only one round trip.
+    struct Pending_Store
+      {
+        Hydrated_Role hyd;
+        bool logout;
+        shptr<::poseidon::Redis_Query_Future> task2;
+      };
+
+    steady_time save_start_time = steady_clock::now();
+    ::std::vector<int64_t> roids;
+    impl->save_scheduler.pop_due(roids, save_start_time);
+    ::std::vector<Pending_Store> pending_stores;
+    pending_stores.reserve(roids.size());
+    size_t dirty_count = 0;
+
+    for(int64_t roid : roids) {
+
+      Pending_Store ps;
+      impl->hyd_roles.find_and_copy(ps.hyd, roid);
+      if(!ps.hyd.role)
         continue;
 
-      if(now - hyd.role->mf_dc_since() >= impl->disconnect_to_logout_duration) {
+      ps.logout = now - ps.hyd.role->mf_dc_since() >= impl->disconnect_to_logout_duration;
+      if(ps.logout) {
         // Role has been disconnected for too long.
-        POSEIDON_LOG_DEBUG(("Logging out role `$1` due to inactivity"), hyd.roinfo.roid);
-        hyd.role->on_logout();
+        POSEIDON_LOG_DEBUG(("Logging out role `$1` due to inactivity"), ps.hyd.roinfo.roid);
+        ps.hyd.role->on_logout();
+        ps.hyd.role->mark_dirty(role_dirty_db_record);
+      }
 
-        do_store_role_into_redis(fiber, hyd, impl->redis_role_ttl);
-        impl->hyd_roles.erase(roid);
-        do_flush_role_to_mysql(fiber, hyd);
+      // Game logic may change a role without marking it dirty, for example in
+      // `on_every_second()`. As a safety net, write all parts every once in a
+      // while anyway.
+      if(now >= ps.hyd.full_save_time) {
+        ps.hyd.role->mark_dirty();
+        ps.hyd.full_save_time = now + impl->save_full_interval;
       }
-      else {
-        do_store_role_into_redis(fiber, hyd, impl->redis_role_ttl);
-        impl->hyd_roles.find_and_assign(roid, hyd);
+
+      dirty_count += do_is_role_dirty(ps.hyd);
+      ps.task2 = do_launch_store_role_into_redis(impl, ps.hyd);
+      pending_stores.emplace_back(move(ps));
+    }
+
+    // As this is an asynchronous operation, `impl->hyd_roles` may change
+    // between iterations. It's crucial that we limit scopes of pointers,
+    // references, and iterators.
+    steady_time store_start_time = steady_clock::now();
+    for(auto& ps : pending_stores) {
+      fiber.yield(ps.task2);
+      do_finish_store_role_into_redis(impl, ps.hyd, ps.task2);
+
+      if(ps.logout && do_is_role_dirty(ps.hyd)) {
+        // The role is going away, so don't wait for the next save.
+        do_store_role_into_redis(impl, fiber, ps.hyd);
+      }
+
+      if(ps.logout) {
+        impl->hyd_roles.erase(ps.hyd.roinfo.roid);
+        impl->save_scheduler.erase(ps.hyd.roinfo.roid);
+        do_release_role_lease(fiber, ps.hyd.roinfo.roid);
+        do_flush_role_to_mysql(impl, fiber, ps.hyd);
       }
+      else
+        impl->hyd_roles.find_and_assign(ps.hyd.roinfo.roid, ps.hyd);
+    }
+
+    if(!pending_stores.empty())
+      POSEIDON_LOG_INFO(("#sav# Saved into Redis: $1 role(s), $2 changed, serialization $3 ms, total $4 ms; $5 due, lag $6 ms"),
+                        pending_stores.size(), dirty_count,
+                        duration_cast<milliseconds>(store_start_time - save_start_time).count(),
+                        duration_cast<milliseconds>(steady_clock::now() - save_start_time).count(),
+                        impl->save_scheduler.count_due(save_start_time),
+                        impl->save_scheduler.lag(save_start_time).count());
+
+    if(impl->journal.is_open()) {
+      impl->journal.flush();
+      do_compact_journal(impl);
     }
   }
 
@@ -255,7 +770,8 @@ do_role_login(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fib
     // * Description
     //
     //   Loads a role from Redis and triggers a _login_ event. If the role has not been
-    //   loaded into Redis, this operation fails.
+    //   loaded into Redis, or is owned by another logic service that is still online,
+    //   this operation fails.
 
     ////////////////////////////////////////////////////////////
     //
@@ -272,23 +788,54 @@ do_role_login(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fib
     //
     Hydrated_Role hyd;
     if(!impl->hyd_roles.find_and_copy(hyd, roid)) {
+      // Take ownership of this role, so other services can locate it.
+      if(!do_acquire_role_lease(fiber, roid, impl->redis_role_ttl)) {
+        response.try_emplace(&"status", &"gs_role_foreign");
+        return;
+      }
+
       // Load role from Redis.
+      static constexpr char redis_load[] =
+          R"!!!(
+            local fields = redis.call('HGETALL', KEYS[1])
+            if #fields ~= 0 then
+              redis.call('EXPIRE', KEYS[1], ARGV[1])
+            end
+            return fields
+          )!!!";
+
       cow_vector<cow_string> redis_cmd;
-      redis_cmd.emplace_back(&"GETEX");
-      redis_cmd.emplace_back(sformat("$1/role/$2", service.application_name(), roid));
-      redis_cmd.emplace_back(&"EX");
-      redis_cmd.emplace_back(sformat("$1", impl->redis_role_ttl.count()));
+      redis_cmd.emplace_back(&"EVAL");
+      redis_cmd.emplace_back(&redis_load);
+      redis_cmd.emplace_back(&"1");   // one key
+      redis_cmd.emplace_back(sformat("$1/role/$2", service.application_name(), roid));  // KEYS[1]
+      redis_cmd.emplace_back(sformat("$1", impl->redis_role_ttl.count()));  // ARGV[1]
 
       auto task2 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
       ::poseidon::task_scheduler.launch(task2);
       fiber.yield(task2);
 
-      if(task2->result().is_nil()) {
+      if(task2->result().as_array().empty()) {
+        if(!impl->hyd_roles.count(roid))
+          do_release_role_lease(fiber, roid);
+
         response.try_emplace(&"status", &"gs_role_not_loaded");
         return;
       }
 
-      hyd.roinfo.parse_from_string(task2->result().as_string());
+      hyd.roinfo.parse_from_redis_hash(task2->result().as_array());
+
+      Journaled_Role jr;
+      if(impl->journaled_roles.find_and_copy(jr, roid)) {
+        // The role may have been saved into the journal but not into Redis.
+        Role_Record roinfo;
+        roinfo.parse_from_string(jr.data);
+        if(roinfo.update_time > hyd.roinfo.update_time) {
+          POSEIDON_LOG_WARN(("Loading role `$1` from journal"), roid);
+          hyd.roinfo = roinfo;
+        }
+      }
+
       hyd.role = new_sh<Role>();
 
       hyd.role->mf_roid() = hyd.roinfo.roid;
@@ -312,11 +859,13 @@ do_role_login(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fib
     hyd.role->mf_agent_srv() = agent_service_uuid;
     hyd.role->mf_monitor_srv() = monitor_service_uuid;
     hyd.role->mf_dc_since() = steady_time::max();
+    do_reset_client_state(hyd.role);
     hyd.role->on_connect();
 
-    do_store_role_into_redis(fiber, hyd, impl->redis_role_ttl);
+    do_store_role_into_redis(impl, fiber, hyd);
     impl->hyd_roles.find_and_assign(roid, hyd);
-    do_flush_role_to_mysql(fiber, hyd);
+    impl->save_scheduler.insert(roid, steady_clock::now());
+    do_flush_role_to_mysql(impl, fiber, hyd);
 
     response.try_emplace(&"status", &"gs_ok");
   }
@@ -356,10 +905,13 @@ do_role_logout(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fi
     hyd.role->mf_dc_since() = steady_clock::now();
     hyd.role->on_disconnect();
     hyd.role->on_logout();
+    hyd.role->mark_dirty(role_dirty_db_record);
 
-    do_store_role_into_redis(fiber, hyd, impl->redis_role_ttl);
+    do_store_role_into_redis(impl, fiber, hyd);
     impl->hyd_roles.erase(roid);
-    do_flush_role_to_mysql(fiber, hyd);
+    impl->save_scheduler.erase(roid);
+    do_release_role_lease(fiber, roid);
+    do_flush_role_to_mysql(impl, fiber, hyd);
 
     response.try_emplace(&"status", &"gs_ok");
   }
@@ -390,6 +942,7 @@ do_role_reconnect(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber&
 
     hyd.role->mf_agent_srv() = agent_service_uuid;
     hyd.role->mf_dc_since() = steady_time::max();
+    do_reset_client_state(hyd.role);
     hyd.role->on_connect();
 
     response.try_emplace(&"roid", hyd.roinfo.roid);
@@ -434,6 +987,52 @@ do_role_disconnect(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber
     response.try_emplace(&"status", &"gs_ok");
   }
 
+void
+do_role_check_digest(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& /*fiber*/,
+                     const ::poseidon::UUID& request_service_uuid,
+                     ::taxon::V_object& response, const ::taxon::V_object& request)
+  {
+    // * Request Parameters
+    //
+    //   - `count` <sub>integer</sub> : Number of online roles on the agent.
+    //   - `hash` <sub>integer</sub> : Sum of hashes of online roles on the agent.
+    //
+    // * Response Parameters
+    //
+    //   - `status` <sub>string</sub> : [General status code.](#general-status-codes)
+    //
+    // * Description
+    //
+    //   Compares the digest of online roles from an agent with that of roles which
+    //   are connected to the agent on this service. Agents send digests when they
+    //   change, and once in a while. Mismatches are normal when roles are logging
+    //   in or out, but if one persists for 10 seconds, the agent will be checked
+    //   with `agent/user/check_roles`.
+
+    ////////////////////////////////////////////////////////////
+    //
+    Role_Digest agent_digest;
+    agent_digest.count = static_cast<uint64_t>(request.at(&"count").as_integer());
+    agent_digest.hash = static_cast<uint64_t>(request.at(&"hash").as_integer());
+
+    ////////////////////////////////////////////////////////////
+    //
+    Role_Digest my_digest;
+    for(const auto& r : impl->hyd_roles)
+      if(r.second.role->agent_service_uuid() == request_service_uuid)
+        my_digest.add(r.second.role->username(), r.second.role->roid());
+
+    if(my_digest == agent_digest)
+      impl->suspicious_agents.erase(request_service_uuid);
+    else {
+      POSEIDON_LOG_DEBUG(("Role digest mismatch with agent `$1`: $2 vs. $3 role(s)"),
+                         request_service_uuid, my_digest.count, agent_digest.count);
+      impl->suspicious_agents.try_emplace(request_service_uuid, steady_clock::now());
+    }
+
+    response.try_emplace(&"status", &"gs_ok");
+  }
+
 void
 do_role_on_client_request(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber,
                           const ::poseidon::UUID& /*request_service_uuid*/,
@@ -475,17 +1074,24 @@ do_role_on_client_request(const shptr<Implementation>& impl, ::poseidon::Abstrac
       return;
     }
 
-    // Call the user-defined handler to get response data.
+    // Call the user-defined handler to get response data. Handlers usually
+    // change role cultivation data, so it's always written, even if the handler
+    // has not marked it dirty.
     ::taxon::V_object client_resp;
     try {
       handler(fiber, roid, client_resp, client_req);
     }
     catch(exception& stdex) {
       POSEIDON_LOG_ERROR(("Unhandled exception in `$1 $2`: $3"), client_opcode, client_req, stdex);
+      do_mark_db_record_dirty(impl, roid);
+      do_schedule_if_dirty(impl, roid, steady_clock::now());
       response.try_emplace(&"status", &"gs_role_handler_except");
       return;
     }
 
+    do_mark_db_record_dirty(impl, roid);
+    do_schedule_if_dirty(impl, roid, steady_clock::now());
+
     response.try_emplace(&"client_resp", client_resp);
     response.try_emplace(&"status", &"gs_ok");
   }
@@ -493,7 +1099,7 @@ do_role_on_client_request(const shptr<Implementation>& impl, ::poseidon::Abstrac
 void
 do_every_second_timer_callback(const shptr<Implementation>& impl,
                                const shptr<::poseidon::Abstract_Timer>& /*timer*/,
-                               ::poseidon::Abstract_Fiber& /*fiber*/, steady_time /*now*/)
+                               ::poseidon::Abstract_Fiber& /*fiber*/, steady_time now)
   {
     ::std::vector<wkptr<Role>> weak_roles;
     weak_roles.reserve(impl->hyd_roles.size());
@@ -508,6 +1114,96 @@ do_every_second_timer_callback(const shptr<Implementation>& impl,
         continue;
 
       POSEIDON_CATCH_EVERYTHING(role->on_every_second());
+      do_schedule_if_dirty(impl, role->roid(), now);
+    }
+  }
+
+void
+do_client_state_timer_callback(const shptr<Implementation>& impl,
+                               const shptr<::poseidon::Abstract_Timer>& /*timer*/,
+                               ::poseidon::Abstract_Fiber& /*fiber*/, steady_time now)
+  {
+    for(const auto& r : impl->hyd_roles) {
+      const auto& role = r.second.role;
+      if(role->agent_service_uuid().is_nil())
+        continue;
+
+      // Send a full snapshot periodically, so a client can recover from lost
+      // deltas; otherwise send changed fields only.
+      bool keyframe = now - role->mf_client_state_keyframe_time() >= impl->client_state_keyframe_interval;
+      if(!keyframe && !role->mf_client_state_dirty())
+        continue;
+
+      ::taxon::V_object state;
+      try {
+        role->make_client_state(state);
+      }
+      catch(exception& stdex) {
+        POSEIDON_LOG_ERROR(("Could not make client state of $1: $2"), *role, stdex);
+        role->mf_client_state_dirty() = false;
+        continue;
+      }
+
+      cow_dictionary<cow_string> sent;
+      ::taxon::V_object client_data;
+      cow_string client_opcode;
+
+      if(keyframe) {
+        for(const auto& rr : state)
+          sent.try_emplace(rr.first, ::taxon::Value(rr.second).to_string());
+
+        client_opcode = &"ntfy/role/state";
+        client_data.try_emplace(&"state", state);
+      }
+      else {
+        // Compare each field with the last value that has been sent. A field
+        // that no longer exists is sent as `unset`.
+        sent = role->mf_client_state_sent();
+        ::taxon::V_object set_fields;
+        ::taxon::V_array unset_fields;
+
+        for(const auto& rr : state) {
+          auto str = ::taxon::Value(rr.second).to_string();
+          auto psent = sent.ptr(rr.first);
+          if(psent && (*psent == str))
+            continue;
+
+          set_fields.try_emplace(rr.first, rr.second);
+          sent.insert_or_assign(rr.first, str);
+        }
+
+        for(const auto& rr : role->mf_client_state_sent())
+          if(state.count(rr.first) == 0) {
+            unset_fields.emplace_back(rr.first.rdstr());
+            sent.erase(rr.first);
+          }
+
+        if(set_fields.empty() && unset_fields.empty()) {
+          role->mf_client_state_dirty() = false;
+          continue;
+        }
+
+        client_opcode = &"ntfy/role/state_delta";
+        if(!set_fields.empty())
+          client_data.try_emplace(&"set", set_fields);
+        if(!unset_fields.empty())
+          client_data.try_emplace(&"unset", unset_fields);
+      }
+
+      role->mf_client_state_sent() = sent;
+      role->mf_client_state_dirty() = false;
+      if(keyframe)
+        role->mf_client_state_keyframe_time() = now;
+
+      POSEIDON_LOG_TRACE(("Sending `$1` to $2: $3"), client_opcode, *role, client_data);
+
+      ::taxon::V_object tx_args;
+      tx_args.try_emplace(&"username", role->username().rdstr());
+      tx_args.try_emplace(&"client_opcode", client_opcode);
+      tx_args.try_emplace(&"client_data", client_data);
+
+      auto srv_q = new_sh<Service_Future>(role->agent_service_uuid(), &"agent/user/push_message", tx_args);
+      service.launch(srv_q);
     }
   }
 
@@ -588,20 +1284,89 @@ reload(const ::poseidon::Config_File& conf_file)
     seconds disconnect_to_logout_duration = seconds(static_cast<int>(conf_file.get_integer_opt(
                                     &"logic.disconnect_to_logout_duration", 1, 999999999).value_or(60)));
 
+    // `logic.client_state_sync_interval`
+    milliseconds client_state_sync_interval = milliseconds(static_cast<int>(conf_file.get_integer_opt(
+                                    &"logic.client_state_sync_interval", 50, 60000).value_or(200)));
+
+    // `logic.client_state_keyframe_interval`
+    seconds client_state_keyframe_interval = seconds(static_cast<int>(conf_file.get_integer_opt(
+                                    &"logic.client_state_keyframe_interval", 1, 999999999).value_or(60)));
+
+    // `logic.save_rate_limit`
+    uint32_t save_rate_limit = static_cast<uint32_t>(conf_file.get_integer_opt(
+                                    &"logic.save_rate_limit", 1, 999999).value_or(1000));
+
+    // `logic.save_max_staleness`
+    seconds save_max_staleness = seconds(static_cast<int>(conf_file.get_integer_opt(
+                                    &"logic.save_max_staleness", 1, 86400).value_or(60)));
+
+    // `logic.journal_directory`
+    cow_string journal_directory;
+    if(auto str = conf_file.get_string_opt(&"logic.journal_directory"))
+      journal_directory = *str;
+
+    // `logic.journal_compaction_size`
+    size_t journal_compaction_size = static_cast<size_t>(conf_file.get_integer_opt(
+                                    &"logic.journal_compaction_size", 1, 999999).value_or(64)) << 20;
+
+    // `logic.flush_batch_size`
+    uint32_t flush_batch_size = static_cast<uint32_t>(conf_file.get_integer_opt(
+                                    &"logic.flush_batch_size", 1, 9999).value_or(100));
+
+    // `logic.flush_interval`
+    milliseconds flush_interval = milliseconds(static_cast<int>(conf_file.get_integer_opt(
+                                    &"logic.flush_interval", 10, 60000).value_or(500)));
+
+    // `logic.save_full_interval`
+    seconds save_full_interval = seconds(static_cast<int>(conf_file.get_integer_opt(
+                                    &"logic.save_full_interval", 1, 86400).value_or(600)));
+
+    if(save_max_staleness * 2 >= redis_role_ttl)
+      POSEIDON_THROW((
+          "Invalid `logic.save_max_staleness`: must be less than half of `redis_role_ttl`",
+          "[in configuration file '$1']"),
+          conf_file.path());
+
     // Set up new configuration. This operation shall be atomic.
     this->m_impl->redis_role_ttl = redis_role_ttl;
     this->m_impl->disconnect_to_logout_duration = disconnect_to_logout_duration;
+    this->m_impl->client_state_sync_interval = client_state_sync_interval;
+    this->m_impl->client_state_keyframe_interval = client_state_keyframe_interval;
+    this->m_impl->save_scheduler.set_limits(save_rate_limit, save_max_staleness);
+    this->m_impl->journal_compaction_size = journal_compaction_size;
+    this->m_impl->flush_batch_size = flush_batch_size;
+    this->m_impl->save_full_interval = save_full_interval;
+    this->m_impl->journal_compaction_threshold = journal_compaction_size;
+
+    if(!this->m_impl->journal.is_open() && (journal_directory != "")) {
+      // Records in the journal may have been left by a previous process, and
+      // will be replayed as if they had failed.
+      cow_int64_dictionary<cow_string> records;
+      this->m_impl->journal.open(records, sformat("$1/logic.$2.journal", journal_directory,
+                                                  service.service_index()));
+
+      for(const auto& r : records) {
+        auto& jr = this->m_impl->journaled_roles.open(r.first);
+        jr.serial = ++ this->m_impl->journal_serial;
+        jr.data = r.second;
+        jr.failed = true;
+      }
+    }
 
     // Set up request handlers.
     service.set_handler(&"logic/role/login", bindw(this->m_impl, do_role_login));
     service.set_handler(&"logic/role/logout", bindw(this->m_impl, do_role_logout));
     service.set_handler(&"logic/role/reconnect", bindw(this->m_impl, do_role_reconnect));
     service.set_handler(&"logic/role/disconnect", bindw(this->m_impl, do_role_disconnect));
+    service.set_handler(&"logic/role/check_digest", bindw(this->m_impl, do_role_check_digest));
     service.set_handler(&"logic/role/on_client_request", bindw(this->m_impl, do_role_on_client_request));
 
     // Restart the service.
-    this->m_impl->save_timer.start(3001ms, bindw(this->m_impl, do_save_timer_callback));
+    this->m_impl->save_timer.start(1001ms, bindw(this->m_impl, do_save_timer_callback));
+    this->m_impl->flush_timer.start(flush_interval, bindw(this->m_impl, do_flush_timer_callback));
     this->m_impl->every_second_timer.start(1s, bindw(this->m_impl, do_every_second_timer_callback));
+    this->m_impl->client_state_timer.start(this->m_impl->client_state_sync_interval,
+                                           bindw(this->m_impl, do_client_state_timer_callback));
   }
 
 }  // namespace k32::logic
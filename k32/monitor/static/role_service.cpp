@@ -5,6 +5,8 @@
 #define K32_FRIENDS_3543B0B1_DC5A_4F34_B9BB_CAE513821771_
 #include "role_service.hpp"
 #include "../globals.hpp"
+#include "../../common/base/save_scheduler.hpp"
+#include "../../common/base/blob_codec.hpp"
 #include <poseidon/base/config_file.hpp>
 #include <poseidon/easy/easy_ws_server.hpp>
 #include <poseidon/easy/easy_timer.hpp>
@@ -14,12 +16,15 @@
 #include <poseidon/fiber/mysql_query_future.hpp>
 #include <poseidon/mysql/mysql_connection.hpp>
 #include <poseidon/static/mysql_connector.hpp>
-#include <list>
 namespace k32::monitor {
 namespace {
 
 const cow_int64_dictionary<Role_Record> empty_role_record_map;
 
+// This is the maximum number of roles in a multi-row statement. Roles can be
+// large, and a statement must not exceed `max_allowed_packet` of MySQL.
+constexpr uint32_t roles_per_statement = 100;
+
 struct Implementation
   {
     seconds redis_role_ttl;
@@ -29,7 +34,7 @@ struct Implementation
     // remote data from mysql
     bool db_ready = false;
     cow_int64_dictionary<Role_Record> role_records;
-    ::std::list<static_vector<int64_t, 255>> save_buckets;
+    Save_Scheduler<int64_t, ::std::hash<int64_t>> save_scheduler;
   };
 
 void
@@ -99,29 +104,89 @@ do_mysql_check_table_role(::poseidon::Abstract_Fiber& fiber)
     POSEIDON_LOG_INFO(("Finished verification of MySQL table `$1`"), table.name);
   }
 
+const cow_string&
+do_find_redis_hash_field(const ::taxon::V_array& fields, const char* name)
+  {
+    // `HGETALL` returns names and values alternately.
+    for(size_t k = 0;  k + 1 < fields.size();  k += 2)
+      if(fields.at(k).as_string() == name)
+        return fields.at(k + 1).as_string();
+
+    POSEIDON_THROW(("Field `$1` not found in Redis hash"), name);
+  }
+
 void
 do_store_role_record_into_redis(::poseidon::Abstract_Fiber& fiber, Role_Record& roinfo, seconds ttl)
   {
+    // If the role exists in Redis, it may contain unflushed data, so take that
+    // instead.
+    static constexpr char redis_store_if_absent[] =
+        R"!!!(
+          if redis.call('EXISTS', KEYS[1]) == 1 then
+            return redis.call('HGETALL', KEYS[1])
+          end
+          redis.call('HSET', KEYS[1], 'head', ARGV[2], 'avatar', ARGV[3],
+                     'profile', ARGV[4], 'whole', ARGV[5])
+          redis.call('EXPIRE', KEYS[1], ARGV[1])
+          return nil
+        )!!!";
+
     cow_vector<cow_string> redis_cmd;
-    redis_cmd.emplace_back(&"SET");
-    redis_cmd.emplace_back(sformat("$1/role/$2", service.application_name(), roinfo.roid));
-    redis_cmd.emplace_back(roinfo.serialize_to_string());
-    redis_cmd.emplace_back(&"NX");  // no replace
-    redis_cmd.emplace_back(&"GET");
-    redis_cmd.emplace_back(&"EX");
-    redis_cmd.emplace_back(sformat("$1", ttl.count()));
+    redis_cmd.emplace_back(&"EVAL");
+    redis_cmd.emplace_back(&redis_store_if_absent);
+    redis_cmd.emplace_back(&"1");   // one key
+    redis_cmd.emplace_back(sformat("$1/role/$2", service.application_name(), roinfo.roid));  // KEYS[1]
+    redis_cmd.emplace_back(sformat("$1", ttl.count()));  // ARGV[1]
+    redis_cmd.emplace_back(roinfo.serialize_head_to_string());  // ARGV[2]
+    redis_cmd.emplace_back(blob_encode(roinfo.avatar));  // ARGV[3]
+    redis_cmd.emplace_back(blob_encode(roinfo.profile));  // ARGV[4]
+    redis_cmd.emplace_back(blob_encode(roinfo.whole));  // ARGV[5]
 
     auto task2 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
     ::poseidon::task_scheduler.launch(task2);
     fiber.yield(task2);
 
     if(!task2->result().is_nil())
-      roinfo.parse_from_string(task2->result().as_string());
+      roinfo.parse_from_redis_hash(task2->result().as_array());
 
     POSEIDON_LOG_INFO(("Loaded from MySQL: role `$1` (`$2`), updated on `$3`"),
                       roinfo.roid, roinfo.nickname, roinfo.update_time);
   }
 
+void
+do_invalidate_role_list(const phcow_string& username)
+  {
+    // Agents cache role lists of users. Notify all of them in this zone. This is
+    // a best-effort notification, so there is no need to wait for responses.
+    cow_vector<::poseidon::UUID> multicast_list;
+    for(const auto& r : service.all_service_records())
+      if((r.second.zone_id == service.zone_id()) && (r.second.service_type == "agent"))
+        multicast_list.emplace_back(r.first);
+
+    if(multicast_list.empty())
+      return;
+
+    ::taxon::V_object tx_args;
+    tx_args.try_emplace(&"username", username.rdstr());
+
+    auto srv_q = new_sh<Service_Future>(multicast_list, &"agent/user/invalidate_roles", tx_args);
+    service.launch(srv_q);
+  }
+
+void
+do_update_role_record(const shptr<Implementation>& impl, const Role_Record& roinfo)
+  {
+    // Role lists contain avatars, so they must be invalidated if an avatar has
+    // changed. Other changes are not visible to agents.
+    auto pold = impl->role_records.ptr(roinfo.roid);
+    bool avatar_changed = !pold || (pold->avatar != roinfo.avatar);
+    impl->role_records.insert_or_assign(roinfo.roid, roinfo);
+    impl->save_scheduler.insert(roinfo.roid, steady_clock::now());
+
+    if(avatar_changed)
+      do_invalidate_role_list(roinfo.username);
+  }
+
 void
 do_role_list(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber,
              const ::poseidon::UUID& /*request_service_uuid*/,
@@ -141,7 +206,9 @@ do_role_list(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fibe
     // * Description
     //
     //   Searches the _default_ database for all roles that belong to `username`, and
-    //   returns their avatars. The result is not cached.
+    //   returns their avatars. The result is not cached by the monitor, but may be
+    //   cached by agents, which are notified with `agent/user/invalidate_roles`
+    //   after a role is created or unloaded, or its avatar changes.
 
     ////////////////////////////////////////////////////////////
     //
@@ -172,18 +239,30 @@ do_role_list(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fibe
     for(const auto& row : task1->result_rows()) {
       Role_Record roinfo;
       roinfo.roid = row.at(0).as_integer();      // SELECT `roid`
-      roinfo.avatar = row.at(1).as_blob();       //        , `avatar`
+      roinfo.avatar = blob_decode(row.at(1).as_blob());  //        , `avatar`
       db_records.emplace_back(move(roinfo));
     }
 
     POSEIDON_LOG_INFO(("Found $1 role(s) for user `$2`"), db_records.size(), username);
 
     if(db_records.size() > 0) {
-      // See whether Redis contains unflushed role records.
+      // See whether Redis contains unflushed avatars. Other parts of roles are
+      // not fetched.
+      static constexpr char redis_get_avatars[] =
+          R"!!!(
+            local avatars = {}
+            for k = 1, #KEYS do
+              avatars[k] = redis.call('HGET', KEYS[k], 'avatar')
+            end
+            return avatars
+          )!!!";
+
       cow_vector<cow_string> redis_cmd;
-      redis_cmd.emplace_back(&"MGET");
+      redis_cmd.emplace_back(&"EVAL");
+      redis_cmd.emplace_back(&redis_get_avatars);
+      redis_cmd.emplace_back(sformat("$1", db_records.size()));
       for(size_t k = 0;  k < db_records.size();  ++k)
-        redis_cmd.emplace_back(sformat("$1/role/$2", service.application_name(), db_records.at(k).roid));
+        redis_cmd.emplace_back(sformat("$1/role/$2", service.application_name(), db_records.at(k).roid));  // KEYS[k]
 
       auto task2 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
       ::poseidon::task_scheduler.launch(task2);
@@ -191,7 +270,7 @@ do_role_list(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fibe
 
       for(size_t k = 0;  k < db_records.size();  ++k)
         if(!task2->result().as_array().at(k).is_nil())
-          db_records.at(k).parse_from_string(task2->result().as_array().at(k).as_string());
+          db_records.at(k).avatar = blob_decode(task2->result().as_array().at(k).as_string());
     }
 
     // Encode avatars in an object, and return it.
@@ -301,14 +380,16 @@ do_role_create(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fi
       }
 
       roinfo.nickname = task1->result_row(0).at(0).as_blob();            // SELECT `nickname`
-      roinfo.update_time = task1->result_row(0).at(1).as_system_time();  //        , `update_time`
-      roinfo.avatar = task1->result_row(0).at(2).as_blob();              //        , `avatar`
-      roinfo.profile = task1->result_row(0).at(3).as_blob();             //        , `profile`
-      roinfo.whole = task1->result_row(0).at(4).as_blob();               //        , `whole`
+      roinfo.update_time = task1->result_row(0).at(1).as_system_time();   //        , `update_time`
+      roinfo.avatar = blob_decode(task1->result_row(0).at(2).as_blob());   //        , `avatar`
+      roinfo.profile = blob_decode(task1->result_row(0).at(3).as_blob());  //        , `profile`
+      roinfo.whole = blob_decode(task1->result_row(0).at(4).as_blob());    //        , `whole`
     }
 
     do_store_role_record_into_redis(fiber, roinfo, impl->redis_role_ttl);
     impl->role_records.insert_or_assign(roinfo.roid, roinfo);
+    impl->save_scheduler.insert(roinfo.roid, steady_clock::now());
+    do_invalidate_role_list(roinfo.username);
 
     POSEIDON_LOG_INFO(("Created role `$1` (`$2`)"), roinfo.roid, roinfo.nickname);
 
@@ -378,13 +459,14 @@ do_role_load(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fibe
 
     roinfo.username = task1->result_row(0).at(0).as_blob();            // SELECT `username`
     roinfo.nickname = task1->result_row(0).at(1).as_blob();            //        , `nickname`
-    roinfo.update_time = task1->result_row(0).at(2).as_system_time();  //        , `update_time`
-    roinfo.avatar = task1->result_row(0).at(3).as_blob();              //        , `avatar`
-    roinfo.profile = task1->result_row(0).at(4).as_blob();             //        , `profile`
-    roinfo.whole = task1->result_row(0).at(5).as_blob();               //        , `whole`
+    roinfo.update_time = task1->result_row(0).at(2).as_system_time();   //        , `update_time`
+    roinfo.avatar = blob_decode(task1->result_row(0).at(3).as_blob());   //        , `avatar`
+    roinfo.profile = blob_decode(task1->result_row(0).at(4).as_blob());  //        , `profile`
+    roinfo.whole = blob_decode(task1->result_row(0).at(5).as_blob());    //        , `whole`
 
     do_store_role_record_into_redis(fiber, roinfo, impl->redis_role_ttl);
     impl->role_records.insert_or_assign(roinfo.roid, roinfo);
+    impl->save_scheduler.insert(roinfo.roid, steady_clock::now());
 
     POSEIDON_LOG_INFO(("Loaded role `$1` (`$2`)"), roinfo.roid, roinfo.nickname);
 
@@ -415,9 +497,9 @@ do_store_role_record_into_mysql(::poseidon::Abstract_Fiber& fiber,
     sql_args.emplace_back(roinfo.username.rdstr());   // SET `username` = ?
     sql_args.emplace_back(roinfo.nickname);           //     , `nickname` = ?
     sql_args.emplace_back(roinfo.update_time);        //     , `update_time` = ?
-    sql_args.emplace_back(roinfo.avatar);             //     , `avatar` = ?
-    sql_args.emplace_back(roinfo.profile);            //     , `profile` = ?
-    sql_args.emplace_back(roinfo.whole);              //     , `whole` = ?
+    sql_args.emplace_back(blob_encode(roinfo.avatar));    //     , `avatar` = ?
+    sql_args.emplace_back(blob_encode(roinfo.profile));   //     , `profile` = ?
+    sql_args.emplace_back(blob_encode(roinfo.whole));     //     , `whole` = ?
     sql_args.emplace_back(roinfo.roid);               // WHERE `roid` = ?
 
     auto task1 = new_sh<::poseidon::MySQL_Query_Future>(::poseidon::mysql_connector,
@@ -429,6 +511,141 @@ do_store_role_record_into_mysql(::poseidon::Abstract_Fiber& fiber,
                       roinfo.roid, roinfo.nickname, roinfo.update_time);
   }
 
+void
+do_flush_roles_to_mysql(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber,
+                        ::std::vector<int64_t>& failed_roids, ::std::vector<int64_t>& unsaved_roids,
+                        const ::std::vector<int64_t>& roids)
+  {
+    if(roids.empty())
+      return;
+
+    // Get all roles from Redis in one round trip.
+    static constexpr char redis_get_roles[] =
+        R"!!!(
+          local roles = {}
+          for k = 1, #KEYS do
+            roles[k] = redis.call('HGETALL', KEYS[k])
+          end
+          return roles
+        )!!!";
+
+    cow_vector<cow_string> redis_cmd;
+    redis_cmd.emplace_back(&"EVAL");
+    redis_cmd.emplace_back(&redis_get_roles);
+    redis_cmd.emplace_back(sformat("$1", roids.size()));
+    for(int64_t roid : roids)
+      redis_cmd.emplace_back(sformat("$1/role/$2", service.application_name(), roid));  // KEYS[k]
+
+    auto task2 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
+    ::poseidon::task_scheduler.launch(task2);
+    fiber.yield(task2);
+
+    if(!task2->successful()) {
+      POSEIDON_LOG_ERROR(("Could not get $1 role(s) from Redis"), roids.size());
+      unsaved_roids.insert(unsaved_roids.end(), roids.begin(), roids.end());
+      return;
+    }
+
+    auto mysql_conn = ::poseidon::mysql_connector.allocate_default_connection();
+    cow_string home_db = mysql_conn->service_uri();
+
+    ::std::vector<Role_Record> roinfos;
+    roinfos.reserve(roids.size());
+    for(size_t k = 0;  k != roids.size();  ++k) {
+      const auto& fields = task2->result().as_array().at(k).as_array();
+      if(fields.empty()) {
+        impl->role_records.erase(roids[k]);
+        impl->save_scheduler.erase(roids[k]);
+        failed_roids.push_back(roids[k]);
+        continue;
+      }
+
+      Role_Record roinfo;
+      roinfo.parse_from_redis_hash(fields);
+      if((roinfo._home_host != ::poseidon::hostname) || (roinfo._home_db != home_db)) {
+        failed_roids.push_back(roids[k]);
+        continue;
+      }
+
+      do_update_role_record(impl, roinfo);
+      roinfos.emplace_back(move(roinfo));
+    }
+
+    // Write roles with multi-row statements. Each statement is committed as a
+    // whole, so this saves a lot of commits. Like `monitor/role/flush`, only
+    // existing rows are updated; a role that has been deleted from MySQL is
+    // not recreated from Redis.
+    cow_vector<shptr<::poseidon::MySQL_Query_Future>> tasks;
+    ::std::vector<size_t> task_ends;
+    size_t next = 0;
+    while(next != roinfos.size()) {
+      cow_string stmt = &R"!!!(
+            UPDATE `role` AS `r`
+              JOIN ()!!!";
+
+      cow_vector<::poseidon::MySQL_Value> sql_args;
+      for(uint32_t k = 0;  (k != roles_per_statement) && (next != roinfos.size());  ++k) {
+        if(k == 0)
+          stmt += "SELECT ? AS `roid`, ? AS `username`, ? AS `nickname`, ? AS `update_time`,"
+                  " ? AS `avatar`, ? AS `profile`, ? AS `whole`";
+        else
+          stmt += " UNION ALL SELECT ?, ?, ?, ?, ?, ?, ?";
+
+        const auto& roinfo = roinfos.at(next);
+        sql_args.emplace_back(roinfo.roid);                   // `roid`
+        sql_args.emplace_back(roinfo.username.rdstr());       // `username`
+        sql_args.emplace_back(roinfo.nickname);               // `nickname`
+        sql_args.emplace_back(roinfo.update_time);            // `update_time`
+        sql_args.emplace_back(blob_encode(roinfo.avatar));    // `avatar`
+        sql_args.emplace_back(blob_encode(roinfo.profile));   // `profile`
+        sql_args.emplace_back(blob_encode(roinfo.whole));     // `whole`
+        ++ next;
+      }
+
+      stmt += R"!!!() AS `v`
+                ON `r`.`roid` = `v`.`roid`
+              SET `r`.`username` = `v`.`username`
+                  , `r`.`nickname` = `v`.`nickname`
+                  , `r`.`update_time` = `v`.`update_time`
+                  , `r`.`avatar` = `v`.`avatar`
+                  , `r`.`profile` = `v`.`profile`
+                  , `r`.`whole` = `v`.`whole`
+          )!!!";
+
+      if(!mysql_conn)
+        mysql_conn = ::poseidon::mysql_connector.allocate_default_connection();
+
+      auto task1 = new_sh<::poseidon::MySQL_Query_Future>(::poseidon::mysql_connector,
+                                                          move(mysql_conn), stmt, sql_args);
+      ::poseidon::task_scheduler.launch(task1);
+      tasks.emplace_back(task1);
+      task_ends.push_back(next);
+    }
+
+    if(mysql_conn)
+      ::poseidon::mysql_connector.pool_connection(move(mysql_conn));
+
+    for(const auto& task1 : tasks)
+      fiber.yield(task1);
+
+    // If a statement has failed, none of its roles have been written.
+    size_t unsaved_count = 0;
+    for(size_t k = 0;  k != tasks.size();  ++k)
+      if(!tasks[k]->successful()) {
+        size_t begin = (k == 0) ? 0 : task_ends[k - 1];
+        POSEIDON_LOG_ERROR(("Could not store $1 role(s) into MySQL, starting from `$2`"),
+                           task_ends[k] - begin, roinfos.at(begin).roid);
+
+        for(size_t i = begin;  i != task_ends[k];  ++i)
+          unsaved_roids.push_back(roinfos.at(i).roid);
+        unsaved_count += task_ends[k] - begin;
+      }
+
+    POSEIDON_LOG_INFO(("#sav# Stored into MySQL: $1 role(s) in $2 batch(es), $3 failed, $4 unsaved"),
+                      roinfos.size() - unsaved_count, tasks.size(), failed_roids.size(),
+                      unsaved_count);
+  }
+
 void
 do_role_unload(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber,
                const ::poseidon::UUID& /*request_service_uuid*/,
@@ -456,25 +673,28 @@ do_role_unload(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fi
     ////////////////////////////////////////////////////////////
     //
     cow_vector<cow_string> redis_cmd;
-    redis_cmd.emplace_back(&"GET");
+    redis_cmd.emplace_back(&"HGETALL");
     redis_cmd.emplace_back(sformat("$1/role/$2", service.application_name(), roid));
 
     auto task2 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
     ::poseidon::task_scheduler.launch(task2);
     fiber.yield(task2);
 
-    if(task2->result().is_nil()) {
+    if(task2->result().as_array().empty()) {
       impl->role_records.erase(roid);
+      impl->save_scheduler.erase(roid);
       response.try_emplace(&"status", &"gs_role_not_loaded");
       return;
     }
 
     // Write role information to MySQL. This is a slow operation, and data may
     // change when it is being executed. Therefore we will have to verify that
-    // the value on Redis is unchanged before deleting it safely.
+    // the value on Redis is unchanged before deleting it safely. As the update
+    // time is updated by every write, comparing heads is sufficient.
     Role_Record roinfo;
     do {
-      roinfo.parse_from_string(task2->result().as_string());
+      roinfo.parse_from_redis_hash(task2->result().as_array());
+      cow_string head = do_find_redis_hash_field(task2->result().as_array(), "head");
 
       auto mysql_conn = ::poseidon::mysql_connector.allocate_default_connection();
       if((roinfo._home_host != ::poseidon::hostname) || (roinfo._home_db != mysql_conn->service_uri())) {
@@ -487,13 +707,12 @@ do_role_unload(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fi
 
       static constexpr char redis_delete_if_unchanged[] =
           R"!!!(
-            local value = redis.call('GET', KEYS[1])
-            if value == ARGV[1] then
-              redis.call('DEL', KEYS[1])
-              return nil
-            else
-              return value
+            local head = redis.call('HGET', KEYS[1], 'head')
+            if head and head ~= ARGV[1] then
+              return redis.call('HGETALL', KEYS[1])
             end
+            redis.call('DEL', KEYS[1])
+            return nil
           )!!!";
 
       redis_cmd.clear();
@@ -501,7 +720,7 @@ do_role_unload(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fi
       redis_cmd.emplace_back(&redis_delete_if_unchanged);
       redis_cmd.emplace_back(&"1");   // one key
       redis_cmd.emplace_back(sformat("$1/role/$2", service.application_name(), roinfo.roid));  // KEYS[1]
-      redis_cmd.emplace_back(task2->result().as_string());  // ARGV[1]
+      redis_cmd.emplace_back(head);  // ARGV[1]
 
       task2 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
       ::poseidon::task_scheduler.launch(task2);
@@ -510,6 +729,8 @@ do_role_unload(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fi
       // Check whether the value was unchanged in between and has been deleted.
     } while(!task2->result().is_nil());
     impl->role_records.erase(roid);
+    impl->save_scheduler.erase(roid);
+    do_invalidate_role_list(roinfo.username);
 
     POSEIDON_LOG_INFO(("Unloaded role `$1` (`$2`)"), roinfo.roid, roinfo.nickname);
 
@@ -545,22 +766,23 @@ do_role_flush(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fib
     POSEIDON_LOG_INFO(("#sav# Flushing role `$1`"), roid);
 
     cow_vector<cow_string> redis_cmd;
-    redis_cmd.emplace_back(&"GET");
+    redis_cmd.emplace_back(&"HGETALL");
     redis_cmd.emplace_back(sformat("$1/role/$2", service.application_name(), roid));
 
     auto task2 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
     ::poseidon::task_scheduler.launch(task2);
     fiber.yield(task2);
 
-    if(task2->result().is_nil()) {
+    if(task2->result().as_array().empty()) {
       impl->role_records.erase(roid);
+      impl->save_scheduler.erase(roid);
       response.try_emplace(&"status", &"gs_role_not_loaded");
       return;
     }
 
     // Write a snapshot of role information to MySQL.
     Role_Record roinfo;
-    roinfo.parse_from_string(task2->result().as_string());
+    roinfo.parse_from_redis_hash(task2->result().as_array());
 
     auto mysql_conn = ::poseidon::mysql_connector.allocate_default_connection();
     if((roinfo._home_host != ::poseidon::hostname) || (roinfo._home_db != mysql_conn->service_uri())) {
@@ -569,7 +791,7 @@ do_role_flush(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fib
       return;
     }
 
-    impl->role_records.insert_or_assign(roinfo.roid, roinfo);
+    do_update_role_record(impl, roinfo);
     do_store_role_record_into_mysql(fiber, move(mysql_conn), roinfo);
 
     POSEIDON_LOG_INFO(("Flushed role `$1` (`$2`)"), roinfo.roid, roinfo.nickname);
@@ -578,60 +800,88 @@ do_role_flush(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fib
   }
 
 void
-do_save_timer_callback(const shptr<Implementation>& impl,
-                       const shptr<::poseidon::Abstract_Timer>& /*timer*/,
-                       ::poseidon::Abstract_Fiber& fiber, steady_time /*now*/)
+do_role_flush_multi(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber,
+                    const ::poseidon::UUID& /*request_service_uuid*/,
+                    ::taxon::V_object& response, const ::taxon::V_object& request)
   {
-    if(impl->db_ready == false) {
-      // Check tables.
-      do_mysql_check_table_role(fiber);
-      impl->db_ready = true;
-    }
+    // * Request Parameters
+    //
+    //   - `roid_list` <sub>array of integers</sub> : IDs of roles to flush.
+    //
+    // * Response Parameters
+    //
+    //   - `status` <sub>string</sub> : [General status code.](#general-status-codes)
+    //   - `failed_roid_list` <sub>array of integers</sub> : IDs of roles that have
+    //     not been loaded, or belong to another server.
+    //   - `unsaved_roid_list` <sub>array of integers</sub> : IDs of roles that could
+    //     not be written because of database errors. These may be retried later.
+    //
+    // * Description
+    //
+    //   Writes roles back into the database. Roles are written with multi-row
+    //   statements, which is much faster than `monitor/role/flush` on each of
+    //   them. As with `monitor/role/flush`, roles that don't exist in the database
+    //   are not created.
 
-    if(impl->save_buckets.empty()) {
-      // Arrange online roles for writing. Initially, users are divided into 20
-      // buckets. For each timer tick, one bucket will be popped and written.
-      while(impl->save_buckets.size() < 20)
-        impl->save_buckets.emplace_back();
-
-      for(const auto& r : impl->role_records) {
-        auto current_bucket = impl->save_buckets.begin();
-        impl->save_buckets.splice(impl->save_buckets.end(), impl->save_buckets, current_bucket);
-        if(current_bucket->size() >= current_bucket->capacity()) {
-          ptrdiff_t sp = static_cast<ptrdiff_t>(current_bucket->capacity() / 2);
-          impl->save_buckets.emplace_back(current_bucket->move_begin(), current_bucket->move_begin() + sp);
-          current_bucket->erase(current_bucket->begin(), current_bucket->begin() + sp);
-        }
-        current_bucket->push_back(r.first);
-      }
+    ////////////////////////////////////////////////////////////
+    //
+    ::std::vector<int64_t> roids;
+    for(const auto& r : request.at(&"roid_list").as_array()) {
+      POSEIDON_CHECK((r.as_integer() >= 1) && (r.as_integer() <= 8'99999'99999'99999));
+      roids.push_back(r.as_integer());
     }
 
-    auto bucket = move(impl->save_buckets.back());
-    impl->save_buckets.pop_back();
-    while(!bucket.empty()) {
-      int64_t roid = bucket.back();
-      bucket.pop_back();
+    POSEIDON_CHECK(impl->db_ready);
 
-      cow_vector<cow_string> redis_cmd;
-      redis_cmd.emplace_back(&"GET");
-      redis_cmd.emplace_back(sformat("$1/role/$2", service.application_name(), roid));
+    ////////////////////////////////////////////////////////////
+    //
+    ::std::vector<int64_t> failed_roids, unsaved_roids;
+    do_flush_roles_to_mysql(impl, fiber, failed_roids, unsaved_roids, roids);
 
-      auto task2 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
-      ::poseidon::task_scheduler.launch(task2);
-      fiber.yield(task2);
+    ::taxon::V_array failed_roid_list;
+    for(int64_t roid : failed_roids)
+      failed_roid_list.emplace_back(roid);
 
-      if(task2->result().is_nil()) {
-        impl->role_records.erase(roid);
-        continue;
-      }
+    ::taxon::V_array unsaved_roid_list;
+    for(int64_t roid : unsaved_roids)
+      unsaved_roid_list.emplace_back(roid);
 
-      // Write a snapshot of role information to MySQL.
-      Role_Record roinfo;
-      roinfo.parse_from_string(task2->result().as_string());
+    response.try_emplace(&"failed_roid_list", failed_roid_list);
+    response.try_emplace(&"unsaved_roid_list", unsaved_roid_list);
+    response.try_emplace(&"status", &"gs_ok");
+  }
 
-      impl->role_records.insert_or_assign(roinfo.roid, roinfo);
-      do_store_role_record_into_mysql(fiber, nullptr, roinfo);
+void
+do_save_timer_callback(const shptr<Implementation>& impl,
+                       const shptr<::poseidon::Abstract_Timer>& /*timer*/,
+                       ::poseidon::Abstract_Fiber& fiber, steady_time /*now*/)
+  {
+    if(impl->db_ready == false) {
+      // Check tables.
+      do_mysql_check_table_role(fiber);
+      impl->db_ready = true;
     }
+
+    // Copy roles that are due from Redis to MySQL. Roles in Redis are always
+    // up to date, so these are only snapshots, and are never urgent. Roles that
+    // belong to other servers are left alone.
+    steady_time save_start_time = steady_clock::now();
+    ::std::vector<int64_t> roids;
+    impl->save_scheduler.pop_due(roids, save_start_time);
+
+    ::std::vector<int64_t> failed_roids, unsaved_roids;
+    do_flush_roles_to_mysql(impl, fiber, failed_roids, unsaved_roids, roids);
+
+    // Retry roles that could not be written.
+    for(int64_t roid : unsaved_roids)
+      impl->save_scheduler.mark_dirty(roid, steady_clock::now());
+
+    if(!roids.empty())
+      POSEIDON_LOG_INFO(("#sav# Saved into MySQL: $1 role(s), total $2 ms; $3 due, lag $4 ms"),
+                        roids.size(),
+                        duration_cast<milliseconds>(steady_clock::now() - save_start_time).count(),
+                        impl->save_scheduler.count_due(save_start_time),
+                        impl->save_scheduler.lag(save_start_time).count());
   }
 
 }  // namespace
@@ -686,8 +936,17 @@ reload(const ::poseidon::Config_File& conf_file)
     seconds redis_role_ttl = seconds(static_cast<int>(conf_file.get_integer_opt(
                                     &"redis_role_ttl", 600, 999999999).value_or(900)));
 
+    // `monitor.save_rate_limit`
+    uint32_t save_rate_limit = static_cast<uint32_t>(conf_file.get_integer_opt(
+                                    &"monitor.save_rate_limit", 1, 999999).value_or(100)));
+
+    // `monitor.save_max_staleness`
+    seconds save_max_staleness = seconds(static_cast<int>(conf_file.get_integer_opt(
+                                    &"monitor.save_max_staleness", 1, 86400).value_or(200)));
+
     // Set up new configuration. This operation shall be atomic.
     this->m_impl->redis_role_ttl = redis_role_ttl;
+    this->m_impl->save_scheduler.set_limits(save_rate_limit, save_max_staleness);
 
     // Set up request handlers.
     service.set_handler(&"monitor/role/list", bindw(this->m_impl, do_role_list));
@@ -695,9 +954,10 @@ reload(const ::poseidon::Config_File& conf_file)
     service.set_handler(&"monitor/role/load", bindw(this->m_impl, do_role_load));
     service.set_handler(&"monitor/role/unload", bindw(this->m_impl, do_role_unload));
     service.set_handler(&"monitor/role/flush", bindw(this->m_impl, do_role_flush));
+    service.set_handler(&"monitor/role/flush_multi", bindw(this->m_impl, do_role_flush_multi));
 
     // Restart the service.
-    this->m_impl->save_timer.start(100ms, 11001ms, bindw(this->m_impl, do_save_timer_callback));
+    this->m_impl->save_timer.start(100ms, 1001ms, bindw(this->m_impl, do_save_timer_callback));
   }
 
 }  // namespace k32::monitor
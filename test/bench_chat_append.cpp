@@ -0,0 +1,101 @@
+// This file is part of k32.
+// Copyright (C) 2024-2026 LH_Mouse. All wrongs reserved.
+
+#include "../k32/xprecompiled.hpp"
+#include "utils.hpp"
+#include "../k32/common/base/ring_buffer.hpp"
+using namespace ::k32;
+
+namespace {
+
+// These mirror `chat/thread/append`.
+constexpr size_t messages_per_segment = 100;
+constexpr size_t appends_per_run = 20000;
+
+using Message = ::std::pair<system_time, cow_string>;
+
+struct Vector_Thread
+  {
+    cow_vector<Message> messages;
+  };
+
+struct Ring_Thread
+  {
+    Ring_Buffer<Message> messages;
+  };
+
+double
+do_appends_per_second(steady_clock::duration elapsed)
+  {
+    return static_cast<double>(appends_per_run) / duration_cast<duration<double>>(elapsed).count();
+  }
+
+double
+do_bench_vector_copy(size_t max_messages, const cow_string& payload)
+  {
+    // This is how threads were appended to before ring buffers: the thread was
+    // copied out of the cache, truncated, appended to, and assigned back.
+    cow_dictionary<Vector_Thread> threads;
+    threads.try_emplace(&"bench", Vector_Thread());
+
+    auto start = steady_clock::now();
+    for(size_t n = 0;  n != appends_per_run;  ++n) {
+      Vector_Thread thread;
+      threads.find_and_copy(thread, &"bench");
+
+      if(thread.messages.size() >= max_messages + messages_per_segment)
+        thread.messages.erase(0, (thread.messages.size() - max_messages)
+                                 / messages_per_segment * messages_per_segment);
+
+      thread.messages.emplace_back(system_time(milliseconds(n)), payload);
+      threads.insert_or_assign(&"bench", move(thread));
+    }
+    auto elapsed = steady_clock::now() - start;
+
+    K32_TEST_CHECK(threads.at(&"bench").messages.size() < max_messages + messages_per_segment);
+    return do_appends_per_second(elapsed);
+  }
+
+double
+do_bench_ring_in_place(size_t max_messages, const cow_string& payload)
+  {
+    // This is how `chat/thread/append` works now: the cached thread is modified
+    // in place, and whole segments are popped from the front.
+    cow_dictionary<Ring_Thread> threads;
+    threads.try_emplace(&"bench", Ring_Thread());
+
+    auto start = steady_clock::now();
+    for(size_t n = 0;  n != appends_per_run;  ++n) {
+      auto& thread = threads.mut(&"bench");
+
+      if(thread.messages.size() >= max_messages + messages_per_segment)
+        thread.messages.pop_front((thread.messages.size() - max_messages)
+                                  / messages_per_segment * messages_per_segment);
+
+      thread.messages.emplace_back(system_time(milliseconds(n)), payload);
+    }
+    auto elapsed = steady_clock::now() - start;
+
+    K32_TEST_CHECK(threads.at(&"bench").messages.size() < max_messages + messages_per_segment);
+    K32_TEST_CHECK(threads.at(&"bench").messages.end_position() == appends_per_run);
+    return do_appends_per_second(elapsed);
+  }
+
+}  // namespace
+
+int
+main()
+  {
+    // Appends per second, versus the maximum number of messages per thread,
+    // which is `chat.max_number_of_messages_per_thread` in 'k32.conf'.
+    cow_string payload = &R"({"from":"bench","text":"The quick brown fox jumps over the lazy dog."})";
+    static constexpr size_t sizes[] = { 100, 1000, 5000, 10000, 20000 };
+
+    ::printf("%10s  %16s  %16s  %8s\n", "messages", "vector+copy/s", "ring+in-place/s", "speedup");
+    for(size_t max_messages : sizes) {
+      double old_rate = do_bench_vector_copy(max_messages, payload);
+      double new_rate = do_bench_ring_in_place(max_messages, payload);
+      ::printf("%10zu  %16.0f  %16.0f  %7.1fx\n", max_messages, old_rate, new_rate,
+               new_rate / old_rate);
+    }
+  }
@@ -0,0 +1,171 @@
+// This file is part of k32.
+// Copyright (C) 2024-2026 LH_Mouse. All wrongs reserved.
+
+#include "../k32/xprecompiled.hpp"
+#define K32_FRIENDS_3543B0B1_DC5A_4F34_B9BB_CAE513821771_
+#define K32_FRIENDS_A40BD99F_5E7D_486F_A905_656CBDBE52AB_
+#include "utils.hpp"
+#include "../k32/common/data/role_record.hpp"
+#include "../k32/common/data/chat_thread.hpp"
+using namespace ::k32;
+
+namespace {
+
+constexpr size_t iterations = 2000;
+
+void
+do_print_result(const char* name, size_t size, steady_clock::duration encode_time,
+                steady_clock::duration decode_time)
+  {
+    ::printf("%-24s  %10zu  %14.0f  %14.0f\n", name, size,
+             static_cast<double>(iterations) / duration_cast<duration<double>>(encode_time).count(),
+             static_cast<double>(iterations) / duration_cast<duration<double>>(decode_time).count());
+  }
+
+Role_Record
+do_make_role()
+  {
+    Role_Record role;
+    role.roid = 1234567;
+    role.username = &"bench_user";
+    role.nickname = &"Bench Role";
+    role.update_time = system_clock::now();
+    role.avatar = &R"({"class":3,"level":87,"skin":[12,4,7,0,19]})";
+
+    role.profile = &R"({"guild":"Bench Guild","titles":[)";
+    for(int k = 0;  k != 50;  ++k)
+      role.profile += sformat("$1{\"id\":$2,\"time\":$3}", (k == 0) ? "" : ",", k, 1700000000 + k);
+    role.profile += "]}";
+
+    role.whole = &R"({"bag":[)";
+    for(int k = 0;  k != 2000;  ++k)
+      role.whole += sformat("$1{\"item\":$2,\"count\":$3,\"bound\":false}", (k == 0) ? "" : ",", k, k % 99);
+    role.whole += "]}";
+
+    role._home_host = &"mysql-bench";
+    role._home_db = &"k32_bench";
+    role._home_zone = 7;
+    return role;
+  }
+
+cow_string
+do_role_to_json(const Role_Record& role)
+  {
+    // This builds a tree of values, as the taxon path does, and prints it as JSON.
+    ::taxon::V_object root;
+    root.try_emplace(&"roid", role.roid);
+    root.try_emplace(&"username", role.username.rdstr());
+    root.try_emplace(&"nickname", role.nickname);
+    root.try_emplace(&"update_time", role.update_time);
+    root.try_emplace(&"avatar", role.avatar);
+    root.try_emplace(&"profile", role.profile);
+    root.try_emplace(&"whole", role.whole);
+    root.try_emplace(&"@home_host", role._home_host);
+    root.try_emplace(&"@home_db", role._home_db);
+    root.try_emplace(&"@home_zone", static_cast<int64_t>(role._home_zone));
+    return ::taxon::Value(root).to_string();
+  }
+
+void
+do_role_from_json(Role_Record& role, const cow_string& str)
+  {
+    ::taxon::Value temp_value;
+    POSEIDON_CHECK(temp_value.parse(str));
+    ::taxon::V_object root = temp_value.as_object();
+    temp_value.clear();
+
+    role.roid = root.at(&"roid").as_integer();
+    role.username = root.at(&"username").as_string();
+    role.nickname = root.at(&"nickname").as_string();
+    role.update_time = root.at(&"update_time").as_time();
+    role.avatar = root.at(&"avatar").as_string();
+    role.profile = root.at(&"profile").as_string();
+    role.whole = root.at(&"whole").as_string();
+    role._home_host = root.at(&"@home_host").as_string();
+    role._home_db = root.at(&"@home_db").as_string();
+    role._home_zone = static_cast<int>(root.at(&"@home_zone").as_integer());
+  }
+
+Chat_Thread
+do_make_thread()
+  {
+    Chat_Thread thread;
+    thread.thread_key = &"bench_thread";
+    thread.update_time = system_clock::now();
+    for(int k = 0;  k != 100;  ++k)
+      thread.messages.emplace_back(time_point_cast<milliseconds>(thread.update_time),
+                                   sformat("{\"from\":\"user_$1\",\"text\":\"Message #$1\"}", k));
+    return thread;
+  }
+
+cow_string
+do_thread_to_json(const Chat_Thread& thread)
+  {
+    // This is how threads were stored before MessagePack.
+    ::taxon::V_object root;
+    root.try_emplace(&"thread_key", thread.thread_key.rdstr());
+    root.try_emplace(&"update_time", thread.update_time);
+
+    auto pa = &(root.open(&"messages").open_array());
+    for(const auto& msg : thread.messages) {
+      auto& sub = pa->emplace_back().open_array();
+      sub.emplace_back(msg.first);
+      sub.emplace_back(msg.second);
+    }
+    return ::taxon::Value(root).to_string();
+  }
+
+template<typename xRecord, typename xEncode, typename xDecode>
+void
+do_bench(const char* name, const xRecord& record, xEncode&& encode, xDecode&& decode)
+  {
+    cow_string str;
+    auto start = steady_clock::now();
+    for(size_t n = 0;  n != iterations;  ++n)
+      str = encode(record);
+    auto encode_time = steady_clock::now() - start;
+
+    xRecord other = xRecord::null;
+    start = steady_clock::now();
+    for(size_t n = 0;  n != iterations;  ++n)
+      decode(other, str);
+    auto decode_time = steady_clock::now() - start;
+
+    do_print_result(name, str.size(), encode_time, decode_time);
+  }
+
+}  // namespace
+
+int
+main()
+  {
+    ::printf("%-24s  %10s  %14s  %14s\n", "codec", "bytes", "encodes/s", "decodes/s");
+
+    Role_Record role = do_make_role();
+    do_bench("Role_Record taxon JSON", role, do_role_to_json, do_role_from_json);
+    do_bench("Role_Record MessagePack", role,
+        [](const Role_Record& r) { return r.serialize_to_string();  },
+        [](Role_Record& r, const cow_string& s) { r.parse_from_string(s);  });
+
+    // Check that both paths produce the same record.
+    Role_Record role2 = Role_Record::null;
+    role2.parse_from_string(role.serialize_to_string());
+    K32_TEST_CHECK(role2.roid == role.roid);
+    K32_TEST_CHECK(role2.whole == role.whole);
+    do_role_from_json(role2, do_role_to_json(role));
+    K32_TEST_CHECK(role2.whole == role.whole);
+
+    Chat_Thread thread = do_make_thread();
+    do_bench("Chat_Thread taxon JSON", thread, do_thread_to_json,
+        [](Chat_Thread& t, const cow_string& s) { t.parse_from_string(s);  });
+    do_bench("Chat_Thread MessagePack", thread,
+        [](const Chat_Thread& t) { return t.serialize_to_string();  },
+        [](Chat_Thread& t, const cow_string& s) { t.parse_from_string(s);  });
+
+    // Legacy JSON is still parsed by `Chat_Thread::parse_from_string()`.
+    Chat_Thread thread2 = Chat_Thread::null;
+    thread2.parse_from_string(do_thread_to_json(thread));
+    K32_TEST_CHECK(thread2.messages.size() == thread.messages.size());
+    thread2.parse_from_string(thread.serialize_to_string());
+    K32_TEST_CHECK(thread2.messages.size() == thread.messages.size());
+  }
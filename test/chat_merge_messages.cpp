@@ -0,0 +1,133 @@
+// This file is part of k32.
+// Copyright (C) 2024-2026 LH_Mouse. All wrongs reserved.
+
+#include "../k32/xprecompiled.hpp"
+#define K32_FRIENDS_A40BD99F_5E7D_486F_A905_656CBDBE52AB_
+#include "utils.hpp"
+#include "../k32/common/data/chat_thread.hpp"
+using namespace ::k32;
+
+namespace {
+
+void
+do_add_messages(Chat_Thread& thread, const char* prefix, ::std::initializer_list<int> times)
+  {
+    for(int t : times) {
+      char payload[32];
+      ::snprintf(payload, sizeof(payload), "%s%d_%zu", prefix, t, thread.messages.size());
+      thread.messages.emplace_back(system_time(milliseconds(1000000 + t)), cow_string(payload));
+    }
+  }
+
+int
+do_get_message_time(const cow_string& payload)
+  {
+    // Payloads are a one-letter prefix, the timestamp, and an index.
+    return static_cast<int>(::strtol(payload.c_str() + 1, nullptr, 10));
+  }
+
+void
+do_check_paging(const ::std::vector<const Chat_Thread*>& threads, size_t max_per_thread,
+                size_t limit, size_t expected_count)
+  {
+    // Page through all threads, passing the timestamp of the last message back,
+    // and check that every message is returned exactly once, in order of time
+    // across all threads.
+    ::std::vector<cow_string> received;
+    system_time since;
+    system_time prev_time;
+    for(size_t pages = 0;  ;  ++pages) {
+      K32_TEST_CHECK(pages <= expected_count);
+
+      ::taxon::V_array payloads;
+      system_time last_time;
+      bool has_more = chat_merge_messages(payloads, last_time, threads, since, max_per_thread, limit);
+      for(const auto& r : payloads)
+        received.emplace_back(r.as_string());
+
+      if(!has_more)
+        break;
+
+      // Each page must make progress.
+      K32_TEST_CHECK(payloads.size() >= limit);
+      K32_TEST_CHECK(last_time > since);
+      K32_TEST_CHECK(last_time >= prev_time);
+      prev_time = last_time;
+      since = last_time;
+    }
+
+    K32_TEST_CHECK(received.size() == expected_count);
+    for(size_t i = 1;  i < received.size();  ++i)
+      K32_TEST_CHECK(do_get_message_time(received[i - 1]) <= do_get_message_time(received[i]));
+
+    for(size_t i = 0;  i != received.size();  ++i)
+      for(size_t j = i + 1;  j != received.size();  ++j)
+        K32_TEST_CHECK(received[i] != received[j]);
+  }
+
+}  // namespace
+
+int
+main()
+  {
+    Chat_Thread a;
+    a.thread_key = &"a";
+    do_add_messages(a, "a", { 1, 2, 2, 2, 3, 5, 5, 8 });
+
+    Chat_Thread b;
+    b.thread_key = &"b";
+    do_add_messages(b, "b", { 2, 4, 4, 5, 6, 9 });
+
+    Chat_Thread c;
+    c.thread_key = &"c";
+
+    // Single thread with distinct timestamps; this used to repeat forever.
+    Chat_Thread d;
+    d.thread_key = &"d";
+    do_add_messages(d, "d", { 1, 2 });
+    do_check_paging({ &d }, 100, 1, 2);
+
+    static constexpr size_t limits[] = { 1, 2, 3, 5, 100 };
+    for(size_t limit : limits) {
+      do_check_paging({ &a }, 100, limit, 8);
+      do_check_paging({ &a, &b, &c }, 100, limit, 14);
+    }
+
+    // Only the last messages of each thread are considered.
+    do_check_paging({ &a, &b }, 3, 1, 6);
+
+    // Messages with the same timestamp in different threads are not separated
+    // by a page boundary.
+    Chat_Thread e;
+    e.thread_key = &"e";
+    do_add_messages(e, "e", { 10, 20, 20 });
+
+    Chat_Thread f;
+    f.thread_key = &"f";
+    do_add_messages(f, "f", { 20, 20, 30 });
+
+    for(size_t limit : limits)
+      do_check_paging({ &e, &f }, 100, limit, 6);
+
+    ::taxon::V_array page;
+    system_time page_time;
+    K32_TEST_CHECK(chat_merge_messages(page, page_time, { &e, &f }, system_time(), 100, 2));
+    K32_TEST_CHECK(page.size() == 5);
+    K32_TEST_CHECK(page_time == system_time(milliseconds(1000020)));
+    K32_TEST_CHECK(do_get_message_time(page.at(0).as_string()) == 10);
+    for(size_t i = 1;  i != page.size();  ++i)
+      K32_TEST_CHECK(do_get_message_time(page.at(i).as_string()) == 20);
+
+    page.clear();
+    K32_TEST_CHECK(!chat_merge_messages(page, page_time, { &e, &f }, page_time, 100, 2));
+    K32_TEST_CHECK(page.size() == 1);
+    K32_TEST_CHECK(do_get_message_time(page.at(0).as_string()) == 30);
+
+    // Messages up to `since` are excluded, including those at `since`.
+    ::taxon::V_array payloads;
+    system_time last_time;
+    K32_TEST_CHECK(!chat_merge_messages(payloads, last_time, { &a, &b },
+                                        system_time(milliseconds(1000005)), 100, 100));
+    K32_TEST_CHECK(payloads.size() == 3);
+    K32_TEST_CHECK(last_time == system_time(milliseconds(1000009)));
+  }
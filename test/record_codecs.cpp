@@ -0,0 +1,113 @@
+// This file is part of k32.
+// Copyright (C) 2024-2026 LH_Mouse. All wrongs reserved.
+
+#include "../k32/xprecompiled.hpp"
+#define K32_FRIENDS_3543B0B1_DC5A_4F34_B9BB_CAE513821771_
+#define K32_FRIENDS_A40BD99F_5E7D_486F_A905_656CBDBE52AB_
+#include "utils.hpp"
+#include "../k32/common/data/role_record.hpp"
+#include "../k32/common/data/chat_thread.hpp"
+#include "../k32/common/base/blob_codec.hpp"
+using namespace ::k32;
+
+namespace {
+
+uint64_t random_state = 0x9E3779B97F4A7C15;
+
+cow_string
+do_random_string(size_t size)
+  {
+    // These bytes don't compress, so encoded records are stored as is.
+    cow_string str;
+    for(size_t k = 0;  k != size;  ++k) {
+      random_state = random_state * 6364136223846793005 + 1442695040888963407;
+      str.push_back(static_cast<char>(random_state >> 56));
+    }
+    return str;
+  }
+
+void
+do_check_role(const Role_Record& role)
+  {
+    Role_Record other = Role_Record::null;
+    other.parse_from_string(role.serialize_to_string());
+    K32_TEST_CHECK(other.roid == role.roid);
+    K32_TEST_CHECK(other.username == role.username);
+    K32_TEST_CHECK(other.nickname == role.nickname);
+    K32_TEST_CHECK(other.update_time == role.update_time);
+    K32_TEST_CHECK(other.avatar == role.avatar);
+    K32_TEST_CHECK(other.profile == role.profile);
+    K32_TEST_CHECK(other.whole == role.whole);
+    K32_TEST_CHECK(other._home_host == role._home_host);
+    K32_TEST_CHECK(other._home_db == role._home_db);
+    K32_TEST_CHECK(other._home_zone == role._home_zone);
+
+    Role_Record head = Role_Record::null;
+    head.parse_head_from_string(role.serialize_head_to_string());
+    K32_TEST_CHECK(head.roid == role.roid);
+    K32_TEST_CHECK(head.nickname == role.nickname);
+  }
+
+void
+do_check_thread(const Chat_Thread& thread)
+  {
+    Chat_Thread other = Chat_Thread::null;
+    other.parse_from_string(thread.serialize_to_string());
+    K32_TEST_CHECK(other.thread_key == thread.thread_key);
+    K32_TEST_CHECK(other.update_time == thread.update_time);
+    K32_TEST_CHECK(other.messages.size() == thread.messages.size());
+    for(size_t k = 0;  k != thread.messages.size();  ++k) {
+      K32_TEST_CHECK(other.messages[k].first == thread.messages[k].first);
+      K32_TEST_CHECK(other.messages[k].second == thread.messages[k].second);
+    }
+  }
+
+}  // namespace
+
+int
+main()
+  {
+    system_time now = time_point_cast<milliseconds>(system_clock::now());
+
+    // A role whose data compress well.
+    Role_Record role;
+    role.roid = 1234567;
+    role.username = &"test_user";
+    role.nickname = &"Test Role";
+    role.update_time = now;
+    role.avatar = &R"({"class":3,"level":87})";
+    role.profile = &R"({"titles":[1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1]})";
+    role.whole = &R"({"bag":[0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0]})";
+    role._home_host = &"mysql";
+    role._home_db = &"k32";
+    role._home_zone = 7;
+    K32_TEST_CHECK(blob_is_encoded(role.serialize_to_string()));
+    do_check_role(role);
+
+    // A role whose data don't compress.
+    role.avatar = do_random_string(100);
+    role.profile = do_random_string(1000);
+    role.whole = do_random_string(10000);
+    K32_TEST_CHECK(!blob_is_encoded(role.serialize_to_string()));
+    do_check_role(role);
+
+    // A thread whose messages compress well.
+    Chat_Thread thread;
+    thread.thread_key = &"test_thread";
+    thread.update_time = now;
+    for(int k = 0;  k != 100;  ++k)
+      thread.messages.emplace_back(now + milliseconds(k), &R"({"text":"hello"})");
+    K32_TEST_CHECK(blob_is_encoded(thread.serialize_to_string()));
+    do_check_thread(thread);
+
+    // A thread whose messages don't compress.
+    thread.messages.clear();
+    for(int k = 0;  k != 100;  ++k)
+      thread.messages.emplace_back(now + milliseconds(k), do_random_string(200));
+    K32_TEST_CHECK(!blob_is_encoded(thread.serialize_to_string()));
+    do_check_thread(thread);
+
+    // An empty thread is too short to compress.
+    thread.messages.clear();
+    do_check_thread(thread);
+  }
@@ -0,0 +1,17 @@
+// This file is part of k32.
+// Copyright (C) 2024-2026 LH_Mouse. All wrongs reserved.
+
+#ifndef K32_TEST_UTILS_
+#define K32_TEST_UTILS_
+
+#include "../k32/fwd.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define K32_TEST_CHECK(...)  \
+    ((__VA_ARGS__) ? (void) 0  \
+      : (::fprintf(stderr, "%s:%d: test check failed: %s\n",  \
+                   __FILE__, __LINE__, #__VA_ARGS__),  \
+         ::abort()))
+
+#endif